@@ -0,0 +1,219 @@
+/*********************************************************************/
+/* @file abr.c                                                       */
+/*                                                                   */
+/* @brief Bitrate adaptation policies. Each takes what the proxy     */
+/*        knows about a client (its video's ladder, its estimated    */
+/*        throughput and player buffer, the rung it was last on) and */
+/*        returns the rung its next fragment should be fetched at.   */
+/*        Policies keep no state of their own, so any worker may run */
+/*        any of them on any client.                                 */
+/*********************************************************************/
+
+#include <math.h>
+#include <strings.h>
+
+#include "abr.h"
+
+static int abr_below(const struct abr_in* in, double rate);
+static int abr_rate(const struct abr_in* in);
+static int abr_bola(const struct abr_in* in);
+static int abr_mpc (const struct abr_in* in);
+
+/* Indexed by ABR_RATE, ABR_BOLA, ABR_MPC */
+static int (* const policies[])(const struct abr_in*) = {
+  abr_rate, abr_bola, abr_mpc
+};
+
+/* @returns ABR_RATE, ABR_BOLA or ABR_MPC from its name, -1 if none. */
+int abr_policy(const char* name)
+{
+  if(!strcasecmp(name, "rate"))
+    return ABR_RATE;
+
+  if(!strcasecmp(name, "bola"))
+    return ABR_BOLA;
+
+  if(!strcasecmp(name, "mpc"))
+    return ABR_MPC;
+
+  return -1;
+}
+
+/*******************************************************************/
+/* @brief Picks the rung of in->ladder the next fragment should be  */
+/*        fetched at, no higher than in->cap.                       */
+/* @returns its index, -1 if the policy would rather not say.       */
+/*******************************************************************/
+int abr_pick(int policy, const struct abr_in* in)
+{
+  int pick;
+
+  if(in->n == 0)
+    return -1;
+
+  pick = policies[policy](in);
+
+  if(in->cap > 0 && pick >= 0 &&
+     (unsigned long long) in->ladder[pick] > in->cap)
+    pick = abr_below(in, in->cap);
+
+  return pick;
+}
+
+/* @returns the highest rung at most rate, 0 if there is none. */
+static int abr_below(const struct abr_in* in, double rate)
+{
+  int lo = 0, hi = in->n - 1, mid, pick = 0;
+
+  while(lo <= hi)
+    {
+      mid = lo + (hi - lo) / 2;
+
+      if(in->ladder[mid] <= rate)
+        {
+          pick = mid;
+          lo   = mid + 1;
+        }
+      else
+        hi = mid - 1;
+    }
+
+  return pick;
+}
+
+/* The highest rung that tput sustains with half as much again to */
+/* spare; -1 if even the lowest needs more.                       */
+static int abr_rate(const struct abr_in* in)
+{
+  int lo = 0, hi = in->n - 1, mid, pick = -1;
+
+  /* The rungs that fit are a prefix of the ladder */
+  while(lo <= hi)
+    {
+      mid = lo + (hi - lo) / 2;
+
+      if(in->ladder[mid] * 1.5 < in->tput)
+        {
+          pick = mid;
+          lo   = mid + 1;
+        }
+      else
+        hi = mid - 1;
+    }
+
+  return pick;
+}
+
+/*******************************************************************/
+/* @brief BOLA: the rung that maximizes (V (u + gp) - Q) / S, for   */
+/*        utility u = ln(S / S_lowest) + 1, rung size S and buffer  */
+/*        Q. V and gp are set so that the lowest rung is chosen up  */
+/*        to ABR_BUF_MIN of buffer and the highest by ABR_BUF_MAX.  */
+/*        As in BOLA-O, a switch up goes no higher than throughput  */
+/*        sustains, unless the client is already above that, which */
+/*        keeps it from oscillating around a rung it cannot hold.   */
+/*******************************************************************/
+static int abr_bola(const struct abr_in* in)
+{
+  double top = log((double) in->ladder[in->n - 1] / in->ladder[0]) + 1;
+  double gp, vp, u, score, best = 0;
+  double q = in->buffer / 1000.0;
+  int    i, pick = 0, cap, last;
+
+  if(in->n == 1)
+    return 0;
+
+  gp = (top - 1) / ((double) ABR_BUF_MAX / ABR_BUF_MIN - 1);
+  vp = ABR_BUF_MIN / 1000.0 / gp;
+
+  for(i = 0; i < in->n; i++)
+    {
+      u     = log((double) in->ladder[i] / in->ladder[0]) + 1;
+      score = (vp * (u + gp) - q) / in->ladder[i];
+
+      if(i == 0 || score > best)
+        {
+          best = score;
+          pick = i;
+        }
+    }
+
+  if(in->last > 0 && in->ladder[pick] > in->last)
+    {
+      cap  = abr_below(in, in->tput);
+      last = abr_below(in, in->last);
+
+      if(cap < last)
+        cap = last;
+      if(pick > cap)
+        pick = cap;
+    }
+
+  return pick;
+}
+
+/* QoE of fetching one fragment at rung first and the rest of the */
+/* horizon at rung rest: bitrate (Mbps), less bitrate changes and */
+/* ABR_REBUF a second stalled.                                    */
+static double abr_plan(const struct abr_in* in, int first, int rest)
+{
+  double buffer = in->buffer, qoe = 0, dl;
+  double prev   = (in->last > 0 ? in->last : in->ladder[first]) / 1000.0;
+  double rate;
+  int    k;
+
+  for(k = 0; k < ABR_HORIZON; k++)
+    {
+      rate = in->ladder[k == 0 ? first : rest] / 1000.0;
+      dl   = (double) ABR_FRAG_MS * in->ladder[k == 0 ? first : rest] /
+             in->tput;
+
+      qoe += rate - fabs(rate - prev);
+      prev = rate;
+
+      if(dl > buffer)
+        {
+          qoe   -= ABR_REBUF * (dl - buffer) / 1000.0;
+          buffer = 0;
+        }
+      else
+        buffer -= dl;
+
+      buffer += ABR_FRAG_MS;
+      if(buffer > ABR_BUF_MAX)
+        buffer = ABR_BUF_MAX;
+    }
+
+  return qoe;
+}
+
+/*******************************************************************/
+/* @brief MPC: the first step of the plan over the next            */
+/*        ABR_HORIZON fragments with the best QoE, taking          */
+/*        throughput to hold at its estimate. Plans are one rung   */
+/*        for the first fragment and one for the rest, which is    */
+/*        n^2 of them rather than n^ABR_HORIZON, and still lets a  */
+/*        plan drop now to climb later.                            */
+/*******************************************************************/
+static int abr_mpc(const struct abr_in* in)
+{
+  double qoe, best = 0;
+  int    first, rest, pick = 0;
+
+  if(in->tput == 0)
+    return 0;
+
+  for(first = 0; first < in->n; first++)
+    for(rest = 0; rest < in->n; rest++)
+      {
+        qoe = abr_plan(in, first, rest);
+
+        if((first == 0 && rest == 0) || qoe > best)
+          {
+            best = qoe;
+            pick = first;
+          }
+      }
+
+  return pick;
+}
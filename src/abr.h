@@ -0,0 +1,37 @@
+/*********************************************************************/
+/* @file abr.h                                                       */
+/*                                                                   */
+/* @brief Interfaces for abr.c, the bitrate adaptation policies the  */
+/*        proxy can choose a client's next rung with.                */
+/*********************************************************************/
+#ifndef ABR_H
+#define ABR_H
+
+/* Policies */
+#define ABR_RATE 0   // Highest rung the throughput sustains with half
+                     // as much again to spare (the default)
+#define ABR_BOLA 1   // Buffer occupancy (BOLA), up-switches capped by
+                     // throughput
+#define ABR_MPC  2   // Lookahead over the next few fragments (MPC)
+
+#define ABR_FRAG_MS  4000    // ms of video a fragment is taken to hold
+#define ABR_BUF_MAX  30000   // ms of video a player is taken to buffer
+#define ABR_BUF_MIN  10000   // BOLA: buffer (ms) kept at the lowest rung
+#define ABR_HORIZON  5       // MPC: fragments looked ahead
+#define ABR_REBUF    4.3     // MPC: QoE lost per s stalled, in Mbps
+
+/* What a policy decides from */
+struct abr_in {
+  const int* ladder;           // Bitrates (Kbps), ascending, no repeats
+  int n;
+  unsigned long long tput;     // Estimated throughput (Kbps)
+  long long buffer;            // ms of video the player is taken to hold
+  int last;                    // Bitrate of the last fragment, 0 if none
+  unsigned long long cap;      // Highest bitrate allowed (Kbps), 0 for
+                               // any; the lowest rung is always allowed
+};
+
+int abr_policy(const char* name);
+int abr_pick  (int policy, const struct abr_in* in);
+
+#endif
@@ -0,0 +1,63 @@
+/*********************************************************************/
+/* @file bufpool.c                                                   */
+/*                                                                   */
+/* @brief The buffers a connection needs only while it has data in   */
+/*        flight: a client's requests, the request line rewritten    */
+/*        for its server, the headers of the response being framed  */
+/*        and a manifest's headers. Each is taken when the first     */
+/*        byte needs a home and given back once the connection is    */
+/*        idle again, so a keep-alive player that is between         */
+/*        fragments holds none of them.                              */
+/*                                                                   */
+/*        Idle buffers are kept on a free list, linked through their */
+/*        first bytes, up to BP_KEEP of them. The list is shared by  */
+/*        every worker under one mutex.                              */
+/*********************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "bufpool.h"
+
+static char*            bp_free = NULL;
+static int              bp_idle = 0;
+static pthread_mutex_t  bp_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* @returns a BP_SIZE buffer, not zeroed; NULL if out of memory. */
+char* bp_get(void)
+{
+  char* buf;
+
+  pthread_mutex_lock(&bp_lock);
+
+  if((buf = bp_free) != NULL)
+    {
+      bp_free = *(char**) buf;
+      bp_idle--;
+    }
+
+  pthread_mutex_unlock(&bp_lock);
+
+  return buf != NULL ? buf : malloc(BP_SIZE);
+}
+
+/* @brief Gives back a buffer from bp_get; NULL is ignored. */
+void bp_put(char* buf)
+{
+  if(buf == NULL)
+    return;
+
+  pthread_mutex_lock(&bp_lock);
+
+  if(bp_idle < BP_KEEP)
+    {
+      *(char**) buf = bp_free;
+      bp_free = buf;
+      bp_idle++;
+      buf = NULL;
+    }
+
+  pthread_mutex_unlock(&bp_lock);
+
+  free(buf);
+}
@@ -0,0 +1,16 @@
+/*********************************************************************/
+/* @file bufpool.h                                                   */
+/*                                                                   */
+/* @brief Interfaces for bufpool.c, the buffers connections borrow   */
+/*        while they have data in flight.                            */
+/*********************************************************************/
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#define BP_SIZE 8192   // Bytes in a pooled buffer
+#define BP_KEEP 1024   // Idle buffers kept for reuse; the rest are freed
+
+char* bp_get(void);
+void  bp_put(char* buf);
+
+#endif
@@ -0,0 +1,381 @@
+/*********************************************************************/
+/* @file dcache.c                                                    */
+/*                                                                   */
+/* @brief The disk tier of the fragment cache, for catalogues too    */
+/*        large for RAM. Fragments are appended to a ring of         */
+/*        fixed-size segment files, each mapped into memory; when    */
+/*        the ring wraps, the oldest segment is reused whole and     */
+/*        every fragment in it is forgotten. Hits are sent straight  */
+/*        from the segment file with sendfile().                     */
+/*                                                                   */
+/*        Each stored fragment is also appended to an index file.    */
+/*        Every segment carries a generation that is bumped when it  */
+/*        is reused, so on startup the index is replayed and entries */
+/*        from an older generation of their segment are dropped. The */
+/*        index is then rewritten with only the live entries, and    */
+/*        again whenever it has grown well past them.                */
+/*********************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dcache.h"
+
+/* Opens (creating if need be) and maps segment i */
+static int dc_open_seg(struct dcache* d, int i)
+{
+  struct dc_seg*    s = &d->segs[i];
+  struct dc_seghdr* h;
+  struct stat       st;
+  char              path[PATH_MAX];
+  bool              fresh;
+
+  if(snprintf(path, sizeof(path), "%s/seg.%03d", d->dir, i) >=
+     (int) sizeof(path))
+    {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+
+  if((s->fd = open(path, O_RDWR | O_CREAT, 0644)) == -1 ||
+     fstat(s->fd, &st) == -1)
+    return -1;
+
+  fresh = (size_t) st.st_size != d->seg_size;
+  if(fresh && ftruncate(s->fd, d->seg_size) == -1)
+    return -1;
+
+  s->map = mmap(NULL, d->seg_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                s->fd, 0);
+  if(s->map == MAP_FAILED)
+    return -1;
+
+  /* A segment that is new or resized holds nothing usable */
+  h = (struct dc_seghdr *) s->map;
+  s->gen = (!fresh && h->magic == DC_MAGIC && h->seg == (uint32_t) i) ?
+           h->gen : 0;
+
+  if(s->gen > d->gen)
+    {
+      d->gen = s->gen;
+      d->cur = i;
+    }
+
+  return 0;
+}
+
+/* Whether an index record still describes what its segment holds */
+static bool dc_valid(struct dcache* d, struct dc_rec* r)
+{
+  return r->seg < (uint32_t) d->nsegs && r->gen != 0 &&
+         r->gen == d->segs[r->seg].gen &&
+         memchr(r->key, '\0', FC_KEY_LEN) != NULL &&
+         r->off >= DC_HDR && r->len <= d->seg_size &&
+         r->off <= d->seg_size - r->len && r->hdr_len <= r->len;
+}
+
+/* Replaces the index with one holding only the live entries */
+static int dc_compact(struct dcache* d)
+{
+  struct dc_entry* e;
+  struct dc_entry* tmp;
+  char path[PATH_MAX], next[PATH_MAX];
+  int  fd;
+
+  if(snprintf(path, sizeof(path), "%s/index", d->dir) >= (int) sizeof(path) ||
+     snprintf(next, sizeof(next), "%s/index.tmp", d->dir) >= (int) sizeof(next))
+    return -1;
+
+  if((fd = open(next, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644)) == -1)
+    return -1;
+
+  HASH_ITER(hh, d->entries, e, tmp)
+    {
+      if(write(fd, &e->r, sizeof(e->r)) != sizeof(e->r))
+        {
+          close(fd);
+          unlink(next);
+          return -1;
+        }
+    }
+
+  if(rename(next, path) == -1)
+    {
+      close(fd);
+      unlink(next);
+      return -1;
+    }
+
+  if(d->journal != -1)
+    close(d->journal);
+
+  d->journal = fd;
+  d->nrecs   = HASH_COUNT(d->entries);
+  return 0;
+}
+
+/* Forgets everything in segment i and starts appending to it. */
+/* Fails while a client is still being sent something from it. */
+static int dc_recycle(struct dcache* d, int i)
+{
+  struct dc_seg*    s = &d->segs[i];
+  struct dc_seghdr* h = (struct dc_seghdr *) s->map;
+  struct dc_entry*  e;
+  struct dc_entry*  tmp;
+
+  if(__atomic_load_n(&s->pins, __ATOMIC_ACQUIRE) > 0)
+    return -1;
+
+  HASH_ITER(hh, d->entries, e, tmp)
+    {
+      if(e->r.seg == (uint32_t) i)
+        {
+          HASH_DEL(d->entries, e);
+          free(e);
+        }
+    }
+
+  s->gen   = ++d->gen;
+  h->magic = DC_MAGIC;
+  h->seg   = i;
+  h->gen   = s->gen;
+
+  d->cur = i;
+  d->off = DC_HDR;
+
+  /* Dropped entries are still in the index until it is rewritten */
+  if(d->nrecs > 2 * HASH_COUNT(d->entries) + 1024)
+    dc_compact(d);
+
+  return 0;
+}
+
+/* Rebuilds the table from the index left by the last run */
+static void dc_load(struct dcache* d)
+{
+  struct dc_entry* e;
+  struct dc_entry* old;
+  struct dc_rec    r;
+  char  path[PATH_MAX];
+  FILE* in;
+
+  if(snprintf(path, sizeof(path), "%s/index", d->dir) >= (int) sizeof(path))
+    return;
+
+  if((in = fopen(path, "r")) == NULL)
+    return;
+
+  /* Later records win; a torn last record is ignored */
+  while(fread(&r, sizeof(r), 1, in) == 1)
+    {
+      if(!dc_valid(d, &r) || (e = calloc(1, sizeof(struct dc_entry))) == NULL)
+        continue;
+
+      HASH_FIND_STR(d->entries, r.key, old);
+      if(old != NULL)
+        {
+          HASH_DEL(d->entries, old);
+          free(old);
+        }
+
+      e->r = r;
+      HASH_ADD_STR(d->entries, r.key, e);
+
+      if(r.seg == (uint32_t) d->cur && r.off + r.len > d->off)
+        d->off = r.off + r.len;
+    }
+
+  fclose(in);
+}
+
+/*******************************************************************/
+/* @brief Opens the disk tier in dir, creating it if need be, and  */
+/*        picks up whatever the last run left there.               */
+/* @param capacity  Bytes of segment files; 0 turns the tier off.  */
+/* @returns 0 on success, -1 with errno set otherwise.             */
+/*******************************************************************/
+int dc_init(struct dcache* d, const char* dir, size_t capacity)
+{
+  int i;
+
+  memset(d, 0, sizeof(struct dcache));
+  pthread_mutex_init(&d->lock, NULL);
+  d->journal  = -1;
+  d->seg_size = (size_t) DC_SEG_MB * 1024 * 1024;
+
+  if(capacity == 0)
+    return 0;
+
+  if(strlen(dir) + strlen("/index.tmp") >= sizeof(d->dir))
+    {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+  strcpy(d->dir, dir);
+
+  if(mkdir(dir, 0755) == -1 && errno != EEXIST)
+    return -1;
+
+  d->nsegs = capacity / d->seg_size;
+  if(d->nsegs < 2)
+    d->nsegs = 2;
+  if(d->nsegs > DC_SEGS_MAX)
+    d->nsegs = DC_SEGS_MAX;
+
+  for(i = 0; i < d->nsegs; i++)
+    {
+      if(dc_open_seg(d, i) == -1)
+        {
+          d->nsegs = 0;
+          return -1;
+        }
+    }
+
+  d->off = DC_HDR;
+  dc_load(d);
+
+  /* Nothing on disk yet */
+  if(d->gen == 0)
+    dc_recycle(d, 0);
+
+  if(dc_compact(d) == -1)
+    {
+      d->nsegs = 0;
+      return -1;
+    }
+
+  return 0;
+}
+
+/*******************************************************************/
+/* @brief Looks a fragment up, counting a hit or a miss.           */
+/* @returns true with h filled in, its segment pinned; the caller  */
+/*          passes h->pin on to whatever sends the bytes, or       */
+/*          dc_unpin()s it.                                        */
+/*******************************************************************/
+bool dc_get(struct dcache* d, const char* key, struct dc_hit* h)
+{
+  struct dc_entry* e;
+  struct dc_seg*   s;
+
+  if(d->nsegs == 0)
+    return false;
+
+  pthread_mutex_lock(&d->lock);
+
+  HASH_FIND_STR(d->entries, key, e);
+
+  if(e == NULL)
+    {
+      d->misses++;
+      pthread_mutex_unlock(&d->lock);
+      return false;
+    }
+
+  s = &d->segs[e->r.seg];
+  __atomic_add_fetch(&s->pins, 1, __ATOMIC_ACQ_REL);
+
+  h->fd      = s->fd;
+  h->off     = e->r.off;
+  h->data    = s->map + e->r.off;
+  h->hdr_len = e->r.hdr_len;
+  h->len     = e->r.len;
+  h->elapsed = e->r.elapsed;
+  h->pin     = &s->pins;
+  h->hot     = ++e->hits == DC_HOT;
+
+  d->hits++;
+  if(h->hot)
+    d->promoted++;
+
+  pthread_mutex_unlock(&d->lock);
+  return true;
+}
+
+/* @brief Whether key is on disk, without counting a hit or a miss. */
+bool dc_has(struct dcache* d, const char* key)
+{
+  struct dc_entry* e;
+
+  if(d->nsegs == 0)
+    return false;
+
+  pthread_mutex_lock(&d->lock);
+  HASH_FIND_STR(d->entries, key, e);
+  pthread_mutex_unlock(&d->lock);
+
+  return e != NULL;
+}
+
+void dc_unpin(int* pin)
+{
+  __atomic_sub_fetch(pin, 1, __ATOMIC_ACQ_REL);
+}
+
+/*******************************************************************/
+/* @brief Appends a complete response to the current segment,      */
+/*        moving on to (and reusing) the next one when it is full. */
+/*        If that one is still being sent from, the fragment is    */
+/*        not stored.                                              */
+/*******************************************************************/
+void dc_put(struct dcache* d, const char* key, const char* data,
+            size_t hdr_len, size_t len, unsigned long long elapsed)
+{
+  struct dc_entry* e;
+
+  if(d->nsegs == 0 || len > d->seg_size - DC_HDR)
+    return;
+
+  pthread_mutex_lock(&d->lock);
+
+  HASH_FIND_STR(d->entries, key, e);
+  if(e != NULL)
+    goto out;
+
+  if(d->off + len > d->seg_size &&
+     dc_recycle(d, (d->cur + 1) % d->nsegs) == -1)
+    {
+      d->skipped++;
+      goto out;
+    }
+
+  if((e = calloc(1, sizeof(struct dc_entry))) == NULL)
+    goto out;
+
+  memcpy(d->segs[d->cur].map + d->off, data, len);
+
+  strcpy(e->r.key, key);
+  e->r.seg     = d->cur;
+  e->r.gen     = d->segs[d->cur].gen;
+  e->r.off     = d->off;
+  e->r.hdr_len = hdr_len;
+  e->r.len     = len;
+  e->r.elapsed = elapsed;
+
+  /* Without its record the entry is still good until a restart */
+  if(write(d->journal, &e->r, sizeof(e->r)) == sizeof(e->r))
+    d->nrecs++;
+
+  HASH_ADD_STR(d->entries, r.key, e);
+  d->off += len;
+  d->stored++;
+
+ out:
+  pthread_mutex_unlock(&d->lock);
+}
+
+void dc_stats(struct dcache* d, FILE* file)
+{
+  if(d->nsegs == 0)
+    return;
+
+  fprintf(file, "disk cache: %llu hits, %llu misses, %llu stored, "
+          "%llu promoted, %llu not stored, %u fragments in %d segments\n",
+          d->hits, d->misses, d->stored, d->promoted, d->skipped,
+          HASH_COUNT(d->entries), d->nsegs);
+}
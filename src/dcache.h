@@ -0,0 +1,100 @@
+/*********************************************************************/
+/* @file dcache.h                                                    */
+/*                                                                   */
+/* @brief Interfaces for dcache.c, the proxy's on-disk tier of the   */
+/*        fragment cache.                                            */
+/*********************************************************************/
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "uthash.h"
+#include "fcache.h"
+
+#define DC_SIZE_MB  1024   // Default size of the disk tier
+#define DC_SEG_MB   64     // Size of one segment file
+#define DC_SEGS_MAX 256
+#define DC_HDR      4096   // Segment header; fragments start after it
+#define DC_HOT      2      // Disk hits before a fragment is copied to RAM
+#define DC_MAGIC    0x31484344  // "DCH1"
+
+/* Start of every segment file */
+struct dc_seghdr {
+  uint32_t magic;
+  uint32_t seg;
+  uint64_t gen;         // Bumped each time the segment is reused
+};
+
+/* One fragment on disk; also the record kept for it in the index */
+struct dc_rec {
+  char key[FC_KEY_LEN];
+  uint32_t seg;
+  uint64_t gen;         // Of the segment when it was written
+  uint64_t off;         // Within the segment
+  uint64_t hdr_len;
+  uint64_t len;         // Headers plus body
+  uint64_t elapsed;     // ns the origin took to send it
+};
+
+struct dc_entry {
+  struct dc_rec r;
+  int hits;
+  UT_hash_handle hh;
+};
+
+struct dc_seg {
+  int fd;
+  char* map;
+  uint64_t gen;
+  int pins;             // Sends from it still queued; never reused while set
+};
+
+/* A fragment found on disk. The segment stays pinned until the   */
+/* caller hands pin to the client's output queue, or dc_unpin()s. */
+struct dc_hit {
+  int fd;               // Segment file to sendfile() from
+  off_t off;
+  const char* data;     // Mapped view of the same bytes
+  size_t hdr_len;
+  size_t len;
+  unsigned long long elapsed;
+  int* pin;
+  bool hot;             // Worth copying into the RAM tier
+};
+
+struct dcache {
+  pthread_mutex_t lock;
+  char dir[PATH_MAX];
+  struct dc_entry* entries;  // Hash by key
+  struct dc_seg segs[DC_SEGS_MAX];
+  int nsegs;            // 0 when the tier is off
+  size_t seg_size;
+  int cur;              // Segment being appended to
+  size_t off;           // Where the next fragment goes in it
+  uint64_t gen;         // Highest generation handed out
+  int journal;          // The index, appended to as fragments are stored
+  unsigned int nrecs;   // Records in it, live or not
+
+  /* Counters */
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long stored;
+  unsigned long long promoted;
+  unsigned long long skipped;  // Not stored: the next segment was busy
+};
+
+int  dc_init (struct dcache* d, const char* dir, size_t capacity);
+bool dc_get  (struct dcache* d, const char* key, struct dc_hit* h);
+bool dc_has  (struct dcache* d, const char* key);
+void dc_unpin(int* pin);
+void dc_put  (struct dcache* d, const char* key, const char* data,
+              size_t hdr_len, size_t len, unsigned long long elapsed);
+void dc_stats(struct dcache* d, FILE* file);
+
+#endif
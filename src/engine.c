@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -19,166 +20,227 @@
 #include "engine.h"
 #include "parse.h"
 
-#define FREE_SIZE 40
+extern struct fcache fcache;
+extern struct dcache dcache;
 
-/**********************************************************/
-/* @brief Parses a given buf based on state and populates */
-/* a struct with parsed tokens if successful. If request  */
-/* is incomplete, stash it as its state.                  */
-/*                                                        */
-/* @param state The saved state of the client             */
-/*                                                        */
-/* @retval  0    if successful                            */
-/* @retval -1    if incomplete request                    */
-/* @retval 400   if malformed                             */
-/* @retval 500   if internal error                        */
-/* @retval 505   if wrong version                         */
-/**********************************************************/
-int parse_line(fsm* state)
+static void set_span(fsm* state, struct span* s, const char* from,
+                     const char* to)
 {
-  char* CRLF; char* tmpbuf;
-  char* method; char* uri; char* version;
-  size_t length;
-
-  /* Check for CLRF */
-  CRLF = memmem(state->request, state->end_idx, "\r\n\r\n", strlen("\r\n\r\n"));
+  s->off = from - (state->request + state->req_at);
+  s->len = to - from;
+}
 
-  if(CRLF == NULL)
-    return -1;
+/* @returns where span s of the request being parsed starts. */
+char* span_at(fsm* state, struct span s)
+{
+  return state->request + state->req_at + s.off;
+}
 
-  /* We have a request, extract tokens */
-  CRLF = memmem(state->request, state->end_idx,
-                "\r\n", strlen("\r\n"));
+/* @returns whether span s of the request is str. */
+bool span_is(fsm* state, struct span s, const char* str)
+{
+  return (size_t) s.len == strlen(str) &&
+         !memcmp(span_at(state, s), str, s.len);
+}
 
-  if(CRLF == NULL)
-    return 500;
+/* @returns whether span s of the request is str, ignoring case. */
+bool span_case_is(fsm* state, struct span s, const char* str)
+{
+  return (size_t) s.len == strlen(str) &&
+         scan_ieq(span_at(state, s), str, s.len);
+}
 
-  /* Copy request line */
-  length = (size_t)(CRLF - state->request);
-  tmpbuf = strndup(state->request,length); // Remember to free here.
+/* Request line: method SP URI SP version, ending at eol */
+static int parse_line(fsm* state, const char* eol)
+{
+  const char* buf = state->request + state->req_at;
+  const char* sp; const char* from; const char* to;
 
-  /* Tokenize the line */
-  method = strtok(tmpbuf," ");
+  if((sp = memchr(buf, ' ', eol - buf)) == NULL || sp == buf)
+    return 400;
 
-  if (method == NULL)
-    {free(tmpbuf); return 400;}
+  set_span(state, &state->method, buf, sp);
 
   /* Check if correct method */
-  if (strncmp(method,"GET",strlen("GET")) && strncmp(method,"HEAD",strlen("HEAD"))
-      && strncmp(method, "POST", strlen("POST")))
-    {free(tmpbuf); return 501;}
+  if(!span_is(state, state->method, "GET") &&
+     !span_is(state, state->method, "HEAD") &&
+     !span_is(state, state->method, "POST"))
+    return 501;
+
+  from = sp + 1;
+  if((sp = memchr(from, ' ', eol - from)) == NULL || sp == from)
+    return 400;
 
-  if((uri = strtok(NULL," ")) == NULL)
-    {free(tmpbuf); return 400;}
+  set_span(state, &state->uri, from, sp);
 
-  if((version = strtok(NULL, " ")) == NULL)
-    {free(tmpbuf); return 400;}
+  from = sp + 1;
+  to   = memchr(from, ' ', eol - from);
+  set_span(state, &state->version, from, to != NULL ? to : eol);
 
-  if(strncmp(version,"HTTP/1.1",strlen("HTTP/1.1")))
-    {free(tmpbuf); return 505;}
+  if(!span_is(state, state->version, "HTTP/1.1"))
+    return 505;
 
   /* If there's one more token, malformed request */
-  if(strtok(NULL," ") != NULL)
-    {free(tmpbuf); return 400;}
-
-  /* These are all malloced by strdup, so it is safe */
-  state->method = method;
-  state->uri = uri;
-  state->version = version;
-  addtofree(state->freebuf, tmpbuf, FREE_SIZE);
+  if(to != NULL)
+    return 400;
 
   return 0;
 }
 
-
-/*******************************************************************/
-/* @brief   Parses headers from the request passed on by the state */
-/* and populates the state accordingly                             */
-/*                                                                 */
-/* @retval  0   Success                                            */
-/* @retval 411  No CL header (411)                                 */
-/* @retval 400  malformed request (400)                            */
-/* @retval 500  internal error (500)                               */
-/*******************************************************************/
-int parse_headers(fsm* state)
+/* Header line "name: value" from line to eol */
+static void parse_header(fsm* state, const char* line, const char* eol)
 {
-  char* CRLF; char* tmpbuf;
-  char* hdr_start;
+  struct http_hdr* h;
+  const char* colon; const char* to;
 
-  CRLF = memmem(state->request, state->end_idx, "\r\n\r\n", strlen("\r\n\r\n"));
+  if((colon = memchr(line, ':', eol - line)) == NULL ||
+     state->nhdrs == HDR_MAX)
+    return;
 
-  if(CRLF == NULL)
-    return 500;
+  h = &state->hdrs[state->nhdrs++];
+  set_span(state, &h->name, line, colon);
+
+  for(colon++; colon < eol && (*colon == ' ' || *colon == '\t'); colon++);
+  for(to = eol; to > colon && (to[-1] == ' ' || to[-1] == '\t'); to--);
+  set_span(state, &h->value, colon, to);
+}
+
+/**********************************************************/
+/* @brief Parses the request at the head of the buffer of */
+/* a client. Nothing is copied: the method, URI, version, */
+/* header block and each header are spans of the request  */
+/* from state->req_at on, good until resetbuf. Each line  */
+/* is parsed once, as its CRLF comes in, and the search   */
+/* for the next resumes where the last one stopped, so    */
+/* bytes are looked at once however the request is split  */
+/* up.                                                    */
+/*                                                        */
+/* @param state The saved state of the client             */
+/*                                                        */
+/* @retval  0    if successful                            */
+/* @retval -1    if incomplete request                    */
+/* @retval 400   if malformed                             */
+/* @retval 501   if not GET, HEAD or POST                 */
+/* @retval 505   if wrong version                         */
+/**********************************************************/
+int parse_request(fsm* state)
+{
+  const char* buf; const char* end;
+  const char* line; const char* eol;
+  struct span* conn;
 
-  /* First extract Connection: */
+  /* Idle: nothing has come in since the last request */
+  if(state->request == NULL)
+    return -1;
 
-  tmpbuf = memmem(state->request, (int)(CRLF - state->request)+2, "Connection: close\r\n",
-                  strlen("Connection: close\r\n"));
+  buf = state->request + state->req_at;
+  end = state->request + state->end_idx;
 
-  if(tmpbuf == NULL)
-    state->conn = 1; // Keep Alive
-  else
-    state->conn = 0; // Close
+  while((eol = scan_crlf(buf + state->scan_at, end)) != NULL)
+    {
+      line = buf + state->line_at;
+      state->line_at = state->scan_at = eol + 2 - buf;
 
-  /* Save the headers in state */
+      if(line == buf)
+        {
+          state->req_err    = parse_line(state, eol);
+          state->header.off = state->line_at;
+        }
+      else if(eol != line)
+        parse_header(state, line, eol);
+      else
+        {
+          /* The blank line: the request is all in */
+          if(state->req_err != 0)
+            return state->req_err;
 
-  hdr_start = memmem(state->request, state->end_idx, "\r\n", strlen("\r\n"));
+          state->req_len    = state->line_at;
+          state->header.len = state->req_len - state->header.off;
 
-  if(hdr_start == NULL)
-    return 400;
+          conn = search_hdr(state, "Connection");
+          state->conn = conn == NULL || !span_case_is(state, *conn, "close");
 
-  hdr_start += 2; // Go to the header line
+          return 0;
+        }
+    }
 
-  state->header = strndup(hdr_start, (size_t)(CRLF+4 - hdr_start));
-  addtofree(state->freebuf, state->header, FREE_SIZE);
+  /* A CR at the very end may yet be followed by its LF */
+  state->scan_at = end - 1 - buf > state->line_at ?
+                   end - 1 - buf : state->line_at;
 
-  return 0;
+  return -1;
 }
 
 
 /**************************************************/
-/* @brief parses the body and stores it in state. */
-/* If the full body has not been read yet, stash  */
-/* whatever has been received.                    */
+/* @brief Points state->body at the body of the   */
+/* request parsed, once all of it has come in.    */
 /*                                                */
 /* @retval  0    if successful                    */
 /* @retval -1    if incomplete body               */
-/* @retval 400   if malformed                     */
 /**************************************************/
 int parse_body(fsm* state)
 {
-  char* CRLF; char* body;
-
-  /* CRLF should be here */
-  CRLF = memmem(state->request, state->end_idx, "\r\n\r\n", strlen("\r\n\r\n"));
-
-  if(CRLF == NULL)
-    return 400;
-
-  /* Check if there's a body to begin with */
-  if(CRLF + 4 == state->request + state->end_idx)
-    return -1;
-
-  body = CRLF + 4;
-
   /* Check if the body is complete */
-  if(body + (int) state->body_size > state->request + state->end_idx)
+  if(state->req_at + state->req_len + state->body_size > state->end_idx)
     return -1;
 
-  state->body = strndup(body, state->body_size + 1);
-  state->body[state->body_size] = '\0';
-  addtofree(state->freebuf, state->body, FREE_SIZE);
+  state->body = state->request + state->req_at + state->req_len;
 
   return 0;
 }
 
-/*
- */
+/*********************************************************************/
+/* @brief Appends size bytes from a client to its request buffer.    */
+/* Requests already served are dropped from the front when they take */
+/* up half the buffer, or when it could not otherwise grow to hold   */
+/* the rest; short of that the buffer doubles, up to REQ_BUF_MAX.    */
+/* Either way a byte is moved O(1) times, however many requests a    */
+/* burst holds.                                                      */
+/*                                                                   */
+/* @retval  0  success                                               */
+/* @retval 413 the unserved requests would outgrow REQ_BUF_MAX       */
+/* @retval 500 out of memory                                         */
+/*********************************************************************/
 int store_request(char* buf, int size, fsm* state)
 {
-  /* Check if request > BUF_SIZE */
-  if(state->end_idx + size > BUF_SIZE)
-    return -2;
+  int   held = state->end_idx - state->req_at;
+  int   need = state->end_idx + size;
+  int   grow;
+  char* bigger;
+
+  /* An idle client has no buffer; the pool lends one */
+  if(state->request == NULL)
+    {
+      if((state->request = bp_get()) == NULL)
+        return 500;
+      state->req_size = BP_SIZE;
+    }
+
+  if(need > state->req_size && state->req_at > 0 &&
+     (state->req_at >= state->req_size / 2 || need > REQ_BUF_MAX))
+    {
+      memmove(state->request, state->request + state->req_at, held);
+      state->req_at  = 0;
+      state->end_idx = held;
+      need           = held + size;
+    }
+
+  if(need > state->req_size)
+    {
+      if(need > REQ_BUF_MAX)
+        return 413;
+
+      for(grow = state->req_size; grow < need; grow *= 2);
+      if(grow > REQ_BUF_MAX)
+        grow = REQ_BUF_MAX;
+
+      if((bigger = realloc(state->request, grow)) == NULL)
+        return 500;
+
+      state->request  = bigger;
+      state->req_size = grow;
+    }
 
   /* Store away in fsm */
   memcpy(state->request + state->end_idx, buf, size);
@@ -195,12 +257,17 @@ int store_request(char* buf, int size, fsm* state)
 /* @retval  0  success                                               */
 /* @retval 500 internal server error                                 */
 /* @retval 404 File not found                                        */
+/* @retval 414 the request line for the server would be too long     */
 /*********************************************************************/
 int service(fsm* state)
 {
-  if(!strncmp(state->method,"GET",strlen("GET")))
+  /* Held until clean_state */
+  if(state->response == NULL && (state->response = bp_get()) == NULL)
+    return 500;
+
+  if(span_is(state, state->method, "GET"))
     {
-      parse_client_message(state);
+      return parse_client_message(state);
     }
   else // Non 'GET' request, just pass it on.
     {
@@ -222,55 +289,42 @@ int validsize(char* body_size)
 
 
 /*****************************************************************/
-/* @brief   resetbuf resizes the buffer of a state using pointer */
-/* arithmetic so that lisod can handle pipelined requests.       */
-/*                                                               */
-/* @returns length of newly resized buffer                       */
+/* @brief   resetbuf moves past the request just served, so that */
+/* lisod can handle pipelined requests. Nothing is copied: the   */
+/* next request is parsed where it lies, and the bytes before it */
+/* are reclaimed by store_request when room is needed.           */
 /*****************************************************************/
-int resetbuf(fsm* state)
+void resetbuf(fsm* state)
 {
-  char* CRLF; char* next; char* buf = state->request;
-  int end = state->end_idx;
-  size_t length;
+  int length;
 
-  /* Since we've serviced at least one request, CRLF should show up */
-  CRLF = memmem(buf, end, "\r\n\r\n", strlen("\r\n\r\n"));
-
-  if (CRLF == NULL)
-    return -1;
+  /* length of the 1st request, and its body if a POST */
+  length = state->req_len;
+  if(span_is(state, state->method, "POST"))
+    length += state->body_size;
 
-  if(strncmp(state->method, "POST", strlen("POST")))
-    {
-      /* length of the 1st request including CRLF */
-      length = (size_t)(strlen("\r\n\r\n") + CRLF - buf);
-    }
-  else
-    {
-      /* length of the 1st request including CRLF + body */
-      length = (size_t)(strlen("\r\n\r\n") + CRLF + state->body_size - buf);
-    }
+  state->req_at += length;
+  if(state->req_at > state->end_idx)
+    state->req_at = state->end_idx;
 
-  if(length >= 8192)
+  /* Nothing left over: the buffer goes back until more comes in */
+  if(state->req_at == state->end_idx)
     {
-      /* buf was full, just memset */
-      memset(buf, 0, BUF_SIZE);
-      return 0;
+      release_request(state);
+      state->req_at = state->end_idx = 0;
     }
+}
 
-  if(strncmp(state->method, "POST", strlen("POST")))
-    next = CRLF + 4;
+/* Gives a client's request buffer back, to the pool if it never grew */
+void release_request(fsm* state)
+{
+  if(state->req_size == BP_SIZE)
+    bp_put(state->request);
   else
-    next = CRLF + 4 + state->body_size;
+    free(state->request);
 
-  /* Copy remaining requests to start of buf */
-  memmove(buf,next,BUF_SIZE-length);
-
-  /* Zero out the rest of the buf */
-  memset(buf+(BUF_SIZE-length),0,length);
-
-  /* I <3 this function */
-
-  return strlen(buf);
+  state->request  = NULL;
+  state->req_size = 0;
 }
 
 
@@ -279,14 +333,14 @@ int resetbuf(fsm* state)
 /****************************************************/
 void clean_state(fsm* state)
 {
-  memset(state->response, 0, BUF_SIZE);
-
-  delfromfree(state->freebuf, FREE_SIZE);
+  bp_put(state->response);
+  state->response = NULL;
 
-  state->method = NULL;
-  state->uri = NULL;
-  state->version = NULL;
-  state->header = NULL;
+  state->req_len = 0;
+  state->req_err = 0;
+  state->line_at = 0;
+  state->scan_at = 0;
+  state->nhdrs = 0;
 
   state->body = NULL;
   state->body_size = 0;
@@ -295,30 +349,22 @@ void clean_state(fsm* state)
 }
 
 /******************************************************/
-/* @brief searches headers for a particular field and */
-/*        returns a ptr to its value.                 */
+/* @brief searches the headers of the request parsed  */
+/*        for a field, by name in any case.           */
 /*                                                    */
 /* @param state       The state of the client         */
-/* @param hdr         The string in question          */
-/* @param n           The length of hdr               */
+/* @param name        The field in question           */
+/* @returns its value, NULL if it is not there.       */
 /******************************************************/
-char* search_hdr(fsm* state, char* hdr, int n)
+struct span* search_hdr(fsm* state, const char* name)
 {
-  char* CRLF;
-  char* headers = state->header; // headers should be NULL terminated.
-  char* needle  = memmem(headers, strlen(headers), hdr, n);
+  int i;
 
-  if(needle == NULL)
-    return NULL;
+  for(i = 0; i < state->nhdrs; i++)
+    if(span_case_is(state, state->hdrs[i].name, name))
+      return &state->hdrs[i].value;
 
-  needle += n;
-
-  CRLF = memmem(needle, strlen(needle), "\r\n", strlen("\r\n"));
-
-  if(CRLF == NULL)
-    return NULL;
-
-  return needle;
+  return NULL;
 }
 
 /*********************************************************/
@@ -333,6 +379,19 @@ int Recv(int fd, char* buf, int num)
   return recv(fd, buf, num, 0);
 }
 
+/*********************************************************/
+/* @brief non-blocking variant of Recv, used to drain    */
+/*        sockets under edge-triggered notification      */
+/*                                                       */
+/* @param fd             File descriptor for HTTP socket */
+/* @param buf            buffer for reading into         */
+/* @param num            size of buffer                  */
+/*********************************************************/
+int Recv_nb(int fd, char* buf, int num)
+{
+  return recv(fd, buf, num, MSG_DONTWAIT);
+}
+
 /*********************************************************/
 /*@brief wrapper for writing to HTTP / HTTPS sockets     */
 /*                                                       */
@@ -345,143 +404,410 @@ int Send(int fd, char* buf, int num)
   return send(fd, buf, num, 0);
 }
 
-void addtofree(char** freebuf, char* ptr, int bufsize)
+/*****************************************************************/
+/* @brief Appends size bytes of a manifest's headers, taking a   */
+/*        buffer from the pool for the first of them.            */
+/* @retval  0  success                                           */
+/* @retval -1  out of memory, or the headers outgrow BP_SIZE     */
+/*****************************************************************/
+int store_request_serv(char* buf, int size, struct serv_rep* state)
 {
-  for (int i = 0; i < bufsize; i++)
+  if(state->response == NULL && (state->response = bp_get()) == NULL)
+    return -1;
+
+  if(state->end_idx + size > BP_SIZE)
+    return -1;
+
+  /* Store away in fsm */
+  memcpy(state->response + state->end_idx, buf, size);
+  state->end_idx += size;
+
+  return 0;
+}
+
+/*****************************************************************/
+/* @brief Parses the headers of a response being kept whole (a   */
+/*        manifest). Like parse_request, it picks up where it    */
+/*        left off, looking at each header line once.            */
+/*                                                               */
+/* @retval  0    headers all in; servst->hdr_len bytes of them   */
+/* @retval -1    incomplete headers                              */
+/* @retval 411   no valid Content-Length                         */
+/*****************************************************************/
+int parse_headers_serv(fsm* state)
+{
+  struct serv_rep* servst = state->servst;
+  const char* buf = servst->response;
+  const char* end = buf + servst->end_idx;
+  const char* line; const char* eol;
+  size_t len = strlen("Content-Length:");
+
+  while((eol = scan_crlf(buf + servst->scan_at, end)) != NULL)
     {
-      if (freebuf[i] == NULL)
+      line = buf + servst->line_at;
+      servst->line_at = servst->scan_at = eol + 2 - buf;
+
+      /* Only note where the length is until the headers are all in */
+      if(eol != line)
         {
-          freebuf[i] = ptr;
-          return;
+          if(line != buf && eol - line >= (int) len &&
+             scan_ieq(line, "Content-Length:", len))
+            servst->length_at = line + len - buf;
+          continue;
         }
+
+      /* Check for valid Content-Length */
+      if(servst->length_at == 0 || !validsize(servst->response + servst->length_at))
+        return 411;
+
+      servst->hdr_len   = servst->line_at;
+      servst->body_size = (size_t)atoi(buf + servst->length_at);
+      servst->body      = calloc(1, servst->body_size + 1);
+      servst->headers   = servst->response;
+
+      return 0;
     }
 
-  fprintf(stderr,"ADDTOFREE ERR");
-  exit(0);
+  /* A CR at the very end may yet be followed by its LF */
+  servst->scan_at = servst->end_idx - 1 > servst->line_at ?
+                    servst->end_idx - 1 : servst->line_at;
+
+  return -1;
 }
 
-void delfromfree(char** freebuf, int bufsize)
+
+int  parse_body_serv(struct serv_rep* servst, char* buf, ssize_t n)
 {
-  for (int i = 0; i < bufsize; i++)
+  // ASSERT: buf contains only pure data, no headers and stuff.
+
+  int remaining = servst->body_size - servst->body_idx;
+
+  if (n == 0)
+    return -1;
+
+  if (n <= remaining)
     {
-      if (freebuf[i] != NULL)
-        free(freebuf[i]);
-      freebuf[i] = NULL;
+      memcpy(servst->body + servst->body_idx, buf, n);
+      servst->body_idx += n;
+
+      if(n == remaining)
+        return 0;
+
+      return -1;
     }
-  return;
+
+  // ASSERT: n > remaining
+  memcpy(servst->body + servst->body_idx, buf, remaining);
+  servst->body_idx += remaining;
+
+  /* What is left is the next response, at buf + remaining */
+  return n - remaining;
 }
 
-/**********************************************************/
-/* @returns NULL If not needle not found; else pointer to */
-/* first occurrence of needle                             */
-/* Code from stackoverflow.                               */
-/**********************************************************/
-void *memmem(const void *haystack, size_t hlen,
-             const void *needle, size_t nlen)
+/*****************************************************************/
+/* @brief Works out how long the body of the response whose      */
+/*        hdr_len bytes of headers are in state->resp_hdr is,    */
+/*        and whether the server will keep the connection open   */
+/*        after it.                                              */
+/* @retval  0   resp_left holds the body length                  */
+/* @retval -1   the response cannot be delimited by its headers  */
+/*****************************************************************/
+static int frame_headers(fsm* state, size_t hdr_len)
 {
-  int needle_first;
-  const void *p = haystack;
-  size_t plen = hlen;
+  char* hdr = state->resp_hdr;
+  const char* lines;
+  const char* value;
+  size_t vlen, len;
+  int   code;
+  long long length;
+
+  if(strncmp(hdr, "HTTP/1.", strlen("HTTP/1.")))
+    return -1;
 
-  if (!nlen)
-    return NULL;
+  /* HTTP/1.0 servers close unless told otherwise */
+  if(hdr[strlen("HTTP/1.")] != '1')
+    state->reusable = false;
 
-  needle_first = *(unsigned char *)needle;
+  /* The header lines, after the status line */
+  lines = scan_crlf(hdr, hdr + hdr_len) + 2;
+  len   = hdr + hdr_len - lines;
 
-  while (plen >= nlen && (p = memchr(p, needle_first, plen - nlen + 1)))
-    {
-      if (!memcmp(p, needle, nlen))
-        return (void *)p;
+  if((value = scan_hdr(lines, len, "Connection", &vlen)) != NULL &&
+     vlen >= strlen("close") && scan_ieq(value, "close", strlen("close")))
+    state->reusable = false;
+
+  code = atoi(hdr + strlen("HTTP/1.1 "));
+
+  /* Interim responses do not answer the request */
+  if(code < 200)
+    return -1;
 
-      p++;
-      plen = hlen - (p - haystack);
+  if(code == 204 || code == 304)
+    {
+      state->resp_left = 0;
+      return 0;
     }
 
-  return NULL;
+  /* Chunked bodies are not followed, nor ones that end with the connection */
+  if(scan_hdr(lines, len, "Transfer-Encoding", NULL) != NULL ||
+     (value = scan_hdr(lines, len, "Content-Length", NULL)) == NULL)
+    return -1;
+
+  if((length = strtoll(value, NULL, 10)) < 0)
+    return -1;
+
+  state->resp_left = length;
+  return 0;
 }
 
-void store_request_serv(char* buf, int size, struct serv_rep* state)
+/*****************************************************************/
+/* @brief Starts storing the response whose headers were just    */
+/*        framed in the fragment cache, if it is a whole 200.    */
+/*****************************************************************/
+static void fill_begin(fsm* state, size_t hdr_len)
 {
-  /* Store away in fsm */
-  memcpy(state->response + state->end_idx, buf, size);
-  state->end_idx += size;
+  struct timespec* t    = &state->start;
+  size_t           disk = dcache.nsegs > 0 ? dcache.seg_size - DC_HDR : 0;
+
+  state->fill_next = false;
+
+  /* Neither tier would keep it */
+  if(hdr_len + state->resp_left > fcache.max_entry &&
+     hdr_len + state->resp_left > disk)
+    return;
+
+  if(atoi(state->resp_hdr + strlen("HTTP/1.1 ")) != 200 ||
+     !state->reusable || state->resp_left == 0)
+    return;
 
-  return;
+  state->fill = fc_new(&fcache, state->fill_key, state->resp_hdr, hdr_len,
+                       state->resp_left);
+
+  /* Until the body is in, elapsed holds when the request went out */
+  if(state->fill != NULL)
+    state->fill->elapsed = 1000000000ULL * t->tv_sec + t->tv_nsec;
 }
 
-int parse_headers_serv(fsm* state)
+/* Copies body bytes into the entry, which goes into the cache once */
+/* the whole body is in.                                            */
+static void fill_body(fsm* state, char* buf, int n)
 {
-  char* CRLF; char* hdr_start; size_t length;
-  struct serv_rep* servst = state->servst;
-  char* body_size;
+  struct fc_entry* e = state->fill;
+  struct timespec  now;
 
-  /* Check for CRLF */
-  CRLF = memmem(servst->response, servst->end_idx, "\r\n\r\n", strlen("\r\n\r\n"));
+  memcpy(e->data + e->filled, buf, n);
+  e->filled += n;
 
-  if (CRLF == NULL)
-    return -1;
+  if(e->filled < e->len)
+    return;
 
-  hdr_start = memmem(servst->response, servst->end_idx, "Content-Length:",
-                  strlen("Content-Length:"));
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  e->elapsed = 1000000000ULL * now.tv_sec + now.tv_nsec - e->elapsed;
 
-  CRLF = memmem(hdr_start, servst->end_idx, "\r\n", strlen("\r\n"));
-  length = (size_t)(CRLF - hdr_start);
-  hdr_start = strndup(hdr_start, length); // Free this guy please.
+  /* fc_put may free e */
+  dc_put(&dcache, e->key, e->data, e->hdr_len, e->len, e->elapsed);
+  fc_put(&fcache, e);
+  state->fill = NULL;
+}
 
-  if(strtok(hdr_start," ") == NULL)
-    {free(hdr_start); return 411;}
+/* Gives back the buffer the headers of a response were framed in */
+static void release_resp_hdr(fsm* state)
+{
+  bp_put(state->resp_hdr);
+  state->resp_hdr = NULL;
+}
 
-  if((body_size = strtok(NULL, " ")) == NULL)
-    {free(hdr_start); return 411;}
+/*******************************************************************/
+/* @brief Notes a request just sent to a client's server, as it is  */
+/*        now, for when its response comes in. Past FRAME_REQS in   */
+/*        flight, responses can no longer be told apart, and        */
+/*        framing is turned off.                                    */
+/*******************************************************************/
+void frame_request(fsm* state)
+{
+  struct sent_req* req;
 
-  /* Check for valid Content-Length */
-  if(!validsize(body_size))
-    {free(hdr_start); return 411;}
+  if(!state->framing)
+    return;
 
-  servst->body_size = (size_t)atoi(body_size);
-  servst->body      = calloc(1, servst->body_size + 1);
-  servst->headers = (char *) 1; // Just to go with the flow.
-  free(hdr_start);
+  if(state->sent_n == FRAME_REQS)
+    {
+      release_resp_hdr(state);
+      state->resp_hdr_len = 0;
+      state->fill_next    = false;
+      state->framing      = false;
+      state->frag_len     = 0;
+      return;
+    }
 
-  return 0;
+  req = &state->sent[(state->sent_head + state->sent_n++) % FRAME_REQS];
+  strcpy(req->chunk, state->servst->expecting == VIDEO ? state->lastchunk
+                                                       : "");
+  req->start = state->start;
 }
 
+/*******************************************************************/
+/* @brief Takes the oldest request in flight off a client's list,   */
+/*        its response having come in.                              */
+/* @param req  Set to the request, if not NULL.                     */
+/* @returns false if none was being kept track of.                  */
+/*******************************************************************/
+bool frame_answered(fsm* state, struct sent_req* req)
+{
+  if(state->sent_n == 0)
+    return false;
+
+  if(req != NULL)
+    *req = state->sent[state->sent_head];
+  state->sent_head = (state->sent_head + 1) % FRAME_REQS;
+  state->sent_n--;
 
-int  parse_body_serv(struct serv_rep* servst, char* buf, ssize_t n)
+  return true;
+}
+
+/*******************************************************************/
+/* @brief Whether the fragment chunk is on its way to a client from */
+/*        its server: asked for and not yet answered, or being      */
+/*        stored as it comes in.                                    */
+/*******************************************************************/
+bool frame_pending(fsm* state, const char* chunk)
 {
-  // ASSERT: buf contains only pure data, no headers and stuff.
+  int i;
 
-  int remaining = servst->body_size - servst->body_idx;
+  if(state->fill != NULL && !strcmp(state->fill->key, chunk))
+    return true;
 
-  if (n == 0)
-    return -1;
+  for(i = 0; i < state->sent_n; i++)
+    if(!strcmp(state->sent[(state->sent_head + i) % FRAME_REQS].chunk,
+               chunk))
+      return true;
 
-  if (n <= remaining)
+  return false;
+}
+
+/*******************************************************************/
+/* @brief Follows the responses relayed from a server to its client */
+/*        so that the proxy knows where each one ends. Headers are  */
+/*        looked at, bodies are skipped using their Content-Length. */
+/*        Once a response cannot be delimited this way, framing is  */
+/*        turned off for the rest of the connection.                */
+/* @param buf   n bytes of the server's stream, in order.           */
+/*******************************************************************/
+void frame_response(fsm* state, char* buf, int n)
+{
+  struct sent_req req;
+  const char* end;
+  int   take;
+
+  while(n > 0 && state->framing)
     {
-      memcpy(servst->body + servst->body_idx, buf, n);
-      servst->body_idx += n;
+      /* Inside a body */
+      if(state->resp_left > 0)
+        {
+          take = (n < state->resp_left) ? n : (int) state->resp_left;
 
-      if(n == remaining)
-        return 0;
+          if(state->fill != NULL)
+            fill_body(state, buf, take);
 
-      return -1;
-    }
+          buf += take;
+          n   -= take;
+          frame_skip(state, take);
+          continue;
+        }
 
-  // ASSERT: n > remaining
-  memcpy(servst->body + servst->body_idx, buf, remaining);
-  servst->body_idx += remaining;
+      /* Inside the headers */
+      if(state->resp_hdr_len == 0)
+        {
+          state->first_byte = state->end;
+
+          if(state->resp_hdr == NULL &&
+             (state->resp_hdr = bp_get()) == NULL)
+            {
+              state->framing = false;
+              return;
+            }
+        }
+
+      take = RESP_HDR_SIZE - 1 - state->resp_hdr_len;
+      if(take > n)
+        take = n;
+
+      if(take == 0)
+        {
+          release_resp_hdr(state);
+          state->framing = false;
+          return;
+        }
 
-  return resetbuf_serv(buf, remaining, n);
+      memcpy(state->resp_hdr + state->resp_hdr_len, buf, take);
+      state->resp_hdr[state->resp_hdr_len + take] = '\0';
+
+      end = scan_blank(state->resp_hdr, state->resp_hdr_len,
+                       state->resp_hdr_len + take);
+      if(end == NULL)
+        {
+          state->resp_hdr_len += take;
+          buf += take;
+          n   -= take;
+          continue;
+        }
+
+      /* Only part of this chunk was headers */
+      take = (end - state->resp_hdr) - state->resp_hdr_len;
+      buf += take;
+      n   -= take;
+
+      state->resp_hdr_len = 0;
+
+      if(frame_headers(state, end - state->resp_hdr) == -1)
+        {
+          release_resp_hdr(state);
+          state->fill_next = false;
+          state->framing   = false;
+          state->frag_len  = 0;
+          return;
+        }
+
+      /* The response is its own request's, whatever the client has
+         pipelined since. A fragment makes one throughput sample, once
+         it is all in. */
+      state->frag_len = 0;
+      if(frame_answered(state, &req))
+        {
+          strcpy(state->lastchunk, req.chunk);
+          state->start = req.start;
+
+          if(req.chunk[0] != '\0' &&
+             atoi(state->resp_hdr + strlen("HTTP/1.1 ")) == 200)
+            state->frag_len = state->resp_left;
+        }
+
+      if(state->fill_next)
+        fill_begin(state, end - state->resp_hdr);
+
+      /* Not needed again until the next response */
+      release_resp_hdr(state);
+
+      if(state->resp_left == 0)
+        state->inflight--;
+    }
 }
 
-/******************************************************************/
-/* @brief Removes prefixlen bytes from the head of buf and pushes */
-/*        everything after upwards.                               */
-/* @returns totalen - prefixlen                                   */
-/******************************************************************/
-int resetbuf_serv(char* buf, int prefixlen, ssize_t totalen)
+/**************************************************************/
+/* @brief Accounts for n body bytes that were relayed without */
+/*        being looked at (spliced).                          */
+/**************************************************************/
+void frame_skip(fsm* state, int n)
 {
-  memmove(buf, buf+prefixlen, totalen - prefixlen);
-  memset(buf + totalen-prefixlen, 0, prefixlen);
-  return totalen-prefixlen;
+  if(!state->framing)
+    return;
+
+  state->resp_left -= n;
+
+  if(state->resp_left == 0)
+    {
+      if(state->frag_len > 0)
+        sample_fragment(state);
+      state->inflight--;
+    }
 }
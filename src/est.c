@@ -0,0 +1,135 @@
+/*********************************************************************/
+/* @file est.c                                                       */
+/*                                                                   */
+/* @brief Throughput estimators. Each client keeps a struct est,     */
+/*        fed the throughput (Kbps) of everything relayed to it; the */
+/*        estimate that comes out is what the adaptation policies in */
+/*        abr.c and the prefetcher go by. Which estimator is used is */
+/*        chosen for the whole proxy.                                */
+/*********************************************************************/
+
+#include <math.h>
+#include <string.h>
+#include <strings.h>
+
+#include "est.h"
+
+/* @returns EST_EWMA, EST_HARMONIC, EST_DUAL or EST_AUTO from its name, */
+/* -1 if none.                                                          */
+int est_kind(const char* name)
+{
+  if(!strcasecmp(name, "ewma"))
+    return EST_EWMA;
+
+  if(!strcasecmp(name, "harmonic"))
+    return EST_HARMONIC;
+
+  if(!strcasecmp(name, "dual"))
+    return EST_DUAL;
+
+  if(!strcasecmp(name, "auto"))
+    return EST_AUTO;
+
+  return -1;
+}
+
+void est_init(struct est* e)
+{
+  memset(e, 0, sizeof(struct est));
+}
+
+/* Harmonic mean of the window; a sample of 0 counts as 1 Kbps */
+static double est_harmonic(struct est* e)
+{
+  double sum = 0;
+  int    i;
+
+  for(i = 0; i < e->nwin; i++)
+    sum += 1 / (e->win[i] > 1 ? e->win[i] : 1);
+
+  return e->nwin / sum;
+}
+
+/*******************************************************************/
+/* @brief Starts an estimate off at value, a guess made before any */
+/*        sample is in.                                            */
+/* @returns the estimate.                                          */
+/*******************************************************************/
+unsigned long long est_seed(struct est* e, int kind, double value)
+{
+  est_init(e);
+
+  if(kind == EST_HARMONIC)
+    {
+      e->win[0] = value;
+      e->nwin   = 1;
+      e->next   = 1;
+    }
+
+  e->avg  = value;
+  e->fast = value;
+  e->n    = 1;
+
+  return value;
+}
+
+/*******************************************************************/
+/* @brief Takes in a throughput sample.                            */
+/* @param alpha  Weight of the sample under EST_EWMA.              */
+/* @returns the estimate (Kbps).                                   */
+/*******************************************************************/
+unsigned long long est_add(struct est* e, int kind, double alpha,
+                           double sample)
+{
+  double a, error;
+
+  switch(kind)
+    {
+    case EST_HARMONIC:
+      e->win[e->next] = sample;
+      e->next = (e->next + 1) % EST_WINDOW;
+      if(e->nwin < EST_WINDOW)
+        e->nwin++;
+      e->n++;
+      return est_harmonic(e);
+
+    case EST_DUAL:
+      /* Quick to fall, slow to rise */
+      if(e->n++ == 0)
+        e->fast = e->avg = sample;
+      else
+        {
+          e->fast = EST_FAST * sample + (1 - EST_FAST) * e->fast;
+          e->avg  = EST_SLOW * sample + (1 - EST_SLOW) * e->avg;
+        }
+      return e->fast < e->avg ? e->fast : e->avg;
+
+    case EST_AUTO:
+      /* Trigg and Leach: alpha is how consistently the estimate has
+         been off in one direction. A shift in the link moves it up;
+         noise around a steady rate averages out and moves it down. */
+      if(e->n++ == 0)
+        {
+          e->avg = sample;
+          return e->avg;
+        }
+
+      error     = sample - e->avg;
+      e->err    = EST_BETA * error + (1 - EST_BETA) * e->err;
+      e->abserr = EST_BETA * fabs(error) + (1 - EST_BETA) * e->abserr;
+
+      a = e->abserr > 0 ? fabs(e->err) / e->abserr : EST_ALPHA_MAX;
+      if(a < EST_ALPHA_MIN)
+        a = EST_ALPHA_MIN;
+      if(a > EST_ALPHA_MAX)
+        a = EST_ALPHA_MAX;
+
+      e->avg = a * sample + (1 - a) * e->avg;
+      return e->avg;
+
+    default:
+      e->n++;
+      e->avg = alpha * sample + (1 - alpha) * e->avg;
+      return e->avg;
+    }
+}
@@ -0,0 +1,42 @@
+/*********************************************************************/
+/* @file est.h                                                       */
+/*                                                                   */
+/* @brief Interfaces for est.c, the estimators of a client's         */
+/*        throughput that bitrate adaptation decides from.           */
+/*********************************************************************/
+#ifndef EST_H
+#define EST_H
+
+/* Estimators */
+#define EST_EWMA     0   // alpha * sample + (1 - alpha) * estimate, alpha
+                         // fixed on the command line (the default)
+#define EST_HARMONIC 1   // Harmonic mean of the last EST_WINDOW samples
+#define EST_DUAL     2   // The lower of a fast and a slow EWMA
+#define EST_AUTO     3   // EWMA whose alpha follows the errors made
+
+#define EST_WINDOW    5      // Samples the harmonic mean is over
+#define EST_FAST      0.5    // Dual: alpha of the fast EWMA
+#define EST_SLOW      0.1    // ...and of the slow one
+#define EST_BETA      0.2    // Auto: alpha the errors are smoothed with
+#define EST_ALPHA_MIN 0.05   // Auto: bounds of its alpha
+#define EST_ALPHA_MAX 0.95
+
+/* A client's estimate and what it is kept from */
+struct est {
+  double avg;                  // EWMA, auto, and the slow one of dual
+  double fast;                 // Dual's fast EWMA
+  double err;                  // Auto: smoothed error, and smoothed
+  double abserr;               // absolute error
+  double win[EST_WINDOW];      // Harmonic: the samples, oldest replaced
+  int    nwin;
+  int    next;
+  int    n;                    // Samples taken in (a seed counts)
+};
+
+int                est_kind(const char* name);
+void               est_init(struct est* e);
+unsigned long long est_seed(struct est* e, int kind, double value);
+unsigned long long est_add (struct est* e, int kind, double alpha,
+                            double sample);
+
+#endif
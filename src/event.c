@@ -0,0 +1,262 @@
+/*********************************************************************/
+/* @file event.c                                                     */
+/*                                                                   */
+/* @brief Readiness notification for the proxy. The epoll backend    */
+/*        carries a pointer to the event handle in every registered  */
+/*        descriptor, so dispatch cost scales with the number of     */
+/*        ready descriptors rather than the number of connections.   */
+/*        The select backend is kept for portability and is bound by */
+/*        FD_SETSIZE.                                                */
+/*********************************************************************/
+
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+
+#include "event.h"
+
+/*******************************************************/
+/* @brief Maps a backend name from the command line to */
+/*        its constant.                                */
+/* @returns EV_SELECT, EV_EPOLL or EV_URING, -1 if     */
+/*          unknown.                                   */
+/*******************************************************/
+int ev_backend(char* name)
+{
+  if(!strcasecmp(name, "select"))
+    return EV_SELECT;
+
+  if(!strcasecmp(name, "epoll"))
+    return EV_EPOLL;
+
+  if(!strcasecmp(name, "uring"))
+    return EV_URING;
+
+  return -1;
+}
+
+/********************************************************/
+/* @brief Initializes an event loop.                    */
+/* @param backend  EV_SELECT, EV_EPOLL or EV_URING.     */
+/*                 io_uring keeps no readiness state    */
+/*                 here; the proxy drives its ring.     */
+/* @param edge     Use edge-triggered epoll. Callers    */
+/*                 must then drain descriptors until    */
+/*                 EAGAIN.                              */
+/* @returns 0 on success, -1 otherwise.                 */
+/********************************************************/
+int ev_init(struct evloop* loop, int backend, bool edge)
+{
+  memset(loop, 0, sizeof(struct evloop));
+  loop->backend = backend;
+  loop->edge    = (backend == EV_EPOLL) && edge;
+  loop->epfd    = -1;
+  loop->maxfd   = -1;
+
+  if(backend == EV_URING)
+    return 0;
+
+  if(backend == EV_EPOLL)
+    {
+      if((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+        return -1;
+      return 0;
+    }
+
+  FD_ZERO(&loop->readfds);
+  FD_ZERO(&loop->writefds);
+  return 0;
+}
+
+static unsigned int to_epoll(struct evloop* loop, unsigned int events)
+{
+  unsigned int ev = 0;
+
+  if(events & EV_READ)
+    ev |= EPOLLIN | EPOLLRDHUP;
+  if(events & EV_WRITE)
+    ev |= EPOLLOUT;
+  if(loop->edge)
+    ev |= EPOLLET;
+
+  return ev;
+}
+
+static void select_set(struct evloop* loop, struct ev_handle* h,
+                       unsigned int events)
+{
+  FD_CLR(h->fd, &loop->readfds);
+  FD_CLR(h->fd, &loop->writefds);
+
+  if(events & EV_READ)
+    FD_SET(h->fd, &loop->readfds);
+  if(events & EV_WRITE)
+    FD_SET(h->fd, &loop->writefds);
+}
+
+/**********************************************************/
+/* @brief Registers a descriptor with the event loop.     */
+/* @param h       The handle; must outlive registration.  */
+/* @param events  EV_READ and/or EV_WRITE.                */
+/* @returns 0 on success, -1 otherwise (e.g. a select fd  */
+/*          past FD_SETSIZE).                             */
+/**********************************************************/
+int ev_add(struct evloop* loop, struct ev_handle* h, unsigned int events)
+{
+  if(loop->backend == EV_EPOLL)
+    {
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events   = to_epoll(loop, events);
+      ev.data.ptr = h;
+
+      if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, h->fd, &ev) == -1)
+        return -1;
+
+      h->events = events;
+      return 0;
+    }
+
+  if(h->fd < 0 || h->fd >= FD_SETSIZE)
+    {
+      errno = EMFILE;
+      return -1;
+    }
+
+  loop->handles[h->fd] = h;
+  select_set(loop, h, events);
+
+  if(h->fd > loop->maxfd)
+    loop->maxfd = h->fd;
+
+  h->events = events;
+  return 0;
+}
+
+/**********************************************************/
+/* @brief Changes the interest set of a registered handle */
+/* @returns 0 on success, -1 otherwise.                   */
+/**********************************************************/
+int ev_mod(struct evloop* loop, struct ev_handle* h, unsigned int events)
+{
+  if(h->events == events)
+    return 0;
+
+  if(loop->backend == EV_EPOLL)
+    {
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events   = to_epoll(loop, events);
+      ev.data.ptr = h;
+
+      if(epoll_ctl(loop->epfd, EPOLL_CTL_MOD, h->fd, &ev) == -1)
+        return -1;
+
+      h->events = events;
+      return 0;
+    }
+
+  select_set(loop, h, events);
+  h->events = events;
+  return 0;
+}
+
+/****************************************************/
+/* @brief Removes a handle from the event loop. Call*/
+/*        before closing its descriptor.            */
+/****************************************************/
+int ev_del(struct evloop* loop, struct ev_handle* h)
+{
+  if(h->fd < 0)
+    return 0;
+
+  h->events = 0;
+
+  if(loop->backend == EV_EPOLL)
+    return epoll_ctl(loop->epfd, EPOLL_CTL_DEL, h->fd, NULL);
+
+  if(h->fd >= FD_SETSIZE)
+    return 0;
+
+  FD_CLR(h->fd, &loop->readfds);
+  FD_CLR(h->fd, &loop->writefds);
+  loop->handles[h->fd] = NULL;
+
+  while(loop->maxfd >= 0 && loop->handles[loop->maxfd] == NULL)
+    loop->maxfd--;
+
+  return 0;
+}
+
+/*************************************************************/
+/* @brief Blocks until registered descriptors become ready.  */
+/* @param ready       Array to fill with ready handles.      */
+/* @param max         Capacity of ready.                     */
+/* @param timeout_ms  -1 to block indefinitely.              */
+/* @returns the number of ready handles, -1 on error.        */
+/*************************************************************/
+int ev_wait(struct evloop* loop, struct ev_ready* ready, int max,
+            int timeout_ms)
+{
+  int n, i, fd;
+
+  if(loop->backend == EV_EPOLL)
+    {
+      struct epoll_event evs[EV_MAX_READY];
+
+      if(max > EV_MAX_READY)
+        max = EV_MAX_READY;
+
+      if((n = epoll_wait(loop->epfd, evs, max, timeout_ms)) == -1)
+        return -1;
+
+      for(i = 0; i < n; i++)
+        {
+          ready[i].h      = evs[i].data.ptr;
+          ready[i].events = 0;
+
+          if(evs[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))
+            ready[i].events |= EV_READ;
+          if(evs[i].events & EPOLLOUT)
+            ready[i].events |= EV_WRITE;
+          if(evs[i].events & (EPOLLERR | EPOLLHUP))
+            ready[i].events |= EV_ERROR | EV_READ;
+        }
+
+      return n;
+    }
+
+  fd_set readfds  = loop->readfds;
+  fd_set writefds = loop->writefds;
+  struct timeval tv, *tvp = NULL;
+
+  if(timeout_ms >= 0)
+    {
+      tv.tv_sec  = timeout_ms / 1000;
+      tv.tv_usec = (timeout_ms % 1000) * 1000;
+      tvp = &tv;
+    }
+
+  if((n = select(loop->maxfd + 1, &readfds, &writefds, NULL, tvp)) <= 0)
+    return n;
+
+  for(fd = 0, i = 0; fd <= loop->maxfd && i < max; fd++)
+    {
+      unsigned int events = 0;
+
+      if(FD_ISSET(fd, &readfds))
+        events |= EV_READ;
+      if(FD_ISSET(fd, &writefds))
+        events |= EV_WRITE;
+
+      if(events && loop->handles[fd] != NULL)
+        {
+          ready[i].h      = loop->handles[fd];
+          ready[i].events = events;
+          i++;
+        }
+    }
+
+  return i;
+}
@@ -0,0 +1,72 @@
+/*********************************************************************/
+/* @file event.h                                                     */
+/*                                                                   */
+/* @brief Interfaces for event.c, a small readiness-notification     */
+/*        layer that lets the proxy run on either select() or epoll. */
+/*********************************************************************/
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdbool.h>
+#include <sys/select.h>
+
+/* Event backends */
+#define EV_SELECT 1
+#define EV_EPOLL  2
+#define EV_URING  3   // Completion based; see uring.c
+
+/* Interest / readiness bits */
+#define EV_READ   0x1
+#define EV_WRITE  0x2
+#define EV_ERROR  0x4
+
+/* What an event handle wraps */
+#define EV_LISTEN 1
+#define EV_DNS    2
+#define EV_CLIENT 3
+#define EV_SERVER 4
+#define EV_PREFETCH 5
+
+#define EV_MAX_READY 256
+
+struct state;
+
+/* One registered descriptor. Handles are embedded in whatever owns the  */
+/* descriptor, so a ready event leads straight back to its fsm.          */
+struct ev_handle {
+  int fd;
+  int kind;             // EV_LISTEN, EV_DNS, EV_CLIENT, EV_SERVER or
+                        // EV_PREFETCH
+  struct state* state;  // Owning fsm; NULL for the other kinds
+  unsigned int events;  // Interest currently registered, 0 if none
+};
+
+/* A descriptor reported ready by ev_wait */
+struct ev_ready {
+  struct ev_handle* h;
+  unsigned int events;
+};
+
+struct evloop {
+  int  backend;  // EV_SELECT, EV_EPOLL or EV_URING
+  bool edge;     // Edge-triggered notification (epoll only)
+
+  /* epoll backend */
+  int epfd;
+
+  /* select backend */
+  int maxfd;
+  fd_set readfds;
+  fd_set writefds;
+  struct ev_handle* handles[FD_SETSIZE];
+};
+
+int  ev_init(struct evloop* loop, int backend, bool edge);
+int  ev_add (struct evloop* loop, struct ev_handle* h, unsigned int events);
+int  ev_mod (struct evloop* loop, struct ev_handle* h, unsigned int events);
+int  ev_del (struct evloop* loop, struct ev_handle* h);
+int  ev_wait(struct evloop* loop, struct ev_ready* ready, int max,
+             int timeout_ms);
+int  ev_backend(char* name);
+
+#endif
@@ -0,0 +1,196 @@
+/*********************************************************************/
+/* @file fcache.c                                                    */
+/*                                                                   */
+/* @brief A bounded in-memory cache of video fragments, shared by    */
+/*        every worker. Fragments are keyed by the chunk name the    */
+/*        proxy rewrote the request to, so clients watching the same */
+/*        video at the same bitrate share entries. The least         */
+/*        recently used entries are evicted first; an entry still    */
+/*        being sent to a client is freed once it is released.       */
+/*********************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fcache.h"
+
+/**********************************************************/
+/* @brief Initializes a cache.                            */
+/* @param capacity  Bytes it may hold; 0 turns it off.    */
+/**********************************************************/
+void fc_init(struct fcache* c, size_t capacity)
+{
+  memset(c, 0, sizeof(struct fcache));
+  pthread_mutex_init(&c->lock, NULL);
+  c->capacity  = capacity;
+  c->max_entry = capacity / 4;
+}
+
+static void fc_unlink(struct fcache* c, struct fc_entry* e)
+{
+  if(e->prev == NULL)
+    c->head = e->next;
+  else
+    e->prev->next = e->next;
+
+  if(e->next == NULL)
+    c->tail = e->prev;
+  else
+    e->next->prev = e->prev;
+
+  e->prev = NULL;
+  e->next = NULL;
+}
+
+static void fc_push(struct fcache* c, struct fc_entry* e)
+{
+  e->prev = NULL;
+  e->next = c->head;
+
+  if(c->head == NULL)
+    c->tail = e;
+  else
+    c->head->prev = e;
+  c->head = e;
+}
+
+/* Takes e out of the cache; it is freed once nobody sends it */
+static void fc_evict(struct fcache* c, struct fc_entry* e)
+{
+  fc_unlink(c, e);
+  HASH_DEL(c->entries, e);
+  c->size  -= e->len;
+  e->linked = false;
+  c->evictions++;
+
+  if(e->refs == 0)
+    free(e);
+}
+
+/*******************************************************************/
+/* @brief Looks a fragment up, counting a hit or a miss.           */
+/* @returns the entry, held until fc_release, or NULL on a miss.   */
+/*******************************************************************/
+struct fc_entry* fc_get(struct fcache* c, const char* key)
+{
+  struct fc_entry* e;
+
+  pthread_mutex_lock(&c->lock);
+
+  HASH_FIND_STR(c->entries, key, e);
+
+  if(e == NULL)
+    c->misses++;
+  else
+    {
+      fc_unlink(c, e);
+      fc_push(c, e);
+      e->refs++;
+      c->hits++;
+      c->hit_bytes += e->len;
+    }
+
+  pthread_mutex_unlock(&c->lock);
+  return e;
+}
+
+/* @brief Whether key is cached, without counting a hit or a miss. */
+bool fc_has(struct fcache* c, const char* key)
+{
+  struct fc_entry* e;
+
+  pthread_mutex_lock(&c->lock);
+  HASH_FIND_STR(c->entries, key, e);
+  pthread_mutex_unlock(&c->lock);
+
+  return e != NULL;
+}
+
+void fc_release(struct fcache* c, struct fc_entry* e)
+{
+  pthread_mutex_lock(&c->lock);
+
+  if(--e->refs == 0 && !e->linked)
+    free(e);
+
+  pthread_mutex_unlock(&c->lock);
+}
+
+/*******************************************************************/
+/* @brief Starts an entry for a response the origin is sending,    */
+/*        holding its headers. The caller copies the body in       */
+/*        behind them and hands the entry to fc_put, or free()s it */
+/*        if the response is cut short. The entry may be larger    */
+/*        than this cache keeps; it is still good for the disk     */
+/*        tier.                                                    */
+/* @returns the entry, NULL if it cannot be allocated.             */
+/*******************************************************************/
+struct fc_entry* fc_new(struct fcache* c, const char* key,
+                        const char* hdr, size_t hdr_len, size_t body_len)
+{
+  struct fc_entry* e;
+
+  (void) c;
+
+  if(strlen(key) >= FC_KEY_LEN ||
+     (e = malloc(sizeof(struct fc_entry) + hdr_len + body_len)) == NULL)
+    return NULL;
+
+  memset(e, 0, sizeof(struct fc_entry));
+  strcpy(e->key, key);
+  memcpy(e->data, hdr, hdr_len);
+  e->hdr_len = hdr_len;
+  e->len     = hdr_len + body_len;
+  e->filled  = hdr_len;
+
+  return e;
+}
+
+/*******************************************************************/
+/* @brief Adds a complete entry, evicting the least recently used  */
+/*        ones to make room. If e is too large to keep, or another */
+/*        client stored the same fragment first, e is dropped.     */
+/*******************************************************************/
+void fc_put(struct fcache* c, struct fc_entry* e)
+{
+  struct fc_entry* old;
+
+  if(e->len > c->max_entry)
+    {
+      free(e);
+      return;
+    }
+
+  pthread_mutex_lock(&c->lock);
+
+  HASH_FIND_STR(c->entries, e->key, old);
+
+  if(old != NULL)
+    {
+      pthread_mutex_unlock(&c->lock);
+      free(e);
+      return;
+    }
+
+  while(c->tail != NULL && c->size + e->len > c->capacity)
+    fc_evict(c, c->tail);
+
+  HASH_ADD_STR(c->entries, key, e);
+  fc_push(c, e);
+  e->linked     = true;
+  c->size      += e->len;
+  c->fill_bytes += e->len;
+
+  pthread_mutex_unlock(&c->lock);
+}
+
+void fc_stats(struct fcache* c, FILE* file)
+{
+  if(c->capacity == 0)
+    return;
+
+  fprintf(file, "fragment cache: %llu hits, %llu misses, %llu bytes served, "
+          "%llu bytes stored, %llu evictions, %zu of %zu bytes in use\n",
+          c->hits, c->misses, c->hit_bytes, c->fill_bytes, c->evictions,
+          c->size, c->capacity);
+}
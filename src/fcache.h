@@ -0,0 +1,61 @@
+/*********************************************************************/
+/* @file fcache.h                                                    */
+/*                                                                   */
+/* @brief Interfaces for fcache.c, the proxy's in-memory cache of    */
+/*        video fragments.                                           */
+/*********************************************************************/
+#ifndef FCACHE_H
+#define FCACHE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "uthash.h"
+
+#define FC_SIZE_MB  64    // Default cache size
+#define FC_KEY_LEN  300   // As long as a client's lastchunk
+
+/* One cached response: headers and body, back to back */
+struct fc_entry {
+  char key[FC_KEY_LEN];       // The rewritten chunk name
+  size_t hdr_len;
+  size_t len;                 // Headers plus body
+  size_t filled;              // Bytes of it received so far
+  unsigned long long elapsed; // ns the origin took to send it
+  int refs;                   // Clients sending it right now
+  bool linked;                // Still in the cache
+  struct fc_entry* prev;      // LRU list, most recently used first
+  struct fc_entry* next;
+  UT_hash_handle hh;
+  char data[];
+};
+
+struct fcache {
+  pthread_mutex_t lock;
+  struct fc_entry* entries;   // Hash by key
+  struct fc_entry* head;      // Most recently used
+  struct fc_entry* tail;      // Next to be evicted
+  size_t size;                // Bytes held
+  size_t capacity;            // 0 when the cache is off
+  size_t max_entry;           // Largest response kept
+
+  /* Counters */
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long hit_bytes;   // Served from the cache
+  unsigned long long fill_bytes;  // Stored from the origin
+  unsigned long long evictions;
+};
+
+void fc_init(struct fcache* c, size_t capacity);
+struct fc_entry* fc_get    (struct fcache* c, const char* key);
+bool             fc_has    (struct fcache* c, const char* key);
+void             fc_release(struct fcache* c, struct fc_entry* e);
+struct fc_entry* fc_new    (struct fcache* c, const char* key,
+                            const char* hdr, size_t hdr_len, size_t body_len);
+void             fc_put    (struct fcache* c, struct fc_entry* e);
+void             fc_stats  (struct fcache* c, FILE* file);
+
+#endif
@@ -0,0 +1,211 @@
+/*********************************************************************/
+/* @file loadgen.c                                                   */
+/*                                                                   */
+/* @brief A small keep-alive HTTP load generator for benchmarking    */
+/*        the proxy's event backends against each other. Every      */
+/*        connection fetches the same path back to back for a fixed */
+/*        time; requests and bytes per second are reported.         */
+/*                                                                   */
+/* @usage: ./loadgen <ip> <port> <connections> <seconds> <path>      */
+/*********************************************************************/
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LG_BUF 65536
+
+struct conn {
+  int    fd;
+  char   hdr[4096];   // Response headers seen so far
+  int    hdr_len;
+  long   body_left;   // -1 while still reading headers
+};
+
+static char request[1024];
+static int  request_len;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int open_conn(struct sockaddr_in* addr)
+{
+  int fd, one = 1;
+
+  if((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    return -1;
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  if(connect(fd, (struct sockaddr *) addr, sizeof(*addr)) == -1)
+    {
+      close(fd);
+      return -1;
+    }
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+static void send_request(struct conn* c)
+{
+  c->hdr_len   = 0;
+  c->body_left = -1;
+
+  if(send(c->fd, request, request_len, MSG_NOSIGNAL) != request_len)
+    {
+      fprintf(stderr, "send failed\n");
+      exit(EXIT_FAILURE);
+    }
+}
+
+/*************************************************************/
+/* @brief Consumes n bytes of response data on a connection. */
+/* @returns the number of responses completed.               */
+/*************************************************************/
+static int consume(struct conn* c, char* buf, long n)
+{
+  int done = 0;
+
+  while(n > 0)
+    {
+      if(c->body_left < 0)
+        {
+          long take = n, i;
+          char* end;
+          char* cl;
+
+          if(take > (long) sizeof(c->hdr) - 1 - c->hdr_len)
+            take = sizeof(c->hdr) - 1 - c->hdr_len;
+
+          memcpy(c->hdr + c->hdr_len, buf, take);
+          c->hdr[c->hdr_len + take] = '\0';
+
+          if((end = strstr(c->hdr, "\r\n\r\n")) == NULL)
+            {
+              c->hdr_len += take;
+              buf += take; n -= take;
+              continue;
+            }
+
+          /* Bytes of this chunk that belonged to the headers */
+          i = (end + 4 - c->hdr) - c->hdr_len;
+          buf += i; n -= i;
+
+          cl = strcasestr(c->hdr, "Content-Length:");
+          c->body_left = cl ? atol(cl + strlen("Content-Length:")) : 0;
+        }
+
+      if(n >= c->body_left)
+        {
+          buf += c->body_left; n -= c->body_left;
+          done++;
+          send_request(c);
+          continue;
+        }
+
+      c->body_left -= n;
+      n = 0;
+    }
+
+  return done;
+}
+
+int main(int argc, char* argv[])
+{
+  struct sockaddr_in  addr;
+  struct epoll_event  ev, evs[256];
+  struct conn*        conns;
+  static char         buf[LG_BUF];
+  long long           bytes = 0, responses = 0;
+  double              start, end, elapsed;
+  int                 nconns, seconds, epfd, i, n;
+
+  if(argc != 6)
+    {
+      fprintf(stderr, "usage: %s <ip> <port> <connections> <seconds> <path>\n",
+              argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(atoi(argv[2]));
+  addr.sin_addr.s_addr = inet_addr(argv[1]);
+  nconns               = atoi(argv[3]);
+  seconds              = atoi(argv[4]);
+
+  request_len = snprintf(request, sizeof(request),
+                         "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n",
+                         argv[5], argv[1]);
+
+  if((conns = calloc(nconns, sizeof(struct conn))) == NULL ||
+     (epfd = epoll_create1(0)) == -1)
+    return EXIT_FAILURE;
+
+  for(i = 0; i < nconns; i++)
+    {
+      if((conns[i].fd = open_conn(&addr)) == -1)
+        {
+          fprintf(stderr, "connect: %s\n", strerror(errno));
+          return EXIT_FAILURE;
+        }
+
+      ev.events   = EPOLLIN;
+      ev.data.ptr = &conns[i];
+      epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+    }
+
+  start = now();
+  end   = start + seconds;
+
+  for(i = 0; i < nconns; i++)
+    send_request(&conns[i]);
+
+  while(now() < end)
+    {
+      if((n = epoll_wait(epfd, evs, 256, 100)) == -1)
+        break;
+
+      for(i = 0; i < n; i++)
+        {
+          struct conn* c = evs[i].data.ptr;
+          ssize_t got = recv(c->fd, buf, LG_BUF, 0);
+
+          if(got <= 0)
+            {
+              if(got == -1 && errno == EAGAIN)
+                continue;
+              fprintf(stderr, "connection closed by proxy\n");
+              return EXIT_FAILURE;
+            }
+
+          bytes     += got;
+          responses += consume(c, buf, got);
+        }
+    }
+
+  elapsed = now() - start;
+
+  printf("%d conns, %.1fs: %lld responses, %.0f req/s, %.2f MB/s\n",
+         nconns, elapsed, responses, responses / elapsed,
+         bytes / elapsed / (1024 * 1024));
+
+  return EXIT_SUCCESS;
+}
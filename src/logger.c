@@ -56,6 +56,8 @@ int log_state(fsm* state, FILE* file, unsigned long long tput, char* chunkname,
   if(strlen(chunkname) == 0)
     return 0;
 
+  /* One fprintf per line: the stream lock keeps lines from different */
+  /* workers whole.                                                   */
   fprintf(file, "%ld %f %llu %llu %llu %s %s\n",
           time(NULL),
           elapsed,
@@ -70,6 +72,29 @@ int log_state(fsm* state, FILE* file, unsigned long long tput, char* chunkname,
   return EXIT_SUCCESS;
 }
 
+/*****************************************************************/
+/* @brief Writes one throughput sample to the diagnostic log:    */
+/*        kind is "frag" for a whole fragment, "recv" for the    */
+/*        bytes of a single read. Times are in ns.               */
+/*****************************************************************/
+int log_sample(FILE* file, fsm* state, const char* kind, long long bytes,
+               unsigned long long ttfb, unsigned long long duration,
+               unsigned long long tput)
+{
+  fprintf(file, "%ld %s %f %f %lld %llu %s\n",
+          time(NULL),
+          kind,
+          ttfb / 1000000000.0,
+          duration / 1000000000.0,
+          bytes,
+          tput,
+          state->lastchunk);
+
+  fflush(file);
+
+  return EXIT_SUCCESS;
+}
+
 int log_dns(char* client_ip, char* response_ip, char* log_file)
 {
   FILE* fp = fopen(log_file, "a");
@@ -9,4 +9,8 @@ int log_close(FILE* file);
 int log_state(fsm* state, FILE* file, unsigned long long tput, char* chunkname,
               unsigned int long long duration);
 
+int log_sample(FILE* file, fsm* state, const char* kind, long long bytes,
+               unsigned long long ttfb, unsigned long long duration,
+               unsigned long long tput);
+
 int log_dns(char* client_ip, char* response_ip, char* log_file);
@@ -0,0 +1,316 @@
+/*********************************************************************/
+/* @file manifest.c                                                  */
+/*                                                                   */
+/* @brief The videos the proxy has parsed manifests for, shared by   */
+/*        every worker. Each keeps its own bitrate ladder, sorted    */
+/*        and without repeats, for the adaptation policies (abr.c)   */
+/*        to pick a client's bitrate from.                           */
+/*                                                                   */
+/*        Players are given the _nolist twin of a manifest, which    */
+/*        names one rendition and no bitrates, so that adaptation is */
+/*        left to the proxy. The twin is made here from the manifest */
+/*        itself rather than fetched, and is kept with the ladder:   */
+/*        until the ladder is MF_TTL old, clients asking for the     */
+/*        manifest are answered without going to the origin at all.  */
+/*                                                                   */
+/*        The table and the ladders are guarded by one rwlock; a     */
+/*        video's best bitrate is read and written atomically.       */
+/*********************************************************************/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "manifest.h"
+#include "scan.h"
+
+static struct video*    videos = NULL;
+static pthread_rwlock_t mf_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static long long mf_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int mf_cmp(const void* a, const void* b)
+{
+  return *(const int *) a - *(const int *) b;
+}
+
+/* @returns the video whose files are under path, NULL if unknown. */
+struct video* mf_find(const char* path)
+{
+  struct video* v;
+
+  pthread_rwlock_rdlock(&mf_lock);
+  HASH_FIND_STR(videos, path, v);
+  pthread_rwlock_unlock(&mf_lock);
+
+  return v;
+}
+
+/*******************************************************************/
+/* @brief Whether v's ladder came from manifest and is recent      */
+/*        enough that the manifest need not be fetched again.      */
+/*******************************************************************/
+bool mf_fresh(struct video* v, const char* manifest)
+{
+  bool fresh;
+
+  pthread_rwlock_rdlock(&mf_lock);
+  fresh = v->n > 0 && !strcmp(v->manifest, manifest) &&
+          mf_now() - v->fetched < MF_TTL;
+  pthread_rwlock_unlock(&mf_lock);
+
+  return fresh;
+}
+
+/* @returns the end of the <media> element starting at m, NULL if */
+/* it is cut short before fend.                                    */
+static const char* mf_media_end(const char* m, const char* fend)
+{
+  const char* end = memchr(m, '>', fend - m);
+
+  if(end == NULL)
+    return NULL;
+  if(end[-1] == '/')
+    return end + 1;
+
+  end = scan_find(end, fend - end, "</media>", strlen("</media>"));
+  if(end == NULL)
+    return NULL;
+  return end + strlen("</media>");
+}
+
+/*******************************************************************/
+/* @brief Makes the _nolist twin of the manifest f4m (len bytes):   */
+/*        document with only its first <media>, and that without    */
+/*        its bitrate, as a whole 200 response.                     */
+/* @returns the response, NULL if f4m has no media.                 */
+/*******************************************************************/
+static char* mf_synth(const char* f4m, size_t flen, size_t* len)
+{
+  const char* fend  = f4m + flen;
+  const char* first = scan_find(f4m, flen, "<media", strlen("<media"));
+  const char* end;
+  const char* m;
+  const char* from;
+  const char* to;
+  char*  body;
+  char*  resp;
+  size_t n = 0;
+  int    hdr;
+
+  if(first == NULL || (end = mf_media_end(first, fend)) == NULL ||
+     (body = malloc(flen + 1)) == NULL)
+    return NULL;
+
+  /* Up to and through the first media, less its bitrate */
+  if((from = scan_find(first, end - first, " bitrate=\"",
+                       strlen(" bitrate=\""))) != NULL &&
+     (to = memchr(from + strlen(" bitrate=\""), '"',
+                  end - (from + strlen(" bitrate=\"")))) != NULL)
+    {
+      memcpy(body, f4m, from - f4m);
+      n = from - f4m;
+      memcpy(body + n, to + 1, end - (to + 1));
+      n += end - (to + 1);
+    }
+  else
+    {
+      memcpy(body, f4m, end - f4m);
+      n = end - f4m;
+    }
+
+  /* Then everything but the other media, each with its own line */
+  for(from = end;
+      (m = scan_find(from, fend - from, "<media", strlen("<media"))) != NULL &&
+      (to = mf_media_end(m, fend)) != NULL; from = to)
+    {
+      while(m > from && (m[-1] == ' ' || m[-1] == '\t'))
+        m--;
+      if(m[-1] == '\n')
+        {
+          if(*to == '\r')
+            to++;
+          if(*to == '\n')
+            to++;
+        }
+
+      memcpy(body + n, from, m - from);
+      n += m - from;
+    }
+
+  memcpy(body + n, from, fend - from);
+  n += fend - from;
+
+  hdr = snprintf(NULL, 0, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n"
+                 "Content-Length: %zu\r\n\r\n", MF_TYPE, n);
+
+  if((resp = malloc(hdr + n + 1)) != NULL)
+    {
+      snprintf(resp, hdr + 1, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n"
+               "Content-Length: %zu\r\n\r\n", MF_TYPE, n);
+      memcpy(resp + hdr, body, n);
+      *len = hdr + n;
+    }
+
+  free(body);
+  return resp;
+}
+
+/*******************************************************************/
+/* @brief Records the ladder of the video under path from the text */
+/*        of its manifest (len bytes of f4m), and the _nolist twin */
+/*        of it, replacing any it had.                             */
+/* @returns the video, NULL if it cannot be stored.                */
+/*******************************************************************/
+struct video* mf_register(const char* path, const char* manifest,
+                          const char* f4m, size_t len)
+{
+  struct video* v;
+  const char*   fend = f4m + len;
+  const char*   value;
+  size_t        vlen;
+  int*          ladder = NULL;
+  int*          grown;
+  char*         nolist;
+  size_t        nolist_len = 0;
+  int           n = 0, cap = 0, i, j;
+
+  if(strlen(path) >= MF_PATH_LEN || strlen(manifest) >= MF_PATH_LEN)
+    return NULL;
+
+  nolist = mf_synth(f4m, len, &nolist_len);
+
+  /* Every bitrate="..." attribute, in any order */
+  for(; (value = scan_attr(f4m, fend - f4m, "bitrate=", &vlen)) != NULL;
+      f4m = value + vlen)
+    {
+      if(n == cap)
+        {
+          cap = cap ? 2 * cap : 8;
+          if((grown = realloc(ladder, cap * sizeof(int))) == NULL)
+            break;
+          ladder = grown;
+        }
+
+      ladder[n++] = atoi(value);
+    }
+
+  qsort(ladder, n, sizeof(int), mf_cmp);
+
+  for(i = j = 0; i < n; i++)
+    if(ladder[i] > 0 && (j == 0 || ladder[i] != ladder[j - 1]))
+      ladder[j++] = ladder[i];
+  n = j;
+
+  pthread_rwlock_wrlock(&mf_lock);
+
+  HASH_FIND_STR(videos, path, v);
+  if(v == NULL)
+    {
+      if((v = calloc(1, sizeof(struct video))) == NULL)
+        {
+          pthread_rwlock_unlock(&mf_lock);
+          free(ladder);
+          free(nolist);
+          return NULL;
+        }
+
+      strcpy(v->path, path);
+      HASH_ADD_STR(videos, path, v);
+    }
+
+  free(v->ladder);
+  free(v->nolist);
+  strcpy(v->manifest, manifest);
+  v->ladder     = ladder;
+  v->n          = n;
+  v->nolist     = nolist;
+  v->nolist_len = nolist_len;
+  v->fetched    = mf_now();
+
+  /* Clients start over from the bottom rung. The ladder is only safe
+     to read under the lock: another registration may replace it. */
+  __atomic_store_n(&v->best, n > 0 ? ladder[0] : 0, __ATOMIC_RELAXED);
+
+  pthread_rwlock_unlock(&mf_lock);
+  return v;
+}
+
+/*******************************************************************/
+/* @brief Copies out the _nolist twin of manifest, if v has one     */
+/*        made from it that is still fresh.                         */
+/* @returns the response, to be freed, or NULL.                     */
+/*******************************************************************/
+char* mf_nolist(struct video* v, const char* manifest, size_t* len)
+{
+  char* resp = NULL;
+
+  pthread_rwlock_rdlock(&mf_lock);
+
+  if(v->nolist != NULL && !strcmp(v->manifest, manifest) &&
+     mf_now() - v->fetched < MF_TTL &&
+     (resp = malloc(v->nolist_len)) != NULL)
+    {
+      memcpy(resp, v->nolist, v->nolist_len);
+      *len = v->nolist_len;
+    }
+
+  pthread_rwlock_unlock(&mf_lock);
+  return resp;
+}
+
+/* @returns the lowest bitrate of v, 0 if it has none. */
+int mf_smallest(struct video* v)
+{
+  int s;
+
+  pthread_rwlock_rdlock(&mf_lock);
+  s = v->n > 0 ? v->ladder[0] : 0;
+  pthread_rwlock_unlock(&mf_lock);
+
+  return s;
+}
+
+/* @returns the highest bitrate of v at most rate, else its lowest; */
+/* 0 if it has none.                                                */
+int mf_below(struct video* v, unsigned long long rate)
+{
+  int s = 0, i;
+
+  pthread_rwlock_rdlock(&mf_lock);
+  for(i = 0; i < v->n && (i == 0 || (unsigned long long) v->ladder[i] <= rate);
+      i++)
+    s = v->ladder[i];
+  pthread_rwlock_unlock(&mf_lock);
+
+  return s;
+}
+
+/*******************************************************************/
+/* @brief Picks a bitrate of v for a client by policy, from what   */
+/*        in says of the client; the ladder is filled in here.     */
+/* @returns the bitrate, 0 if the policy picks none.               */
+/*******************************************************************/
+int mf_pick(struct video* v, int policy, struct abr_in* in)
+{
+  int pick;
+
+  pthread_rwlock_rdlock(&mf_lock);
+
+  in->ladder = v->ladder;
+  in->n      = v->n;
+  pick       = abr_pick(policy, in);
+  pick       = pick >= 0 ? v->ladder[pick] : 0;
+  in->ladder = NULL;
+
+  pthread_rwlock_unlock(&mf_lock);
+  return pick;
+}
@@ -0,0 +1,48 @@
+/*********************************************************************/
+/* @file manifest.h                                                  */
+/*                                                                   */
+/* @brief Interfaces for manifest.c, the registry of the videos the  */
+/*        proxy has seen manifests for and their bitrate ladders.    */
+/*********************************************************************/
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "uthash.h"
+#include "abr.h"
+
+#define MF_PATH_LEN 256
+#define MF_TTL      300000   // ms a ladder is used before its manifest is
+                             // fetched again
+#define MF_TYPE     "text/xml"   // Content-Type of the _nolist twins made
+
+/* A video is known by the directory its manifest and fragments are   */
+/* in, since fragment names carry nothing else. Videos are never      */
+/* freed, so clients may keep pointers to them.                       */
+struct video {
+  char path[MF_PATH_LEN];      // Key
+  char manifest[MF_PATH_LEN];  // URI of the manifest the ladder is from
+  int* ladder;                 // Bitrates (Kbps), ascending, no repeats
+  int  n;
+  long long fetched;           // ms when the manifest was parsed
+  unsigned long long best;     // Last bitrate picked for any of its
+                               // clients; new clients start there
+  char*  nolist;               // The _nolist twin of the manifest, made
+  size_t nolist_len;           // from it as a whole response; NULL if the
+                               // manifest had no media to make it from
+  UT_hash_handle hh;
+};
+
+struct video* mf_find    (const char* path);
+bool          mf_fresh   (struct video* v, const char* manifest);
+char*         mf_nolist  (struct video* v, const char* manifest,
+                          size_t* len);
+struct video* mf_register(const char* path, const char* manifest,
+                          const char* f4m, size_t len);
+int           mf_smallest(struct video* v);
+int           mf_below   (struct video* v, unsigned long long rate);
+int           mf_pick    (struct video* v, int policy, struct abr_in* in);
+
+#endif
@@ -3,7 +3,7 @@
 /*
 extern char* dns_ip;
 extern short dns_port;
-extern int   dns_sock;
+extern __thread int dns_sock;
 */
 
 /**
@@ -328,8 +328,8 @@ void gen_other_half(dns_message* info){
 				(info->AA << 10) | (info->TC 	 << 9)  |
 				(info->RD << 8)  | (info->RA 	 << 7)  |
 				(info->Z  << 6)  | (info->AD 	 << 5)  |
-				(info->CD << 4)  | (info->OPCODE);
-  final = final & 0xFF;
+				(info->CD << 4)  | (info->RCODE);
+  final = final & 0xFFFF;
 	dec2hex2binary(final, 4, info->OTHER_HALF);
 }
 
@@ -520,11 +520,13 @@ question* gen_question(uint8_t* QNAME, size_t QNAME_len)
 /* @param  NAME_len  The length of the NAME field.                      */
 /* @param  RDATA     The data of the response.                          */
 /* @param  RDLENGTH  By default, this should be 4 (bytes).              */
+/* @param  TTL       Seconds the answer may be cached; the field is     */
+/*                   2 bytes in this format.                            */
 /*                                                                      */
 /* @returns A pointer to an answer struct. Make sure to free.           */
 /************************************************************************/
 answer* gen_answer(uint8_t* NAME, size_t NAME_len,
-                   uint8_t* RDATA)
+                   uint8_t* RDATA, int TTL)
 {
   //@assert length(RDATA) == 4 bytes.
   //@assert strlen(NAME) + 1 == NAME_len.
@@ -537,7 +539,8 @@ answer* gen_answer(uint8_t* NAME, size_t NAME_len,
   memcpy(a->NAME, NAME, NAME_len);
   a->TYPE[1]         = 1;
   a->CLASS[1]        = 1;
-  a->TTL[1]          = 0;
+  a->TTL[0]          = (TTL >> 8) & 0xFF;
+  a->TTL[1]          = TTL & 0xFF;
   a->RDLENGTH[1]     = 4;
   memcpy(a->RDATA, RDATA, 4);
 
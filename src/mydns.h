@@ -111,7 +111,7 @@ struct byte_buf* gen_QNAME(char* name, size_t len);
 void      gen_RDATA(char* ip, uint8_t* ans);
 question* gen_question(uint8_t* QNAME, size_t QNAME_len);
 answer*   gen_answer(uint8_t* NAME, size_t NAME_len,
-                     uint8_t* RDATA);
+                     uint8_t* RDATA, int TTL);
 
 void free_dns(dns_message* info);
 int binary2int(uint8_t *buf, int len);
@@ -3,6 +3,7 @@
 
 /* Globals */
 bool   rr;
+int    ttl     = NSD_TTL;
 size_t rrcount = 0;
 size_t numsrvs = 0;
 
@@ -15,30 +16,37 @@ lsa*  lsa_hash = NULL;
 int main(int argc, char* argv[])
 {
   char                 *ip;
-  int                  listen_fd, port;
+  int                  listen_fd, port, opt;
   struct sockaddr_in   serv_addr;
 
-  if (argc == 6)
-    {
-      rr = false;
-      log_file     = argv[1];
-      ip           = argv[2];
-      port         = atoi(argv[3]);
-      servers_file = argv[4];
-      lsa_file     = argv[5];
-    }
-  else if (argc == 7)
+  rr = false;
+
+  while ((opt = getopt(argc, argv, "rt:")) != -1)
     {
-      rr = true;
-      log_file     = argv[2];
-      ip           = argv[3];
-      port         = atoi(argv[4]);
-      servers_file = argv[5];
-      lsa_file     = argv[6];
+      switch (opt)
+        {
+        case 'r':
+          rr = true;
+          break;
+        case 't':
+          ttl = atoi(optarg);
+          if (ttl < 0 || ttl > 0xFFFF)
+            usage();
+          break;
+        default:
+          usage();
+        }
     }
-  else
+
+  if (argc - optind != 5)
     usage();
 
+  log_file     = argv[optind];
+  ip           = argv[optind + 1];
+  port         = atoi(argv[optind + 2]);
+  servers_file = argv[optind + 3];
+  lsa_file     = argv[optind + 4];
+
   /* Count the number of servers */
   numsrvs = num_server();
 
@@ -179,7 +187,7 @@ void process_inbound_udp(int sock)
   dumquery[0]          = q2send;
 
   answer* response =
-      gen_answer(qname2send->buf, qname2send->pos + 2, iphex);
+      gen_answer(qname2send->buf, qname2send->pos + 2, iphex, ttl);
 
   answer** dumresponse = calloc(1, sizeof(answer*));
   dumresponse[0] = response;
@@ -200,6 +208,9 @@ void process_inbound_udp(int sock)
 
 void usage()
 {
-  printf("Usage: ./nameserver [-r] <log> <ip> <port> <servers> <LSAs> \n");
+  printf("Usage: ./nameserver [-r] [-t ttl] <log> <ip> <port> <servers> <LSAs> \n");
+  printf("  -r  answer round robin instead of by shortest path\n");
+  printf("  -t  seconds an answer may be cached, 0 for none (default %d)\n",
+         NSD_TTL);
   exit(1);
 }
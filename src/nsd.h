@@ -23,6 +23,8 @@
 #include "mydns.h"
 #include "logger.h"
 
+#define NSD_TTL 30  // Default seconds an answer may be cached
+
 void usage();
 void process_inbound_udp(int sock);
 
@@ -0,0 +1,252 @@
+/*********************************************************************/
+/* @file outq.c                                                      */
+/*                                                                   */
+/* @brief Output queues for non-blocking sockets. Whatever a socket  */
+/*        will not take right away is kept here, in order, until it  */
+/*        becomes writable again. Bytes that were spliced into a     */
+/*        pipe stay there and are queued by length only, so they are */
+/*        still never copied into the proxy. Ranges of files are     */
+/*        queued by position the same way and go out by sendfile().  */
+/*********************************************************************/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#include "outq.h"
+
+void outq_init(struct outq* q)
+{
+  memset(q, 0, sizeof(struct outq));
+  q->pipefd = -1;
+}
+
+static struct outbuf* outq_append(struct outq* q, int kind, size_t len)
+{
+  struct outbuf* b;
+
+  if((b = malloc(sizeof(struct outbuf) + (kind == OQ_MEM ? len : 0))) == NULL)
+    return NULL;
+
+  b->next = NULL;
+  b->kind = kind;
+  b->len  = len;
+  b->off  = 0;
+  b->pin  = NULL;
+
+  if(q->tail == NULL)
+    q->head = b;
+  else
+    q->tail->next = b;
+  q->tail = b;
+
+  q->bytes += len;
+  return b;
+}
+
+/*****************************************************************/
+/* @brief Writes len bytes to fd, queueing whatever the socket   */
+/*        does not take. Nothing is written ahead of bytes that  */
+/*        are already queued.                                    */
+/* @returns 0 on success, -1 on a socket error or out of memory. */
+/*****************************************************************/
+int outq_write(struct outq* q, int fd, const char* buf, size_t len)
+{
+  ssize_t n = 0;
+
+  if(len == 0)
+    return 0;
+
+  /* Nothing queued: try the socket first, it usually takes it all */
+  if(q->head == NULL)
+    {
+      if((n = send(fd, buf, len, MSG_NOSIGNAL)) == -1)
+        {
+          if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            return -1;
+          n = 0;
+        }
+
+      if((size_t) n == len)
+        return 0;
+    }
+
+  return outq_push(q, buf + n, len - n);
+}
+
+/**************************************************************/
+/* @brief Queues a copy of len bytes without trying to write  */
+/*        them, e.g. while the socket is still connecting.    */
+/* @returns 0 on success, -1 if out of memory.                */
+/**************************************************************/
+int outq_push(struct outq* q, const char* buf, size_t len)
+{
+  struct outbuf* b;
+
+  if(len == 0)
+    return 0;
+
+  if((b = outq_append(q, OQ_MEM, len)) == NULL)
+    return -1;
+
+  memcpy(b->data, buf, len);
+  return 0;
+}
+
+/***************************************************************/
+/* @brief Queues len bytes that were just spliced into q's     */
+/*        pipe, behind everything queued before them.          */
+/* @returns 0 on success, -1 if out of memory.                 */
+/***************************************************************/
+int outq_piped(struct outq* q, size_t len)
+{
+  if(q->tail != NULL && q->tail->kind == OQ_PIPE)
+    {
+      q->tail->len += len;
+      q->bytes     += len;
+    }
+  else if(outq_append(q, OQ_PIPE, len) == NULL)
+    return -1;
+
+  q->piped += len;
+  return 0;
+}
+
+/**************************************************************/
+/* @brief Sends len bytes of file from off to fd without them */
+/*        passing through the proxy, queueing whatever the    */
+/*        socket does not take. The caller's hold on pin is   */
+/*        handed over: it is dropped once the bytes are out   */
+/*        or the queue is cleared, since until then the range */
+/*        must not change.                                    */
+/* @returns 0 on success, -1 on a socket error or out of      */
+/*          memory (pin is dropped either way).               */
+/**************************************************************/
+int outq_file(struct outq* q, int fd, int file, off_t off, size_t len,
+              int* pin)
+{
+  struct outbuf* b;
+  off_t   pos = off;
+  ssize_t n   = 0;
+
+  if(q->head == NULL)
+    {
+      if((n = sendfile(fd, file, &pos, len)) == -1)
+        {
+          if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+              __atomic_sub_fetch(pin, 1, __ATOMIC_ACQ_REL);
+              return -1;
+            }
+          n = 0;
+        }
+
+      if((size_t) n == len)
+        {
+          __atomic_sub_fetch(pin, 1, __ATOMIC_ACQ_REL);
+          return 0;
+        }
+    }
+
+  if((b = outq_append(q, OQ_FILE, len - n)) == NULL)
+    {
+      __atomic_sub_fetch(pin, 1, __ATOMIC_ACQ_REL);
+      return -1;
+    }
+
+  b->fd   = file;
+  b->foff = off + n;
+  b->pin  = pin;
+  return 0;
+}
+
+static void outq_free(struct outbuf* b)
+{
+  if(b->pin != NULL)
+    __atomic_sub_fetch(b->pin, 1, __ATOMIC_ACQ_REL);
+  free(b);
+}
+
+static ssize_t outq_send(struct outq* q, struct outbuf* b, int fd)
+{
+  off_t pos;
+
+  if(b->kind == OQ_PIPE)
+    return splice(q->pipefd, NULL, fd, NULL, b->len - b->off,
+                  SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+  if(b->kind == OQ_FILE)
+    {
+      pos = b->foff + b->off;
+      return sendfile(fd, b->fd, &pos, b->len - b->off);
+    }
+
+  return send(fd, b->data + b->off, b->len - b->off, MSG_NOSIGNAL);
+}
+
+/*******************************************************************/
+/* @brief Writes queued bytes to fd until the queue is empty or the */
+/*        socket is full.                                           */
+/* @returns 0 if the queue is empty, 1 if bytes are left, -1 on     */
+/*          error.                                                  */
+/*******************************************************************/
+int outq_flush(struct outq* q, int fd)
+{
+  struct outbuf* b;
+  ssize_t n;
+
+  while((b = q->head) != NULL)
+    {
+      if((n = outq_send(q, b, fd)) == -1)
+        {
+          if(errno == EINTR)
+            continue;
+          if(errno == EAGAIN || errno == EWOULDBLOCK)
+            return 1;
+          return -1;
+        }
+
+      /* The pipe ran dry (or the file ended) under us */
+      if(n == 0)
+        {
+          errno = EPIPE;
+          return -1;
+        }
+
+      b->off   += n;
+      q->bytes -= n;
+      if(b->kind == OQ_PIPE)
+        q->piped -= n;
+
+      if(b->off < b->len)
+        continue;
+
+      q->head = b->next;
+      if(q->head == NULL)
+        q->tail = NULL;
+      outq_free(b);
+    }
+
+  return 0;
+}
+
+/* @brief Drops everything queued. */
+void outq_clear(struct outq* q)
+{
+  struct outbuf* b;
+
+  while((b = q->head) != NULL)
+    {
+      q->head = b->next;
+      outq_free(b);
+    }
+
+  q->tail  = NULL;
+  q->bytes = 0;
+  q->piped = 0;
+}
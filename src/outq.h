@@ -0,0 +1,46 @@
+/*********************************************************************/
+/* @file outq.h                                                      */
+/*                                                                   */
+/* @brief Interfaces for outq.c, the per-connection output queues    */
+/*        that let the proxy write to non-blocking sockets.          */
+/*********************************************************************/
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* What a queued chunk holds */
+#define OQ_MEM   1   // Bytes copied into the chunk
+#define OQ_PIPE  2   // Bytes waiting in the queue's splice pipe
+#define OQ_FILE  3   // A range of a file, sent with sendfile()
+
+struct outbuf {
+  struct outbuf* next;
+  int    kind;       // OQ_MEM or OQ_PIPE
+  size_t len;        // Bytes in the chunk
+  size_t off;        // Bytes of it already written
+  int    fd;         // OQ_FILE: the file,
+  off_t  foff;       // where the range starts,
+  int*   pin;        // and the count keeping it intact, dropped when done
+  char   data[];     // OQ_MEM only
+};
+
+struct outq {
+  struct outbuf* head;
+  struct outbuf* tail;
+  size_t bytes;      // Unwritten bytes in the whole queue
+  size_t piped;      // Of those, how many sit in the pipe
+  int    pipefd;     // Read end of the splice pipe, -1 if none
+};
+
+void outq_init (struct outq* q);
+int  outq_write(struct outq* q, int fd, const char* buf, size_t len);
+int  outq_push (struct outq* q, const char* buf, size_t len);
+int  outq_piped(struct outq* q, size_t len);
+int  outq_file (struct outq* q, int fd, int file, off_t off, size_t len,
+                int* pin);
+int  outq_flush(struct outq* q, int fd);
+void outq_clear(struct outq* q);
+
+#endif
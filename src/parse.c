@@ -1,66 +1,95 @@
 #include "parse.h"
+#include "engine.h"
 #include "logger.h"
 
 extern FILE* logfile;
-extern struct bitrate *all_bitrates;
-extern unsigned long long int global_best;
-extern unsigned long long global_smallest;
+extern FILE* samplelog;
 
-int smallest_bitrate(struct bitrate* b)
+/* @returns milliseconds on the monotonic clock. */
+static long long mono_ms(void)
 {
-  int s = b->bitrate;
-  struct bitrate* current;
-  struct bitrate* tmp;
+  struct timespec now;
 
-  HASH_ITER(hh, b, current, tmp)
-    {
-      if(current->bitrate < s)
-        s = current->bitrate;
-    }
-
-  return s;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
 }
 
 /*********************************************************/
-/* @brief Parse a .f4m file to obtain bitrates.          */
-/* @param state - state of the client to store bitrates. */
-/* @param f4m   - The .f4m file.                         */
+/* @brief Starts the estimate of a client that has none  */
+/*        from what its network has had from its origin  */
+/*        before or, if too little is known, from the    */
+/*        lowest bitrate of its video.                   */
 /*********************************************************/
-void parse_f4m(fsm* state)
+static void warm_start(fsm* state)
 {
-  struct serv_rep* servst = state->servst;
-  char *buf = servst->body, *needle1 = NULL, *needle2 = NULL;
-  char number[200] = {0};
-  size_t len = 0;
-  int bitrate_f4m = 0;
-  struct bitrate* rate = NULL;
-
-  while((needle1 = strstr(buf, "bitrate=")) != NULL)
-    {
-      needle2 = strstr(needle1 + strlen("bitrate=") + 1, "\"");
-      len     = needle2 - (needle1 + strlen("bitrate=") + 1);
+  unsigned long long prior;
 
-      bzero(number, 200);
-      strncpy(number, needle1 + strlen("bitrate=") + 1, len);
+  if(state->avg_tput != 0 || state->video == NULL)
+    return;
+
+  prior = pr_get(state->cli_ip, state->serv_addr.sin_addr.s_addr, mono_ms());
+  state->avg_tput = est_seed(&state->est, estimator,
+                             prior > 0 ? prior :
+                             (unsigned long long) mf_smallest(state->video));
+}
+
+/*********************************************************/
+/* @brief Picks the bitrate of a client's next fragment  */
+/*        by the adaptation policy; failing that, it     */
+/*        stays where it was, or starts at the bottom.   */
+/*        Either way it is held to its fair share.       */
+/*********************************************************/
+static void choose_bitrate(fsm* state)
+{
+  struct abr_in      in;
+  unsigned long long best;
+  int                low;
 
-      bitrate_f4m = atoi(number);
+  in.tput   = state->avg_tput;
+  in.buffer = state->buffer;
+  in.last   = state->bitrate;
+  in.cap    = fair ? sh_share(state->group) : 0;
 
-      rate          = calloc(sizeof(struct bitrate), 1);
-      rate->bitrate = bitrate_f4m;
-      HASH_ADD_INT(all_bitrates, bitrate, rate);
+  /* Not the video's best: that is whatever any client last got */
+  if((best = mf_pick(state->video, abr, &in)) == 0)
+    {
+      best = state->bitrate > 0 ? (unsigned long long) state->bitrate :
+             (unsigned long long) mf_smallest(state->video);
 
-      buf = needle2;
+      /* The policy's pick is capped already; the fallback is not */
+      if(in.cap > 0 && best > in.cap &&
+         (low = mf_below(state->video, in.cap)) > 0)
+        best = low;
     }
+  else
+    __atomic_store_n(&state->video->best, best, __ATOMIC_RELAXED);
+
+  state->current_best = best;
+}
 
-  global_best = smallest_bitrate(all_bitrates);
-  global_smallest = global_best;
+/*********************************************************/
+/* @brief Registers the ladder of the .f4m manifest just */
+/*        fetched for a client, and starts the client's  */
+/*        throughput estimate (warm_start).              */
+/* @param state - state of the client that asked for it. */
+/*********************************************************/
+void parse_f4m(fsm* state)
+{
+  struct video* v = mf_register(state->mf_path, state->mf_uri,
+                                state->servst->body,
+                                state->servst->body_size);
 
+  if(v == NULL)
+    return;
+
+  state->video = v;
+  warm_start(state);
 }
 
 /* Returns a substring of the given string from [start,end). */
 void getSubstring(char *dest, char *src, int start, int end){
     strncpy(dest, src + start, end - start);
-    strncat(dest, "\0", 1);
+    dest[end - start] = '\0';
 }
 
 /* @brief Calculates the throughput and updates the average throughput and 
@@ -76,9 +105,7 @@ void calculate_bitrate(fsm* state){
   size_t    size         = state->body_size;
   struct timespec *start = &(state->start);
   struct timespec *end   = &(state->end);
-  unsigned long long int    bitrate;
-  unsigned long long int    current_best = 0;
-  unsigned long long int    smallest = 1000000000;
+  long long                 now;
 
   unsigned long long int start_time =
     1000000000 * (start->tv_sec) + (start->tv_nsec);
@@ -89,30 +116,26 @@ void calculate_bitrate(fsm* state){
 
   unsigned long long throughput = (size * 8 * 1000000) / elapsed; /* kilobits per second */
 
-  struct bitrate* current = NULL;
-  struct bitrate* tmp     = NULL;
-  state->avg_tput = (alpha * throughput) + (1 - alpha)*(state->avg_tput);
-
-  HASH_ITER(hh, all_bitrates, current, tmp) {
-    /* This code loops through all struct bitrates */
-    /* All bitrates are in units of Kbps */
-    bitrate = current->bitrate;
-    if((bitrate * 1.5) < state->avg_tput)
-      {
-        if(bitrate > current_best)
-          current_best = bitrate;
-      }
-
-    if(bitrate < smallest)
-      smallest = bitrate;
-  }
+  state->avg_tput = est_add(&state->est, estimator, alpha, throughput);
 
-  if(current_best == 0)
-    state->current_best = global_best;
-  else
-    state->current_best = current_best;
+  /* The player's buffer gains the video it is sent and plays out in
+     real time */
+  now = end_time / 1000000;
+  if(state->bitrate > 0)
+    {
+      if(state->buf_at > 0)
+        state->buffer -= now - state->buf_at;
+      if(state->buffer < 0)
+        state->buffer = 0;
+
+      state->buffer += (long long) size * 8 / state->bitrate;
+      if(state->buffer > ABR_BUF_MAX)
+        state->buffer = ABR_BUF_MAX;
+      state->buf_at = now;
+    }
 
-  global_best = state->current_best;
+  if(state->video != NULL)
+    choose_bitrate(state);
 
   /***********************************************************************/
   /* printf("Throughput is :%lld \n", throughput);                       */
@@ -121,19 +144,94 @@ void calculate_bitrate(fsm* state){
   /* printf("\n");                                                       */
   /***********************************************************************/
 
+  session_save(state);
+
   log_state(state, logfile, throughput, state->lastchunk, elapsed);
   //  printf("Current best: %lld \n", state->current_best);
 }
 
+/* ns from a to b */
+static unsigned long long ns_between(struct timespec* a, struct timespec* b)
+{
+  return 1000000000ULL * (b->tv_sec - a->tv_sec) + b->tv_nsec - a->tv_nsec;
+}
+
+/*********************************************************************/
+/* @brief Takes the fragment whose last byte was just relayed as one */
+/*        throughput sample: its whole body over the time from its   */
+/*        request to that byte.                                      */
+/*********************************************************************/
+void sample_fragment(fsm* state)
+{
+  unsigned long long elapsed = ns_between(&state->start, &state->end);
+  char key[SS_KEY_LEN];
+
+  /* The fragment counts towards its origin's capacity */
+  if(fair){
+    ss_key(key, state->cli_ip, state->sess_path);
+    state->group = sh_sample(state->serv_addr.sin_addr.s_addr, key,
+                             state->frag_len,
+                             1000000000ULL * state->start.tv_sec +
+                             state->start.tv_nsec,
+                             1000000000ULL * state->end.tv_sec +
+                             state->end.tv_nsec,
+                             state->end.tv_sec * 1000LL +
+                             state->end.tv_nsec / 1000000);
+  }
+
+  state->body_size = state->frag_len;
+  calculate_bitrate(state);
+  state->body_size = 0;
+
+  /* And towards what clients on its network can expect from there */
+  if(elapsed > 0)
+    pr_add(state->cli_ip, state->serv_addr.sin_addr.s_addr,
+           state->frag_len * 8 * 1000000 / elapsed,
+           state->end.tv_sec * 1000LL + state->end.tv_nsec / 1000000);
+
+  if(samplelog != NULL && elapsed > 0)
+    log_sample(samplelog, state, "frag", state->frag_len,
+               ns_between(&state->start, &state->first_byte), elapsed,
+               state->frag_len * 8 * 1000000 / elapsed);
+
+  state->frag_len = 0;
+}
+
+/*********************************************************************/
+/* @brief Logs the n bytes of a single read as a sample of their     */
+/*        own, for diagnostics; estimates never see these.          */
+/*********************************************************************/
+void sample_recv(fsm* state, int n)
+{
+  unsigned long long elapsed = ns_between(&state->start, &state->end);
+
+  if(samplelog == NULL || state->lastchunk[0] == '\0' || elapsed == 0)
+    return;
+
+  log_sample(samplelog, state, "recv", n,
+             ns_between(&state->start, &state->first_byte), elapsed,
+             (unsigned long long) n * 8 * 1000000 / elapsed);
+}
+
+/* @brief Copies span s of the client's request into dst, a BUF_SHORT
+ *        buffer, as a string.
+ */
+static void copy_span(char* dst, struct state *client, struct span s){
+  int len = s.len < BUF_SHORT ? s.len : BUF_SHORT - 1;
+
+  memcpy(dst, span_at(client, s), len);
+  dst[len] = '\0';
+}
+
 /* @brief Copies some relevant information into an easier to use struct
  * @param my_req: Destination struct
  * @param client: Source struct
  */
 void copy_info(client_req *my_req, struct state *client){
-  memcpy(my_req->req_type, client->method, strlen(client->method));
-  memcpy(my_req->URI, client->uri, strlen(client->uri));
-  memcpy(my_req->version, client->version, strlen(client->version));
-  memcpy(my_req->file, client->uri, strlen(client->uri));
+  copy_span(my_req->req_type, client, client->method);
+  copy_span(my_req->URI, client, client->uri);
+  copy_span(my_req->version, client, client->version);
+  copy_span(my_req->file, client, client->uri);
   my_req->bitrate = client->current_best; //Change later
 }
 
@@ -159,7 +257,7 @@ void parse_URI(client_req *my_req){
     last_slash = strstr(last_slash + 1, "/");
   }
 
-  bzero(my_req->file, 0);
+  bzero(my_req->file, sizeof(my_req->file));
   memcpy(my_req->file, temp + 1, strlen(temp) - 1);
   memset(temp, 0, BUF_SHORT);
   getSubstring(temp, my_req->URI, 0, last_pos);
@@ -211,29 +309,102 @@ void parse_file(client_req *my_req){
   my_req->fragno = atoi(str_frag_num);
 }
 
+/* @brief Saves the client's adaptation state with its session for the
+ *        video it is on, if any.
+ */
+void session_save(struct state* client){
+  struct ss_state s;
+  struct timespec now;
+
+  if(client->sess_path[0] == '\0')
+    return;
+
+  s.est          = client->est;
+  s.avg_tput     = client->avg_tput;
+  s.current_best = client->current_best;
+  s.bitrate      = client->bitrate;
+  s.buffer       = client->buffer;
+  s.buf_at       = client->buf_at;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ss_save(client->cli_ip, client->sess_path, &s,
+          (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+/* @brief Moves the client onto the session for the video under path:
+ *        what it had for the video it was on is saved, and the session
+ *        for path picked up if it has one. Otherwise only what it knows
+ *        of its link is carried over; the stream starts afresh.
+ *        A path too long to keep has no session: the client is left
+ *        untracked, as a new one is, and not moved again while on it.
+ */
+static void session_enter(struct state* client, const char* path){
+  struct ss_state s;
+  int fits = strlen(path) < MF_PATH_LEN;
+
+  if(fits ? !strcmp(client->sess_path, path) : client->sess_path[0] == '\0')
+    return;
+
+  session_save(client);
+  strcpy(client->sess_path, fits ? path : "");
+
+  if(fits && ss_load(client->cli_ip, path, &s)){
+    client->est          = s.est;
+    client->avg_tput     = s.avg_tput;
+    client->current_best = s.current_best;
+    client->bitrate      = s.bitrate;
+    client->buffer       = s.buffer;
+    client->buf_at       = s.buf_at;
+  } else {
+    client->current_best = 0;
+    client->bitrate      = 0;
+    client->buffer       = 0;
+    client->buf_at       = 0;
+  }
+}
+
 /* @brief Parses the client's message and stores the info in the state.
+ *        client->response gets the request line to send the server in
+ *        its place; the client's own header block follows it.
  * @param client: Struct where all the info will be stored.
+ * @return 0, or 414 if the request line for the server is too long.
  */
-void parse_client_message(struct state *client){
+int parse_client_message(struct state *client){
   char response[BUF_SHORT];
   char response2[BUF_SHORT];
+  char nolist[BUF_SHORT];
   char *ext_loc;
   int  ext_pos;
+  int  len;
   client_req *my_req = calloc(1, sizeof(client_req));
 
   //  printf("Received from client : %s \n", client->request);
 
-  memset(client->response, 0, BUF_SIZE);
   memset(response, 0, BUF_SHORT);
   memset(response2, 0, BUF_SHORT);
+
+  /* Only fragment requests name a chunk */
+  bzero(client->lastchunk, sizeof(client->lastchunk));
   copy_info(my_req, client);
-  char *fragment = strstr(client->uri, "Seg");
-  char *manifest = strstr(client->uri, ".f4m");
+  char *fragment = strstr(my_req->URI, "Seg");
+  char *manifest = strstr(my_req->URI, ".f4m");
+
+  /* A player's own copy is asked for as any other file would be */
+  if(strstr(my_req->URI, "_nolist.f4m"))
+    manifest = NULL;
+
+  /* So is a manifest whose name is too long to register it under; its
+     directory, the registry's key, is a prefix of it */
+  if(manifest && strlen(my_req->URI) >= MF_PATH_LEN){
+    manifest = NULL;
+    fragment = NULL;
+  }
 
   if(manifest){
     my_req->content_type = 1;
     my_req->segno = -1;
     my_req->fragno = -1;
+    parse_URI(my_req);
   } else if(fragment){
     my_req->content_type = 2;
     parse_URI(my_req);
@@ -251,37 +422,78 @@ void parse_client_message(struct state *client){
     //ASSERT(ext_loc != NULL)
     ext_pos = ext_loc - (my_req->file);
     getSubstring(response2, my_req->file, 0, ext_pos);
-    sprintf(response2, "%s%s_nolist.f4m", my_req->path, response2);
-    sprintf(response, "GET %s HTTP/1.1\r\n", my_req->URI);
-    sprintf(response, "%s%sGET %s HTTP/1.1\r\n%s", response, client->header, response2, client->header);
-    client->servst->expecting = REGF4M;
+    if(snprintf(nolist, BUF_SHORT, "%s%s_nolist.f4m", my_req->path,
+                response2) >= BUF_SHORT)
+      nolist[0] = '\0';
+
+    session_enter(client, my_req->path);
+
+    /* The client is given the _nolist twin, made from the manifest
+       once the proxy has it; until then only the manifest is fetched.
+       The twin's own fetch is for when it cannot be answered here. */
+    client->video = mf_find(my_req->path);
+    if(client->video != NULL && nolist[0] != '\0' &&
+       mf_fresh(client->video, my_req->URI)){
+      len = snprintf(response, BUF_SHORT, "GET %s HTTP/1.1\r\n", nolist);
+      client->servst->expecting = NOLIST;
+
+      warm_start(client);
+    } else {
+      len = snprintf(response, BUF_SHORT, "GET %s HTTP/1.1\r\n",
+                     my_req->URI);
+      client->servst->expecting = REGF4M;
+    }
+
+    strcpy(client->mf_path, my_req->path);
+    strcpy(client->mf_uri, my_req->URI);
 
   } else if(fragment){
 
-    if(my_req->bitrate == 0)
+    /* A client's first fragment is at the bitrate it had before it
+       reconnected or, if it is new, the one its estimate picks when it
+       is started from what its network has had */
+    if(client->video == NULL || strcmp(client->video->path, my_req->path))
+      client->video = mf_find(my_req->path);
+
+    session_enter(client, my_req->path);
+
+    if(client->current_best == 0 && client->video != NULL)
       {
-        my_req->bitrate = global_best;
-        client->current_best = global_best;
+        warm_start(client);
+        choose_bitrate(client);
       }
+    my_req->bitrate = client->current_best;
 
-    sprintf(response, "GET %s%dSeg%d-Frag%d HTTP/1.1\r\n%s", my_req->path,
-            my_req->bitrate, my_req->segno, my_req->fragno, client->header);
+    len = snprintf(response, BUF_SHORT, "GET %s%dSeg%d-Frag%d HTTP/1.1\r\n",
+                   my_req->path, my_req->bitrate, my_req->segno,
+                   my_req->fragno);
     client->servst->expecting = VIDEO;
 
-    bzero(client->lastchunk, 200);
-    snprintf(client->lastchunk, 200, "%s%dSeg%d-Frag%d",
-             my_req->path,
-             my_req->bitrate, my_req->segno, my_req->fragno);
+    /* A name too long to be a cache key is fetched uncached */
+    if(snprintf(client->lastchunk, sizeof(client->lastchunk),
+                "%s%dSeg%d-Frag%d", my_req->path, my_req->bitrate,
+                my_req->segno, my_req->fragno) >=
+       (int) sizeof(client->lastchunk))
+      client->lastchunk[0] = '\0';
+    client->segno   = my_req->segno;
+    client->fragno  = my_req->fragno;
+    client->bitrate = my_req->bitrate;
   }
   else if(!manifest && !fragment){
-    sprintf(response, "GET %s HTTP/1.1\r\n%s", my_req->URI, client->header);
+    len = snprintf(response, BUF_SHORT, "GET %s HTTP/1.1\r\n", my_req->URI);
     client->servst->expecting = VIDEO;
 
   } else {
     //Impossible
+    len = 0;
   }
   free(my_req);
-  memcpy(client->response, response, strlen(response));
-  client->resp_idx = strlen(response);
+
+  if(len >= BUF_SHORT)
+    return 414;
+
+  memcpy(client->response, response, len);
+  client->resp_idx = len;
   //printf("Sending to server: %s \n", response);
+  return 0;
 }
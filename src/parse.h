@@ -43,10 +43,15 @@ typedef struct client_req{
 
 void parse_f4m(fsm* state);
 void calculate_bitrate(fsm* state);
-void parse_client_message(struct state *client);
-int smallest_bitrate(struct bitrate* b);
+void sample_fragment(fsm* state);
+void sample_recv(fsm* state, int n);
+void session_save(struct state* client);
+int parse_client_message(struct state *client);
 
 extern float alpha;
+extern int   abr;
+extern int   estimator;
+extern bool  fair;
 
 
 
@@ -0,0 +1,386 @@
+/*********************************************************************/
+/* @file prefetch.c                                                  */
+/*                                                                   */
+/* @brief Fetches fragments ahead of the clients that will ask for   */
+/*        them. Each prefetch is a GET on a connection of its own,   */
+/*        taken from the idle pool when one is there, whose response */
+/*        goes into the fragment cache (both tiers) and nowhere      */
+/*        else. Once the response is in, the connection goes back to */
+/*        the pool. Only 200s with a Content-Length are kept; any    */
+/*        other answer, or any error, simply drops the prefetch.     */
+/*        Every worker has its own prefetcher, so none of this is    */
+/*        locked.                                                    */
+/*********************************************************************/
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dcache.h"
+#include "prefetch.h"
+#include "scan.h"
+
+extern struct fcache fcache;
+extern struct dcache dcache;
+
+/* Counted over every worker */
+static unsigned long long pf_issued;
+static unsigned long long pf_stored;
+static unsigned long long pf_failed;
+
+static unsigned long long now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return 1000000000ULL * ts.tv_sec + ts.tv_nsec;
+}
+
+/*******************************************************************/
+/* @brief Initializes a worker's prefetcher.                       */
+/* @param depth   Fragments to fetch ahead of each request; 0 off. */
+/* @param src_ip  Address new origin connections come from.        */
+/*******************************************************************/
+void pf_init(struct prefetcher* pf, int depth, const char* src_ip)
+{
+  memset(pf, 0, sizeof(struct prefetcher));
+  pf->depth = depth;
+
+  pf->src.sin_family      = AF_INET;
+  pf->src.sin_addr.s_addr = inet_addr(src_ip);
+  pf->src.sin_port        = 0;
+}
+
+/* Takes f out and closes or pools its connection */
+static void pf_done(struct prefetcher* pf, struct evloop* loop,
+                    struct upstreams* up, struct prefetch* f, bool ok)
+{
+  struct timespec ts;
+
+  if(f->prev == NULL)
+    pf->head = f->next;
+  else
+    f->prev->next = f->next;
+  if(f->next != NULL)
+    f->next->prev = f->prev;
+
+  HASH_DEL(pf->bykey, f);
+  pf->n--;
+
+  ev_del(loop, &f->ev);
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  if(!ok || !f->reusable || up == NULL ||
+     !up_put(up, f->ip, f->ev.fd,
+             (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000))
+    close(f->ev.fd);
+
+  __atomic_add_fetch(ok ? &pf_stored : &pf_failed, 1, __ATOMIC_RELAXED);
+
+  free(f->fill);
+  free(f->req);
+  free(f);
+}
+
+/* Opens a new connection to ip:8080 and starts connecting */
+static int pf_connect(struct prefetcher* pf, in_addr_t ip, bool* connecting)
+{
+  struct sockaddr_in addr;
+  int sock, one = 1;
+
+  if((sock = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    return -1;
+
+  bind(sock, (struct sockaddr *) &pf->src, sizeof(pf->src));
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(8080);
+  addr.sin_addr.s_addr = ip;
+
+  *connecting = false;
+
+  if(connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+    {
+      if(errno != EINPROGRESS)
+        {
+          close(sock);
+          return -1;
+        }
+      *connecting = true;
+    }
+
+  return sock;
+}
+
+/*******************************************************************/
+/* @brief Starts fetching key from the origin at ip, unless it is  */
+/*        cached, already being prefetched, or the worker already  */
+/*        has PF_INFLIGHT prefetches out. The request carries Host */
+/*        and nothing else: the copy is for every client, so no   */
+/*        client's cookies, ranges or conditions go with it.       */
+/* @param host  host_len bytes of the Host to ask for key at.      */
+/* @returns true if a fetch was started.                           */
+/*******************************************************************/
+bool pf_start(struct prefetcher* pf, struct evloop* loop,
+              struct upstreams* up, const char* key, const char* host,
+              int host_len, in_addr_t ip)
+{
+  struct prefetch* f;
+  int len;
+
+  if(pf->depth == 0 || pf->n >= PF_INFLIGHT || strlen(key) >= FC_KEY_LEN)
+    return false;
+
+  HASH_FIND_STR(pf->bykey, key, f);
+  if(f != NULL || fc_has(&fcache, key) || dc_has(&dcache, key))
+    return false;
+
+  if((f = calloc(1, sizeof(struct prefetch))) == NULL)
+    return false;
+
+  len = snprintf(NULL, 0, "GET %s HTTP/1.1\r\nHost: %.*s\r\n\r\n", key,
+                 host_len, host);
+  if((f->req = malloc(len + 1)) == NULL)
+    {
+      free(f);
+      return false;
+    }
+
+  f->req_len = snprintf(f->req, len + 1,
+                        "GET %s HTTP/1.1\r\nHost: %.*s\r\n\r\n", key,
+                        host_len, host);
+  strcpy(f->key, key);
+  f->ip      = ip;
+  f->ev.kind = EV_PREFETCH;
+
+  if((f->ev.fd = up_get(up, ip)) == -1 &&
+     (f->ev.fd = pf_connect(pf, ip, &f->connecting)) == -1)
+    {
+      free(f->req);
+      free(f);
+      return false;
+    }
+
+  if(ev_add(loop, &f->ev, EV_WRITE) == -1)
+    {
+      close(f->ev.fd);
+      free(f->req);
+      free(f);
+      return false;
+    }
+
+  f->start    = now_ns();
+  f->deadline = f->start / 1000000 + PF_TIMEOUT;
+
+  HASH_ADD_STR(pf->bykey, key, f);
+  f->next = pf->head;
+  if(pf->head != NULL)
+    pf->head->prev = f;
+  pf->head = f;
+  pf->n++;
+
+  __atomic_add_fetch(&pf_issued, 1, __ATOMIC_RELAXED);
+  return true;
+}
+
+/* Takes in the header block of the response */
+static int pf_headers(struct prefetch* f)
+{
+  const char* lines = scan_crlf(f->hdr, f->hdr + f->hdr_len) + 2;
+  size_t      len   = f->hdr + f->hdr_len - lines;
+  const char* value;
+  size_t vlen;
+  long long length;
+
+  if(strncmp(f->hdr, "HTTP/1.1 200", strlen("HTTP/1.1 200")) ||
+     (value = scan_hdr(lines, len, "Content-Length", NULL)) == NULL ||
+     (length = strtoll(value, NULL, 10)) <= 0)
+    return -1;
+
+  if((size_t) (f->hdr_len + length) > fcache.max_entry &&
+     (dcache.nsegs == 0 ||
+      (size_t) (f->hdr_len + length) > dcache.seg_size - DC_HDR))
+    return -1;
+
+  value = scan_hdr(lines, len, "Connection", &vlen);
+  f->reusable = value == NULL || vlen < strlen("close") ||
+                !scan_ieq(value, "close", strlen("close"));
+
+  if((f->fill = fc_new(&fcache, f->key, f->hdr, f->hdr_len, length)) == NULL)
+    return -1;
+
+  return 0;
+}
+
+/* Takes in n bytes of the response. @returns 1 once it is all in, */
+/* 0 if more is due, -1 if it cannot be kept.                      */
+static int pf_take(struct prefetch* f, char* buf, int n)
+{
+  struct fc_entry* e;
+  const char* end;
+  int take;
+
+  while(n > 0)
+    {
+      if((e = f->fill) != NULL)
+        {
+          /* Anything past the body was never asked for */
+          if((size_t) n > e->len - e->filled)
+            return -1;
+
+          memcpy(e->data + e->filled, buf, n);
+          e->filled += n;
+          return e->filled == e->len;
+        }
+
+      take = sizeof(f->hdr) - 1 - f->hdr_len;
+      if(take > n)
+        take = n;
+      if(take == 0)
+        return -1;
+
+      memcpy(f->hdr + f->hdr_len, buf, take);
+      f->hdr[f->hdr_len + take] = '\0';
+
+      if((end = scan_blank(f->hdr, f->hdr_len, f->hdr_len + take)) == NULL)
+        {
+          f->hdr_len += take;
+          return 0;
+        }
+
+      /* Only part of this chunk was headers */
+      take = (end - f->hdr) - f->hdr_len;
+      buf += take;
+      n   -= take;
+
+      f->hdr_len = end - f->hdr;
+      f->hdr[f->hdr_len] = '\0';
+
+      if(pf_headers(f) == -1)
+        return -1;
+    }
+
+  return f->fill != NULL && f->fill->filled == f->fill->len;
+}
+
+/*******************************************************************/
+/* @brief Moves a prefetch along once its connection is ready:     */
+/*        sends the request, then reads the response into the      */
+/*        cache.                                                   */
+/*******************************************************************/
+void pf_ready(struct prefetcher* pf, struct evloop* loop,
+              struct upstreams* up, struct ev_handle* h,
+              unsigned int events)
+{
+  struct prefetch* f = (struct prefetch *)
+                       ((char *) h - offsetof(struct prefetch, ev));
+  struct fc_entry* e;
+  char      buf[16384];
+  int       err = 0, ret = 0;
+  socklen_t len = sizeof(err);
+  ssize_t   n;
+
+  if(f->connecting)
+    {
+      if(getsockopt(h->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err)
+        {
+          pf_done(pf, loop, up, f, false);
+          return;
+        }
+      f->connecting = false;
+    }
+
+  if(f->req_off < f->req_len)
+    {
+      n = send(h->fd, f->req + f->req_off, f->req_len - f->req_off,
+               MSG_NOSIGNAL);
+
+      if(n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+          pf_done(pf, loop, up, f, false);
+          return;
+        }
+
+      if(n > 0)
+        f->req_off += n;
+
+      if(f->req_off == f->req_len && ev_mod(loop, h, EV_READ) == -1)
+        pf_done(pf, loop, up, f, false);
+      return;
+    }
+
+  if(!(events & (EV_READ | EV_ERROR)))
+    return;
+
+  while(ret == 0)
+    {
+      if((n = recv(h->fd, buf, sizeof(buf), 0)) == -1)
+        {
+          if(errno == EINTR)
+            continue;
+          if(errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+        }
+
+      /* The origin went away before the response was all in */
+      if(n <= 0)
+        {
+          pf_done(pf, loop, up, f, false);
+          return;
+        }
+
+      ret = pf_take(f, buf, n);
+    }
+
+  if(ret == -1)
+    {
+      pf_done(pf, loop, up, f, false);
+      return;
+    }
+
+  /* The cache's throughput sample is the origin's, as for any fill */
+  e = f->fill;
+  e->elapsed = now_ns() - f->start;
+  dc_put(&dcache, e->key, e->data, e->hdr_len, e->len, e->elapsed);
+  fc_put(&fcache, e);
+  f->fill = NULL;
+
+  pf_done(pf, loop, up, f, true);
+}
+
+/* @brief Drops the prefetches that have taken longer than PF_TIMEOUT. */
+void pf_expire(struct prefetcher* pf, struct evloop* loop, long long now)
+{
+  struct prefetch* f;
+  struct prefetch* next;
+
+  for(f = pf->head; f != NULL; f = next)
+    {
+      next = f->next;
+
+      if(f->deadline <= now)
+        pf_done(pf, loop, NULL, f, false);
+    }
+}
+
+void pf_stats(FILE* file)
+{
+  if(pf_issued == 0)
+    return;
+
+  fprintf(file, "prefetch: %llu issued, %llu stored, %llu dropped\n",
+          pf_issued, pf_stored, pf_failed);
+}
@@ -0,0 +1,62 @@
+/*********************************************************************/
+/* @file prefetch.h                                                  */
+/*                                                                   */
+/* @brief Interfaces for prefetch.c, which fetches the fragments a   */
+/*        client is about to ask for into the fragment cache.        */
+/*********************************************************************/
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <netinet/in.h>
+
+#include "uthash.h"
+#include "event.h"
+#include "upstream.h"
+#include "fcache.h"
+
+#define PF_INFLIGHT 8      // Prefetches in flight per worker
+#define PF_TIMEOUT  5000   // ms a prefetch may take before it is dropped
+#define PF_HDR_SIZE 2048   // Longest response header block accepted
+
+/* One fragment being fetched. Its handle is how the event loop */
+/* leads back to it.                                            */
+struct prefetch {
+  char key[FC_KEY_LEN];        // Key; also the path requested
+  struct ev_handle ev;
+  in_addr_t ip;
+  bool connecting;
+  char* req;                   // The request, and how much of it is sent
+  size_t req_len;
+  size_t req_off;
+  char hdr[PF_HDR_SIZE];       // Response headers so far
+  int hdr_len;
+  struct fc_entry* fill;       // The response, once its headers are in
+  bool reusable;               // The origin keeps the connection open
+  unsigned long long start;    // ns when it was sent for
+  long long deadline;          // ms
+  struct prefetch* prev;
+  struct prefetch* next;
+  UT_hash_handle hh;
+};
+
+struct prefetcher {
+  int depth;                   // Fragments fetched ahead, 0 when off
+  struct sockaddr_in src;      // Address new connections are bound to
+  struct prefetch* bykey;      // Hash of the fetches in flight
+  struct prefetch* head;       // and a list of them
+  int n;
+};
+
+void pf_init  (struct prefetcher* pf, int depth, const char* src_ip);
+bool pf_start (struct prefetcher* pf, struct evloop* loop,
+               struct upstreams* up, const char* key, const char* host,
+               int host_len, in_addr_t ip);
+void pf_ready (struct prefetcher* pf, struct evloop* loop,
+               struct upstreams* up, struct ev_handle* h,
+               unsigned int events);
+void pf_expire(struct prefetcher* pf, struct evloop* loop, long long now);
+void pf_stats (FILE* file);
+
+#endif
@@ -0,0 +1,120 @@
+/*********************************************************************/
+/* @file prior.c                                                     */
+/*                                                                   */
+/* @brief Throughput history per client network (/24) and origin.   */
+/*        Every fragment's throughput is added to the history of the */
+/*        network its client is on, weighted so that a sample counts */
+/*        half as much every PR_HALF_LIFE_MS. A client with nothing  */
+/*        learned yet starts its estimate at PR_DISCOUNT of that     */
+/*        history, as long as enough of it is recent, rather than at */
+/*        the lowest bitrate; viewers coming back on a network the   */
+/*        proxy knows reach their bitrate in a fragment or so.       */
+/*                                                                   */
+/*        The table is shared by every worker under one mutex.       */
+/*********************************************************************/
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "prior.h"
+
+static struct prior*    priors = NULL;
+static pthread_mutex_t  pr_lock = PTHREAD_MUTEX_INITIALIZER;
+static long long        pr_swept;
+
+static void pr_keyof(struct pr_key* key, in_addr_t client, in_addr_t origin)
+{
+  memset(key, 0, sizeof(struct pr_key));
+  key->net    = client & htonl(0xffffff00);
+  key->origin = origin;
+}
+
+/* The weight p's samples have left at now */
+static double pr_weight(struct prior* p, long long now)
+{
+  return p->weight * exp2(-(double) (now - p->updated) / PR_HALF_LIFE_MS);
+}
+
+/* @brief Adds a fragment's throughput (Kbps) to the history of the */
+/*        client's network with origin.                             */
+void pr_add(in_addr_t client, in_addr_t origin, unsigned long long tput,
+            long long now)
+{
+  struct pr_key key;
+  struct prior* p;
+  double w;
+
+  pr_keyof(&key, client, origin);
+
+  pthread_mutex_lock(&pr_lock);
+
+  HASH_FIND(hh, priors, &key, sizeof(struct pr_key), p);
+  if(p != NULL)
+    HASH_DEL(priors, p);
+  else if((p = calloc(1, sizeof(struct prior))) != NULL)
+    p->key = key;
+
+  if(p != NULL)
+    {
+      w = pr_weight(p, now);
+
+      p->tput   = (p->tput * w + tput) / (w + 1);
+      p->weight = w + 1 < PR_MAX_WEIGHT ? w + 1 : PR_MAX_WEIGHT;
+      p->updated = now;
+
+      HASH_ADD(hh, priors, key, sizeof(struct pr_key), p);
+    }
+
+  pthread_mutex_unlock(&pr_lock);
+}
+
+/*******************************************************************/
+/* @brief What a new client on client's network may start from     */
+/*        with origin.                                             */
+/* @returns the throughput (Kbps), 0 if too little is known.       */
+/*******************************************************************/
+unsigned long long pr_get(in_addr_t client, in_addr_t origin, long long now)
+{
+  struct pr_key key;
+  struct prior* p;
+  unsigned long long tput = 0;
+
+  pr_keyof(&key, client, origin);
+
+  pthread_mutex_lock(&pr_lock);
+
+  HASH_FIND(hh, priors, &key, sizeof(struct pr_key), p);
+  if(p != NULL && pr_weight(p, now) >= PR_MIN_WEIGHT)
+    tput = p->tput * PR_DISCOUNT;
+
+  pthread_mutex_unlock(&pr_lock);
+  return tput;
+}
+
+/* @brief Drops the histories without a sample for PR_TTL_MS. */
+void pr_expire(long long now)
+{
+  struct prior* p;
+  struct prior* tmp;
+
+  if(__atomic_load_n(&pr_swept, __ATOMIC_RELAXED) + PR_SWEEP_MS > now)
+    return;
+
+  pthread_mutex_lock(&pr_lock);
+
+  pr_swept = now;
+
+  HASH_ITER(hh, priors, p, tmp)
+    {
+      if(p->updated + PR_TTL_MS > now)
+        break;
+
+      HASH_DEL(priors, p);
+      free(p);
+    }
+
+  pthread_mutex_unlock(&pr_lock);
+}
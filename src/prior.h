@@ -0,0 +1,41 @@
+/*********************************************************************/
+/* @file prior.h                                                     */
+/*                                                                   */
+/* @brief Interfaces for prior.c, the throughput each client network */
+/*        has had from each origin, for new clients to start from.   */
+/*********************************************************************/
+#ifndef PRIOR_H
+#define PRIOR_H
+
+#include <netinet/in.h>
+
+#include "uthash.h"
+
+#define PR_HALF_LIFE_MS 600000    // ms over which a sample's weight halves
+#define PR_MIN_WEIGHT   1.0       // Weight a history needs to be used
+#define PR_MAX_WEIGHT   20.0      // Weight at which it stops growing
+#define PR_DISCOUNT     0.7       // Share of the history a new client gets
+#define PR_TTL_MS       3600000   // ms a history is kept after its last
+                                  // sample
+#define PR_SWEEP_MS     10000     // ms between sweeps for stale histories
+
+struct pr_key {
+  in_addr_t net;               // The client's /24
+  in_addr_t origin;
+};
+
+struct prior {
+  struct pr_key key;
+  double tput;                 // Kbps, weighted by age
+  double weight;               // Sum of the samples' weights, as of
+  long long updated;           // this ms
+  UT_hash_handle hh;           // In order of update, least recent first
+};
+
+void               pr_add   (in_addr_t client, in_addr_t origin,
+                             unsigned long long tput, long long now);
+unsigned long long pr_get   (in_addr_t client, in_addr_t origin,
+                             long long now);
+void               pr_expire(long long now);
+
+#endif
@@ -16,6 +16,11 @@
 /* Part of the code is based on the select-based echo server found in
    CSAPP */
 
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <sys/resource.h>
+
 #include "proxy.h"
 #include "logger.h"
 #include "engine.h"
@@ -25,7 +30,11 @@
 
 /** Global vars **/
 FILE* logfile;
+FILE* samplelog = NULL;
 float alpha;
+int   abr = ABR_RATE;
+int   estimator = EST_EWMA;
+bool  fair      = false;
 
 short listen_port;
 char* fake_ip;
@@ -33,78 +42,198 @@ char* dns_ip;
 short dns_port;
 char* www_ip;
 
+int   connect_timeout = CONNECT_TIMEOUT;
+int   idle_max        = UP_MAX_IDLE;
+int   idle_ms         = UP_IDLE_MS;
+int   cache_mb        = FC_SIZE_MB;
+char* disk_dir        = NULL;
+int   disk_mb         = DC_SIZE_MB;
+int   prefetch_depth  = 0;
+
 bool  dns;
-int   dns_sock;
 
-/* Linkd list of bitrates */
-struct bitrate *all_bitrates = NULL;
-unsigned long long int global_best;
-unsigned long long global_smallest;
+/* Fragments cached for every worker, in memory and on disk */
+struct fcache fcache;
+struct dcache dcache;
 
 /** Prototypes **/
 
 int  close_socket(int sock);
+int  open_listenfd(short port, bool reuseport);
+int  init_shard(shard* s, int* backend, bool edge, bool splice,
+                bool reuseport);
+void* run_shard(void* arg);
 void init_pool(int listenfd, int dns_sock, pool *p);
-void add_client(int client_fd, pool *p);
-void check_clients(pool *p, int dns_sock);
+void add_client(int client_fd, in_addr_t cli_ip, pool *p);
+void check_clients(pool *p);
+void accept_clients(pool *p);
+void handle_dns(pool *p);
+void handle_ready(pool *p, struct ev_handle* h, unsigned int events);
+void handle_client(pool *p, fsm* state);
+void handle_server(pool *p, fsm* state);
+void client_data(pool *p, fsm* state, char* buf, int n);
+void server_data(pool *p, fsm* state, char* buf, int n);
+void relay(pool *p, fsm* state, char* buf, int n);
+void send_client(pool *p, fsm* state, char* buf, int n);
+void send_server(pool *p, fsm* state, char* buf, int n);
+void fail_client(pool *p, fsm* state, int error);
+void drain_client(pool *p, fsm* state);
+void set_interest(pool *p, fsm* state);
+int  splice_server(fsm* state);
+void count_relayed(fsm* state, int n);
+bool serve_cached(pool *p, fsm* state);
+bool serve_manifest(pool *p, fsm* state);
+void prefetch_next(pool *p, fsm* state);
+bool asked_next(fsm* state, int seg, int frag);
+int  watch_client(pool *p, fsm* state);
+void reap_clients(pool *p);
+void check_completions(pool *p);
+void uring_watch(pool *p, struct ev_handle* h);
+void uring_relay(pool *p, fsm* state, char* buf, int n, int bid);
+void uring_flush(pool *p, fsm* state);
+void uring_write(pool *p, fsm* state, struct ev_handle* h, char* buf, int n);
+void uring_poll_out(pool *p, struct ev_handle* h);
+void uring_caught_up(pool *p, fsm* state);
+void write_complete(pool *p, struct ev_handle* h);
+int  sendq_add(pool *p, fsm* state, char* buf, int n, int bid);
+void sendq_done(pool *p, struct relay* r);
+void recv_complete(pool *p, struct ev_handle* h, int res, unsigned flags);
+void send_complete(pool *p, fsm* state, int res);
 void cleanup(int sig);
 void sigchld_handler(int sig);
-int connect_server(fsm* state, char* webip);
+int  connect_server(pool *p, fsm* state, char* webip);
+int  open_server(pool *p, fsm* state, char* webip);
+void release_server(pool *p, fsm* state);
+void start_server(pool *p, fsm* state, char* webip);
+void resolved(pool *p, struct dns_query* q, in_addr_t ip);
+void connect_done(pool *p, fsm* state, int err);
+long long now_ms(void);
+void timer_set(pool *p, fsm* state, int ms);
+void timer_del(pool *p, fsm* state);
+void check_timers(pool *p);
+void usage(char* prog);
 
 /** Definitions **/
 
-int resolve(char *node, char *service,
-            const struct addrinfo *hints, struct addrinfo **res)
+int main(int argc, char* argv[])
 {
-    (void) hints;
-    (void) res;
-    (void) service;
-
-    struct sockaddr_in dns_addr;
-    struct sockaddr_in my_addr;
-
-    bzero(&my_addr, sizeof(my_addr));
-    my_addr.sin_family  = AF_INET;
-    my_addr.sin_port    = 0;
-    my_addr.sin_addr.s_addr = inet_addr(fake_ip);
-
-    /* Bind this socket to the fake-ip with an ephemeral port */
-    bind(dns_sock, (struct sockaddr *) &my_addr, sizeof(my_addr));
-
-    bzero(&dns_addr, sizeof(dns_addr));
-    dns_addr.sin_family  = AF_INET;
-    dns_addr.sin_port    = htons(dns_port);
-    dns_addr.sin_addr.s_addr = inet_addr(dns_ip);
-
-    byte_buf* QNAME_bb = gen_QNAME(node, strlen(node));
-    question* query    = gen_question(QNAME_bb->buf, strlen((char *) QNAME_bb->buf) + 1);
-
-    question** dumquery = calloc(1, sizeof(question*));
-    dumquery[0]         = query;
-
-    srand(time(NULL));
-
-    struct byte_buf* msg2send = gen_message(rand(), 0, 0, 0, 0,
-                                            0, 0, 0,
-                                            1, 0,
-                                            dumquery, NULL);
-
-    sendto(dns_sock, msg2send->buf, msg2send->pos, 0,
-           (struct sockaddr *)&dns_addr, sizeof(dns_addr));
+    char* prog     = argv[0];
+    int   backend  = EV_EPOLL;
+    bool  edge     = false;
+    int   nthreads = 1;
+    bool  pin      = false;
+    bool  splice   = false;
+    int   opt, i;
+
+    /* Parse options; the positional args follow them */
+    while ((opt = getopt(argc, argv, "b:Et:Psc:k:i:f:m:D:M:p:a:e:L:F")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            if ((backend = ev_backend(optarg)) == -1)
+            {
+                usage(prog);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'E':
+            edge = true;
+            break;
+        case 't':
+            if ((nthreads = atoi(optarg)) < 1)
+            {
+                usage(prog);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'P':
+            pin = true;
+            break;
+        case 's':
+            splice = true;
+            break;
+        case 'c':
+            if ((connect_timeout = atoi(optarg)) < 1)
+            {
+                usage(prog);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'k':
+            if ((idle_max = atoi(optarg)) < 0)
+            {
+                usage(prog);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'i':
+            if ((idle_ms = atoi(optarg)) < 1)
+            {
+                usage(prog);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'f':
+            www_ip = optarg;
+            break;
+        case 'm':
+            if ((cache_mb = atoi(optarg)) < 0)
+            {
+                usage(prog);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'D':
+            disk_dir = optarg;
+            break;
+        case 'M':
+            if ((disk_mb = atoi(optarg)) < 0)
+            {
+                usage(prog);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'p':
+            if ((prefetch_depth = atoi(optarg)) < 0)
+            {
+                usage(prog);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'a':
+            if ((abr = abr_policy(optarg)) == -1)
+            {
+                usage(prog);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'e':
+            if ((estimator = est_kind(optarg)) == -1)
+            {
+                usage(prog);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'L':
+            samplelog = log_open(optarg);
+            break;
+        case 'F':
+            fair = true;
+            break;
+        default:
+            usage(prog);
+            return EXIT_FAILURE;
+        }
+    }
 
-    delete_bytebuf(msg2send);
-    delete_bytebuf(QNAME_bb);
-    return 0;
-}
+    argc -= optind - 1;
+    argv += optind - 1;
 
-int main(int argc, char* argv[])
-{
     if (argc != 7 && argc != 8) // argc = 9
     {
         fprintf(stderr, "%d \n", argc);
-        fprintf(stderr, "usage: %s <log> <alpha> <listen-port> ", argv[0]);
-        fprintf(stderr, "<fake-ip> <dns-ip> <dns-port> ");
-        fprintf(stderr, "<www-ip> \n");
+        usage(prog);
         return EXIT_FAILURE;
     }
 
@@ -132,108 +261,309 @@ int main(int argc, char* argv[])
     if(argc == 8)
         www_ip          = argv[7];
 
-    int                 listen_fd, client_fd;
-    socklen_t           cli_size;
-    struct sockaddr_in  serv_addr, cli_addr;
-    pool *pool =        malloc(sizeof(struct pool));
-    struct timeval      tv;
-    tv.tv_sec = 5;
+    struct rlimit  rl;
+    long           ncpus  = sysconf(_SC_NPROCESSORS_ONLN);
+    shard*         shards = calloc(nthreads, sizeof(shard));
 
     /********* BEGIN INIT *******/
 
-    if(pool == NULL)
+    if(shards == NULL)
     {
         return EXIT_FAILURE;
     }
 
-    fprintf(stdout, "-----Welcome to Proxy!-----\n");
+    if (ncpus < 1)
+        ncpus = 1;
 
-    /* all networked programs must create a socket */
-    if ((listen_fd = socket(PF_INET, SOCK_STREAM, 0)) == -1)
+    /* Every client costs two descriptors; lift the soft limit as far as
+       we are allowed to. */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
     {
-        return EXIT_FAILURE;
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
     }
 
-    /* These will help a client connect to the proxy */
-    serv_addr.sin_family        = AF_UNSPEC;
-    serv_addr.sin_port          = htons(listen_port);
-    serv_addr.sin_addr.s_addr   = INADDR_ANY;
+    scan_init(SCAN_AUTO);
+    fc_init(&fcache, (size_t) cache_mb * 1024 * 1024);
 
-    /* Set sockopt so that ports can be resued */
-    int enable = -1;
-    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable,
-                   sizeof(int)) == -1)
+    if (dc_init(&dcache, disk_dir,
+                disk_dir ? (size_t) disk_mb * 1024 * 1024 : 0) == -1)
     {
-        close_socket(listen_fd);
+        fprintf(stderr, "Could not open disk cache %s: %s\n", disk_dir,
+                strerror(errno));
         return EXIT_FAILURE;
     }
 
-    /* servers bind sockets to ports---notify the OS they accept connections */
-    if (bind(listen_fd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)))
+    fprintf(stdout, "-----Welcome to Proxy!-----\n");
+
+    /* Every worker gets its own listening socket; with more than one the
+       kernel spreads new connections across them (SO_REUSEPORT). */
+    for (i = 0; i < nthreads; i++)
     {
-        close_socket(listen_fd);
-        return EXIT_FAILURE;
+        shards[i].id  = i;
+        shards[i].cpu = pin ? i % ncpus : -1;
+
+        if (init_shard(&shards[i], &backend, edge, splice,
+                       nthreads > 1) == -1)
+        {
+            fprintf(stderr, "Could not start worker %d: %s\n", i,
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
     }
 
-    if (listen(listen_fd, 5))
+    /******** END INIT *********/
+
+    /******* BEGIN SERVER CODE ******/
+
+    for (i = 1; i < nthreads; i++)
     {
-        close_socket(listen_fd);
-        return EXIT_FAILURE;
+        if (pthread_create(&shards[i].tid, NULL, run_shard, &shards[i]) != 0)
+        {
+            fprintf(stderr, "Could not start worker %d\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* The main thread is worker 0 */
+    run_shard(&shards[0]);
+    return EXIT_FAILURE;
+}
+
+/*****************************************************************/
+/* @brief Sets up one worker: its pool and event loop, listening */
+/*        socket and DNS socket.                                 */
+/* @param backend    The event backend; switched to epoll if     */
+/*                   io_uring cannot be set up.                  */
+/* @param splice     Relay bodies with splice() (not io_uring).  */
+/* @param reuseport  Share the listening port with the other     */
+/*                   workers.                                    */
+/* @returns 0 on success, -1 otherwise.                          */
+/*****************************************************************/
+int init_shard(shard* s, int* backend, bool edge, bool splice,
+               bool reuseport)
+{
+    int   listen_fd, dns_fd;
+    struct sockaddr_in fake;
+    pool* pool = calloc(1, sizeof(struct pool));
+
+    if (pool == NULL)
+        return -1;
+
+    if (*backend == EV_URING &&
+        uring_init(&pool->ring, UR_ENTRIES, UR_NBUFS, BUF_SIZE) == -1)
+    {
+        fprintf(stderr, "io_uring unavailable (%s), using epoll\n",
+                strerror(errno));
+        *backend = EV_EPOLL;
     }
 
+    if (ev_init(&pool->loop, *backend, edge) == -1)
+        return -1;
+
+    if ((listen_fd = open_listenfd(listen_port, reuseport)) == -1)
+        return -1;
+
     /* Create a UDP socket for dns comms */
-    if ((dns_sock = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+    if ((dns_fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
     {
-        return EXIT_FAILURE;
+        close_socket(listen_fd);
+        return -1;
     }
 
-    /***************************************************/
-    /* Use this to talk to the DNS server:             */
-    /*                                                 */
-    /* struct sockaddr_in dnsaddr = {0};               */
-    /* dnsaddr.sin_family         = AF_INET;           */
-    /* dnsaddr.sin_addr.s_addr    = inet_addr(dns_ip); */
-    /* dnsaddr.sin_port           = htons(dns_port);   */
-    /***************************************************/
+    /* Queries go out from the fake-ip with an ephemeral port */
+    memset(&fake, 0, sizeof(fake));
+    fake.sin_family      = AF_INET;
+    fake.sin_addr.s_addr = inet_addr(fake_ip);
+    fake.sin_port        = 0;
+    bind(dns_fd, (struct sockaddr *) &fake, sizeof(fake));
+    fcntl(dns_fd, F_SETFL, fcntl(dns_fd, F_GETFL) | O_NONBLOCK);
 
     /* Initialize our pool of fds */
-    init_pool(listen_fd, dns_sock, pool);
+    init_pool(listen_fd, dns_fd, pool);
+    pool->splice = splice && *backend != EV_URING;
+    pool->cache  = (fcache.capacity > 0 || dcache.nsegs > 0) &&
+                   *backend != EV_URING;
+    pf_init(&pool->pf, pool->cache ? prefetch_depth : 0, fake_ip);
 
-    /******** END INIT *********/
+    if (*backend == EV_URING)
+    {
+        /* One multishot accept and one multishot poll cover the
+           listening and DNS sockets for the lifetime of the proxy */
+        uring_prep_accept_multi(uring_sqe(&pool->ring), listen_fd,
+                                UR_DATA(&pool->listen_ev, UR_ACCEPT));
+        uring_prep_poll_multi(uring_sqe(&pool->ring), dns_fd,
+                              UR_DATA(&pool->dns_ev, UR_POLL));
+        uring_submit(&pool->ring);
+    }
+    else if (ev_add(&pool->loop, &pool->listen_ev, EV_READ) == -1 ||
+             ev_add(&pool->loop, &pool->dns_ev, EV_READ) == -1)
+    {
+        close_socket(listen_fd);
+        close_socket(dns_fd);
+        return -1;
+    }
 
-    /******* BEGIN SERVER CODE ******/
+    s->pool = pool;
+    return 0;
+}
+
+/*******************************************************************/
+/* @brief The event loop of one worker. Never returns; a fatal      */
+/*        error in any worker ends the proxy.                       */
+/* @param arg The worker's shard.                                   */
+/*******************************************************************/
+void* run_shard(void* arg)
+{
+    shard* s    = arg;
+    pool*  pool = s->pool;
+    int    timeout;
+
+    if (s->cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(s->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
 
     /* finally, loop waiting for input and then write it back */
     while (1)
     {
-        /* Block until there are file descriptors ready */
-        pool->readfds = pool->masterfds;
-        pool->writefds = pool->masterfds;
+        /* Timers, idle server connections, DNS queries and prefetches
+           need ticks */
+        timeout = (pool->timers || pool->up.nidle || pool->rs.npending ||
+                   pool->pf.n) ? TICK_MS : 5000;
 
-        if((pool->nready = select(pool->maxfd+1, &pool->readfds, &pool->writefds,
-                                  NULL, &tv)) == -1)
+        if (pool->loop.backend == EV_URING)
         {
-            close_socket(listen_fd);
-            return EXIT_FAILURE;
+            /* Submit whatever was queued and wait for completions */
+            if (uring_wait(&pool->ring, timeout) == -1 &&
+                errno != ETIME && errno != EINTR)
+                break;
+
+            check_completions(pool);
+            continue;
         }
 
-        /* Is the http port having clients ? */
-        if (FD_ISSET(listen_fd, &pool->readfds))
+        /* Block until there are file descriptors ready */
+        if((pool->nready = ev_wait(&pool->loop, pool->ready, EV_MAX_READY,
+                                   timeout)) == -1)
         {
-            cli_size = sizeof(cli_addr);
-            if ((client_fd = accept(listen_fd, (struct sockaddr *) &cli_addr,
-                                    &cli_size)) == -1)
-            {
-                close(listen_fd);
-                return EXIT_FAILURE;
-            }
+            if (errno == EINTR)
+                continue;
 
-            add_client(client_fd, pool);
+            break;
         }
 
-        /* Read and respond to each client requests */
-        check_clients(pool, dns_sock);
+        /* Accept, read and respond to whatever is ready */
+        check_clients(pool);
+    }
+
+    fprintf(stderr, "Worker %d: %s\n", s->id, strerror(errno));
+    close_socket(pool->listen_ev.fd);
+    exit(EXIT_FAILURE);
+}
+
+/*************************************************************/
+/* @brief Opens a non-blocking socket listening on port.     */
+/* @param reuseport  Let other sockets bind the same port so */
+/*                   the kernel balances accepts over them.  */
+/* @returns the socket, -1 on error.                         */
+/*************************************************************/
+int open_listenfd(short port, bool reuseport)
+{
+    int                 listen_fd;
+    struct sockaddr_in  serv_addr;
+
+    /* all networked programs must create a socket */
+    if ((listen_fd = socket(PF_INET, SOCK_STREAM, 0)) == -1)
+    {
+        return -1;
+    }
+
+    /* These will help a client connect to the proxy */
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family        = AF_UNSPEC;
+    serv_addr.sin_port          = htons(port);
+    serv_addr.sin_addr.s_addr   = INADDR_ANY;
+
+    /* Set sockopt so that ports can be resued */
+    int enable = -1;
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable,
+                   sizeof(int)) == -1 ||
+        (reuseport &&
+         setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &enable,
+                    sizeof(int)) == -1))
+    {
+        close_socket(listen_fd);
+        return -1;
+    }
+
+    /* servers bind sockets to ports---notify the OS they accept connections */
+    if (bind(listen_fd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)))
+    {
+        close_socket(listen_fd);
+        return -1;
+    }
+
+    if (listen(listen_fd, SOMAXCONN))
+    {
+        close_socket(listen_fd);
+        return -1;
     }
+
+    /* accept() is drained in a loop, so it must never block */
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+
+    return listen_fd;
+}
+
+void usage(char* prog)
+{
+    fprintf(stderr, "usage: %s [-b select|epoll|uring] [-E] [-t threads] [-P] [-s] ", prog);
+    fprintf(stderr, "[-c connect-ms] [-k idle-max] [-i idle-ms] ");
+    fprintf(stderr, "[-f fallback-ip] [-m cache-mb] [-D cache-dir] [-M disk-mb] ");
+    fprintf(stderr, "[-p prefetch-depth] [-a rate|bola|mpc] ");
+    fprintf(stderr, "[-e ewma|harmonic|dual|auto] [-L sample-log] [-F] ");
+    fprintf(stderr, "<log> <alpha> ");
+    fprintf(stderr, "<listen-port> <fake-ip> <dns-ip> <dns-port> ");
+    fprintf(stderr, "<www-ip> \n");
+    fprintf(stderr, "  -b  event backend (default epoll); uring falls back to\n");
+    fprintf(stderr, "      epoll when the kernel lacks io_uring\n");
+    fprintf(stderr, "  -E  edge-triggered notification (epoll only)\n");
+    fprintf(stderr, "  -t  worker threads, each with its own listening socket\n");
+    fprintf(stderr, "  -P  pin worker i to CPU i\n");
+    fprintf(stderr, "  -s  splice() video and pass-through bodies from the\n");
+    fprintf(stderr, "      server to the client (select and epoll only)\n");
+    fprintf(stderr, "  -c  ms to wait for a server connect (default %d)\n",
+            CONNECT_TIMEOUT);
+    fprintf(stderr, "  -k  idle server connections kept per origin, 0 for\n");
+    fprintf(stderr, "      none (default %d)\n", UP_MAX_IDLE);
+    fprintf(stderr, "  -i  ms an idle server connection is kept (default %d)\n",
+            UP_IDLE_MS);
+    fprintf(stderr, "  -f  server to use when DNS gives no answer\n");
+    fprintf(stderr, "  -m  MB of fragments cached in memory, 0 for none\n");
+    fprintf(stderr, "      (default %d; not used with uring)\n", FC_SIZE_MB);
+    fprintf(stderr, "  -D  directory for a fragment cache on disk that\n");
+    fprintf(stderr, "      outlives restarts (default none)\n");
+    fprintf(stderr, "  -M  MB of fragments cached on disk (default %d)\n",
+            DC_SIZE_MB);
+    fprintf(stderr, "  -p  fragments fetched into the cache ahead of each\n");
+    fprintf(stderr, "      fragment request, bandwidth allowing (default 0)\n");
+    fprintf(stderr, "  -a  bitrate adaptation: rate picks the highest bitrate\n");
+    fprintf(stderr, "      the throughput sustains (default), bola by player\n");
+    fprintf(stderr, "      buffer, mpc by looking %d fragments ahead\n",
+            ABR_HORIZON);
+    fprintf(stderr, "  -e  throughput estimator: ewma by <alpha> (default),\n");
+    fprintf(stderr, "      harmonic mean of the last %d samples, dual fast and\n",
+            EST_WINDOW);
+    fprintf(stderr, "      slow EWMA taking the lower, auto EWMA whose alpha\n");
+    fprintf(stderr, "      follows how the estimate has been off\n");
+    fprintf(stderr, "  -L  also log every throughput sample, per fragment\n");
+    fprintf(stderr, "      and per read, with time to first byte\n");
+    fprintf(stderr, "  -F  split each origin's capacity equally among its\n");
+    fprintf(stderr, "      clients and cap their bitrates to their shares\n");
 }
 
 int close_socket(int sock)
@@ -254,41 +584,62 @@ int close_socket(int sock)
  */
 void init_pool(int listenfd, int dns_sock, pool *p)
 {
-    p->maxi = -1;
-
-    memset(p->clientfd, -1, FD_SETSIZE*sizeof(int)); // No clients at the moment.
-    memset(p->dns,       false,  FD_SETSIZE*sizeof(bool)); // No dns yet.
-    memset(p->states,    0, FD_SETSIZE*sizeof(fsm*)); // NULL out the fsms.
-
-    /* Initailly, listenfd and dns_sock are the only members of the read set */
-    p->maxfd = dns_sock;
-    FD_ZERO(&p->masterfds);
-    FD_SET(listenfd, &p->masterfds);
-    FD_SET(dns_sock, &p->masterfds);
+    p->nready    = 0;
+    p->splice    = false;
+    p->nclients  = 0;
+    p->graveyard = NULL;
+    p->timers    = NULL;
+
+    up_init(&p->up, idle_max, idle_ms);
+    rs_init(&p->rs, dns_sock, dns_ip, dns_port, DNS_TIMEOUT);
+    p->ring_bid  = -1;
+    p->starved   = NULL;
+
+    /* Initailly, listenfd and dns_sock are the only handles */
+    p->listen_ev.fd     = listenfd;
+    p->listen_ev.kind   = EV_LISTEN;
+    p->listen_ev.state  = NULL;
+    p->listen_ev.events = 0;
+
+    p->dns_ev.fd        = dns_sock;
+    p->dns_ev.kind      = EV_DNS;
+    p->dns_ev.state     = NULL;
+    p->dns_ev.events    = 0;
 }
 
 /*
  * @brief Adds a client file descriptor to the pool and updates it.
  *
  * @param client_fd The client file descriptor.
+ * @param cli_ip    The client's address.
  * @param p         The pool struct to update.
  */
-void add_client(int client_fd, pool *p)
+void add_client(int client_fd, in_addr_t cli_ip, pool *p)
 {
-    int i; fsm* state;
-
-    p->nready--;
+    fsm* state;
+    struct dns_query* q;
+    struct in_addr ipblk;
+    long long now = now_ms();
 
     /* Create a fsm for this client */
     state = malloc(sizeof(struct state));
 
+    if (state == NULL)
+    {
+        close_socket(client_fd);
+        return;
+    }
+
     /* Create initial values for fsm */
-    memset(state->request,  0, BUF_SIZE);
-    memset(state->response, 0, BUF_SIZE);
-    state->method     = NULL;
-    state->uri        = NULL;
-    state->version    = NULL;
-    state->header     = NULL;
+    state->request    = NULL;
+    state->req_size   = 0;
+    state->req_at     = 0;
+    state->response   = NULL;
+    state->req_len    = 0;
+    state->req_err    = 0;
+    state->line_at    = 0;
+    state->scan_at    = 0;
+    state->nhdrs      = 0;
     state->body       = NULL;
     state->body_size  = 0; // No body as of yet
 
@@ -298,337 +649,1545 @@ void add_client(int client_fd, pool *p)
     state->conn       = 1;
     bzero(state->serv_ip, INET_ADDRSTRLEN);
 
-    state->avg_tput   = global_smallest;
-
-    if(!dns)
-        connect_server(state, www_ip);
-    else
-        resolve("video.cs.cmu.edu", "8080", NULL, NULL);
-
-    memset(state->freebuf, 0, FREE_SIZE*sizeof(char*));
-
-    for (i = 0; i < FD_SETSIZE; i++)  /* Find an available slot */
+    state->servfd     = -1;
+    state->servst     = NULL;
+    state->connecting = false;
+
+    state->inflight     = 0;
+    state->framing      = true;
+    state->reusable     = true;
+    state->resp_left    = 0;
+    state->resp_hdr_len = 0;
+    state->resp_hdr     = NULL;
+    state->sent_head    = 0;
+    state->sent_n       = 0;
+
+    state->fill         = NULL;
+    state->fill_next    = false;
+    state->frag_len     = 0;
+
+    state->avg_tput   = 0;
+    est_init(&state->est);
+    state->current_best = 0;
+    state->video      = NULL;
+    state->cli_ip     = cli_ip;
+    state->sess_path[0] = '\0';
+    state->group      = NULL;
+    bzero(state->lastchunk, sizeof(state->lastchunk));
+    state->bitrate    = 0;
+    state->buffer     = 0;
+    state->buf_at     = 0;
+
+    /* Writes are queued rather than waited for, whatever the backend */
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+
+    state->clientfd       = client_fd;
+    state->cli_ev.fd      = client_fd;
+    state->cli_ev.kind    = EV_CLIENT;
+    state->cli_ev.state   = state;
+    state->cli_ev.events  = 0;
+    state->serv_ev.fd     = -1;
+    state->serv_ev.kind   = EV_SERVER;
+    state->serv_ev.state  = state;
+    state->serv_ev.events = 0;
+    state->pipefd[0]      = -1;
+    state->pipefd[1]      = -1;
+
+    outq_init(&state->cli_out);
+    outq_init(&state->serv_out);
+    state->draining   = false;
+    state->paused     = false;
+
+    state->closed     = false;
+    state->next       = NULL;
+
+    state->deadline   = 0;
+    state->tprev      = NULL;
+    state->tnext      = NULL;
+
+    state->uring_ops   = 0;
+    state->sendq       = NULL;
+    state->sendq_head  = 0;
+    state->sendq_sent  = 0;
+    state->sendq_tail  = 0;
+    state->sendq_cap   = 0;
+    state->starved     = 0;
+    state->starve_next = NULL;
+
+    p->nclients++;
+
+    if (dns)
     {
-        if(p->clientfd[i] < 0) {   /* Found one free slot */
-            p->clientfd[i] = client_fd;
-
-            /* Add the descriptor to the master set */
-            FD_SET(client_fd, &p->masterfds);
-
-            if(!dns)
-                FD_SET(state->servfd, &p->masterfds);
-
-            /* Add fsm to pool */
-            p->states[i] = state;
+        /* A cached answer saves the round trip */
+        if (rs_lookup(&p->rs, VIDEO_HOST, now, &ipblk.s_addr))
+        {
+            start_server(p, state, inet_ntoa(ipblk));
+            return;
+        }
 
-            /* Expecting DNS response */
-            p->dns[i]    = true;
+        /* Otherwise park the client on the query until the reply comes
+           in; its socket is watched once the server connection exists. */
+        if ((q = rs_query(&p->rs, VIDEO_HOST, now)) != NULL)
+        {
+            state->next = q->waiters;
+            q->waiters  = state;
+            return;
+        }
+    }
 
-            /* Update max descriptor and max index */
-            if (client_fd > p->maxfd)
-                p->maxfd = client_fd;
+    start_server(p, state, www_ip);
+}
 
-            if(!dns && state->servfd > p->maxfd)
-                p->maxfd = state->servfd;
+/*******************************************************************/
+/* @brief Connects a client to its server and starts watching it;   */
+/*        answers 503 if that fails or there is no server to use.   */
+/*******************************************************************/
+void start_server(pool *p, fsm* state, char* webip)
+{
+    if (webip == NULL ||
+        connect_server(p, state, webip) != EXIT_SUCCESS ||
+        watch_client(p, state) == -1)
+    {
+        fail_client(p, state, 503);
 
-            if (i > p->maxi)
-                p->maxi = i;
+        /* The client's socket is not watched yet, and has to be for
+           what it did not take at once */
+        if (!state->closed && p->loop.backend != EV_URING &&
+            ev_add(&p->loop, &state->cli_ev, EV_WRITE) == -1)
+            rm_client(p, state);
+    }
+}
 
-            break;
-        }
+/*****************************************************************/
+/* @brief Starts watching a client for input, and its server     */
+/*        connection for input or, while it is still connecting, */
+/*        for the connect to finish.                             */
+/* @returns 0 on success, -1 if the event loop refused either.   */
+/*****************************************************************/
+int watch_client(pool *p, fsm* state)
+{
+    if (p->loop.backend == EV_URING)
+    {
+        if (!state->connecting)
+            uring_watch(p, &state->serv_ev);
+        uring_watch(p, &state->cli_ev);
+        return 0;
     }
 
-    if (i == FD_SETSIZE)   /* There are no empty slots */
+    if (ev_add(&p->loop, &state->serv_ev,
+               state->connecting ? EV_WRITE : EV_READ) == -1)
+        return -1;
+
+    if (ev_add(&p->loop, &state->cli_ev, EV_READ) == -1)
     {
-        client_error(state, 503);
-        send(client_fd, state->response, state->resp_idx, 0);
-        close_socket(client_fd);
-        free(state);
+        ev_del(&p->loop, &state->serv_ev);
+        return -1;
     }
+
+    return 0;
 }
 
 /*********************************************************************/
-/* @brief Iterates through active clients and reads requests.        */
+/* @brief Dispatches every handle reported ready by the event loop.  */
 /*                                                                   */
-/* Uses select to determine whether clients are ready for reading or */
-/* writing, reads a request. Never blocks for a                      */
-/* single user.                                                      */
+/* Only ready descriptors are visited, and each one leads straight   */
+/* to its fsm. Clients removed while the batch is being handled are  */
+/* freed at the end, so later events in the batch never see freed    */
+/* memory.                                                           */
 /*                                                                   */
 /* @param p The pool of clients to iterate through.                  */
-/* @param dns_sock The DNS server socket                             */
 /*********************************************************************/
-void check_clients(pool *p, int dns_sock)
+void check_clients(pool *p)
 {
-    int i, client_fd, n, error;
-    fsm* state;
-    char buf[BUF_SIZE] = {0};
-    struct serv_rep* servst;
+    int i;
+    struct ev_handle* h;
+
+    for (i = 0; i < p->nready; i++)
+    {
+        h = p->ready[i].h;
+
+        switch (h->kind)
+        {
+        case EV_LISTEN:
+            accept_clients(p);
+            break;
+        case EV_DNS:
+            handle_dns(p);
+            break;
+        case EV_CLIENT:
+        case EV_SERVER:
+            handle_ready(p, h, p->ready[i].events);
+            break;
+        case EV_PREFETCH:
+            pf_ready(&p->pf, &p->loop, &p->up, h, p->ready[i].events);
+            break;
+        }
+    }
+
+    check_timers(p);
+    reap_clients(p);
+}
 
-    memset(buf,0,BUF_SIZE);
+/****************************************************************/
+/* @brief Frees the clients removed during this batch of events */
+/*        that nothing refers to anymore. Under io_uring a      */
+/*        client stays around until its cancelled requests have */
+/*        all completed.                                        */
+/****************************************************************/
+void reap_clients(pool *p)
+{
+    fsm** link = &p->graveyard;
+    fsm*  state;
 
-    /* Iterate through all clients, and read their data */
-    for(i = 0; (i <= p->maxi) && (p->nready > 0); i++)
+    while ((state = *link) != NULL)
     {
-        if((client_fd = p->clientfd[i]) <= 0)
+        if (state->uring_ops > 0)
+        {
+            link = &state->next;
             continue;
+        }
+
+        *link = state->next;
+        free(state->sendq);
+        release_request(state);
+        bp_put(state->response);
+        bp_put(state->resp_hdr);
+        free(state);
+    }
+}
 
-        state  = p->states[i];
+/*****************************************************/
+/* @brief Accepts every pending connection.          */
+/* @param p The pool to add the new clients to.      */
+/*****************************************************/
+void accept_clients(pool *p)
+{
+    int                 client_fd;
+    socklen_t           cli_size;
+    struct sockaddr_in  cli_addr;
 
-        /* Are we using DNS ? */
-        if(dns)
+    while (1)
+    {
+        cli_size = sizeof(cli_addr);
+        if ((client_fd = accept(p->listen_ev.fd, (struct sockaddr *) &cli_addr,
+                                &cli_size)) == -1)
         {
-            /* Check if there is a 'requested' DNS response for this socket */
-            if(FD_ISSET(dns_sock, &p->readfds) && p->dns[i])
-            {
-              #define              BUFLEN         512
-              uint8_t              buf[BUFLEN]  = {0};
-              struct  sockaddr_in  from         = {0};
-              socklen_t            fromlen      = sizeof(from);
-              struct in_addr       ipblk        = {0};
-              answer*              reply        = NULL;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                fprintf(stderr, "accept: %s\n", strerror(errno));
+            return;
+        }
 
-              recvfrom(dns_sock, buf, BUFLEN, 0,
-                       (struct sockaddr *) &from, &fromlen);
+        add_client(client_fd, cli_addr.sin_addr.s_addr, p);
+    }
+}
 
-              dns_message* msg = parse_message(buf);
-              reply            = msg->answers[0];
+/*******************************************************************/
+/* @brief Hands each DNS reply to the clients waiting on the query  */
+/*        it answers. Replies to nothing pending are dropped.       */
+/* @param p The pool of clients.                                    */
+/*******************************************************************/
+void handle_dns(pool *p)
+{
+    uint8_t            buf[MAX_MESSAGE_SIZE];
+    struct dns_query*  q;
+    in_addr_t          ip;
+    ssize_t            n;
 
-              in_addr_t ip     = (in_addr_t) (binary2int(reply->RDATA, 4));
-              ipblk.s_addr     = ip;
+    while (1)
+    {
+        memset(buf, 0, MAX_MESSAGE_SIZE);
 
-              connect_server(state, inet_ntoa(ipblk));
+        if ((n = recv(p->dns_ev.fd, buf, MAX_MESSAGE_SIZE,
+                      MSG_DONTWAIT)) <= 0)
+            return;
 
-              /* Add servfd to select() */
-              FD_SET(state->servfd, &p->masterfds);
-              p->maxfd = state->servfd;
+        if ((q = rs_reply(&p->rs, buf, n, now_ms(), &ip)) != NULL)
+            resolved(p, q, ip);
+    }
+}
 
-              /* Free memory */
-              free_dns(msg);
+/*******************************************************************/
+/* @brief Connects the clients waiting on a finished query, to the  */
+/*        fallback server if it got no answer.                      */
+/* @param ip The answer, INADDR_NONE if there was none.             */
+/*******************************************************************/
+void resolved(pool *p, struct dns_query* q, in_addr_t ip)
+{
+    struct in_addr ipblk = { .s_addr = ip };
+    fsm* state;
 
-              /* Not requesting DNS anymore...*/
-              p->dns[i] = 0;
-            }
-            /* DNS requested but never came...*/
-            else if(p->dns[i])
-            {
-                continue;
-            }
-        }
+    while ((state = q->waiters) != NULL)
+    {
+        q->waiters  = state->next;
+        state->next = NULL;
 
-        /* If a descriptor is ready to be read, read a line from it */
-        if (client_fd > 0 && FD_ISSET(client_fd, &p->readfds))
-        {
-            p->nready--;
+        start_server(p, state, ip != INADDR_NONE ? inet_ntoa(ipblk) : www_ip);
+    }
 
-            state = p->states[i];
+    free(q);
+}
 
-            /* Recv bytes from the client */
-            n = Recv(client_fd, buf, BUF_SIZE);
+/*******************************************************************/
+/* @brief Handles readiness on a client or server socket: flushes   */
+/*        what is queued for it, reads what it sent, then updates   */
+/*        what both of the client's sockets are watched for.        */
+/* @param p      The pool of clients.                               */
+/* @param h      The handle of the ready socket.                    */
+/* @param events EV_READ and/or EV_WRITE.                           */
+/*******************************************************************/
+void handle_ready(pool *p, struct ev_handle* h, unsigned int events)
+{
+    fsm* state = h->state;
+    struct outq* q = (h->kind == EV_CLIENT) ? &state->cli_out
+                                            : &state->serv_out;
 
-            /* We have received bytes, send for parsing. */
-            if (n >= 1)
+    if (state->closed)
+        return;
+
+    /* Whatever woke a connecting socket, the connect is settled */
+    if (h->kind == EV_SERVER && state->connecting)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        if (getsockopt(h->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+            err = errno;
+
+        connect_done(p, state, err);
+        if (state->closed)
+            return;
+    }
+
+    /* Flushing first may lift the backpressure on the other socket */
+    if ((events & EV_WRITE) && outq_flush(q, h->fd) == -1)
+    {
+        rm_client(p, state);
+        return;
+    }
+
+    if ((events & EV_READ) && !state->draining)
+    {
+        if (h->kind == EV_CLIENT)
+            handle_client(p, state);
+        else
+            handle_server(p, state);
+    }
+
+    set_interest(p, state);
+}
+
+/*******************************************************************/
+/* @brief Reads requests from a client and relays them to its      */
+/*        server. In edge-triggered mode the socket is drained      */
+/*        until it would block.                                     */
+/* @param p     The pool of clients.                                */
+/* @param state The client that is ready for reading.               */
+/*******************************************************************/
+void handle_client(pool *p, fsm* state)
+{
+    int n;
+    int client_fd = state->clientfd;
+    char buf[BUF_SIZE];
+
+    do
+    {
+        /* Recv bytes from the client */
+        if (p->loop.edge)
+            n = Recv_nb(client_fd, buf, BUF_SIZE);
+        else
+            n = Recv(client_fd, buf, BUF_SIZE);
+
+        /* Client sent EOF, close socket. */
+        if (n == 0)
+        {
+            rm_client(p, state);
+            return;
+        }
+
+        if (n == -1)
+        {
+            /* Drained */
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return;
+
+            /* Error with recv */
+            rm_client(p, state);
+            return;
+        }
+
+        client_data(p, state, buf, n);
+
+    } while (p->loop.edge && !state->closed && !state->draining &&
+             state->serv_out.bytes < OUTQ_HIGH);
+}
+
+/*******************************************************************/
+/* @brief Parses n bytes of requests from a client and forwards     */
+/*        every complete one to its server.                         */
+/* @param p     The pool of clients.                                */
+/* @param state The client the bytes came from.                     */
+/* @param buf   The bytes.                                          */
+/* @param n     How many bytes.                                     */
+/*******************************************************************/
+void client_data(pool *p, fsm* state, char* buf, int n)
+{
+    int error;
+
+    /* We have received bytes, send for parsing. */
+    if ((error = store_request(buf, n, state)) != 0)
+    {
+        fail_client(p, state, error);
+        return;
+    }
+
+    /* The loop that keeps servicing pipelined request */
+    do{
+        /* Parse the request line and headers in one go. */
+        error = parse_request(state);
+
+        /* Malformed Request */
+        if(error != 0 && error != -1)
+        {
+            fail_client(p, state, error);
+            return;
+        }
+
+        /* Incomplete request, save and wait for more */
+        if(error == -1) break;
+
+        /* Everything has been parsed, service the client */
+        if ((error = service(state)) != 0)
+        {
+            fail_client(p, state, error);
+            return;
+        }
+
+        if (serve_cached(p, state) || serve_manifest(p, state))
+        {
+            if (state->closed)
+                return;
+        }
+        else
+        {
+            /* Regular GET/HEAD: the rewritten request line, then the
+               client's headers as they are in its buffer */
+            send_server(p, state, state->response, state->resp_idx);
+            if (state->resp_idx > 0)
+                send_server(p, state, span_at(state, state->header),
+                            state->header.len);
+            send_server(p, state, state->body, state->body_size);
+
+            if (state->closed)
+                return;
+
+            /* Clock the start time */
+            clock_gettime(CLOCK_MONOTONIC, &state->start);
+
+            if (state->resp_idx > 0)
             {
-                store_request(buf, n, state);
-
-                /* The loop that keeps servicing pipelined request */
-                do{
-                    /* First, parse method, URI and version. */
-                    if(state->method == NULL)
-                    {
-                        /* Malformed Request */
-                        if((error = parse_line(state)) != 0 && error != -1)
-                        {
-                            client_error(state, error);
-                            if (Send(client_fd, state->response, state->resp_idx)
-                                != state->resp_idx)
-                            {
-                                rm_client(client_fd, p, i);
-                                break;
-                            }
-                            rm_client(client_fd, p, i);
-                            break;
-                        }
-
-                        /* Incomplete request, save and continue to next client */
-                        if(error == -1) break;
-                    }
-
-                    /* Then, parse headers. */
-                    if(state->header == NULL && state->method != NULL)
-                    {
-                        if((error = parse_headers(state)) != 0)
-                        {
-                            client_error(state, error);
-                            if (Send(client_fd, state->response, state->resp_idx) !=
-                                state->resp_idx)
-                            {
-                                rm_client(client_fd, p, i);
-                                break;
-                            }
-                            rm_client(client_fd, p, i);
-                            break;
-                        }
-                    }
-
-                    /* If everything has been parsed, service the client */
-                    if(state->method != NULL && state->header != NULL)
-                    {
-                        if ((error = service(state)) != 0)
-                        {
-                            client_error(state, error);
-                            if (Send(client_fd, state->response, state->resp_idx) !=
-                                state->resp_idx)
-                            {
-                                rm_client(client_fd, p, i);
-                                break;
-                            }
-                            rm_client(client_fd, p, i);
-                            break;
-                        }
-
-                        /* Regular GET/HEAD */
-                        else if (Send(state->servfd, state->response, state->resp_idx)
-                                 != state->resp_idx ||
-                                 Send(state->servfd, state->body, state->body_size)
-                                 != state->body_size)
-                        {
-                            rm_client(client_fd, p, i);
-                            break;
-                        }
-
-                        /* Clock the start time */
-                        clock_gettime(CLOCK_MONOTONIC, &state->start);
-
-                        memset(buf,0,BUF_SIZE);
-                    }
-
-                    /* Finished serving one request, reset buffer */
-                    state->end_idx = resetbuf(state);
-                    clean_state(state);
-                    if(!state->conn) rm_client(client_fd, p, i);
-                } while(error == 0 && state->conn);
-                continue;
+                state->inflight++;
+                frame_request(state);
             }
+        }
+
+        prefetch_next(p, state);
+
+        /* Finished serving one request, reset buffer */
+        resetbuf(state);
+        clean_state(state);
+        if(!state->conn)
+        {
+            rm_client(p, state);
+            return;
+        }
+    } while(error == 0 && state->conn);
+}
+
+/*******************************************************************/
+/* @brief Relays whatever the webserver sent back to its client,   */
+/*        and stashes .f4m manifests for bitrate adaptation.        */
+/* @param p     The pool of clients.                                */
+/* @param state The client whose server is ready for reading.       */
+/*******************************************************************/
+void handle_server(pool *p, fsm* state)
+{
+    int n;
+    bool spliced;
+    char buf[BUF_SIZE];
+
+    do
+    {
+        /* Manifests and response headers are parsed here; bodies may
+           bypass us */
+        spliced = p->splice && state->servst->expecting != REGF4M &&
+                  (!state->framing || state->resp_left > 0) &&
+                  state->fill == NULL;
+
+        if (spliced)
+            n = splice_server(state);
+        else
+        {
+            /* Receive bytes from the webserver */
+            if (p->loop.edge)
+                n = Recv_nb(state->servfd, buf, BUF_SIZE);
+            else
+                n = Recv(state->servfd, buf, BUF_SIZE);
+        }
+
+        /* The server hung up; this client cannot be served any further */
+        if (n == 0)
+        {
+            drain_client(p, state);
+            return;
+        }
+
+        if (n == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return;
+
+            rm_client(p, state);
+            return;
+        }
+
+        if (spliced)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &state->end);
+            frame_skip(state, n);
+            count_relayed(state, n);
+        }
+        else
+            server_data(p, state, buf, n);
+
+    } while (p->loop.edge && !state->closed && !state->draining &&
+             state->cli_out.bytes < OUTQ_HIGH && state->cli_out.piped == 0);
+}
+
+/*******************************************************************/
+/* @brief Moves whatever the server has sent straight to the client */
+/*        through the client's pipe, without copying it into the    */
+/*        proxy. What the client does not take stays in the pipe.   */
+/* @returns bytes relayed, 0 on EOF from the server, -1 on error    */
+/*          (errno EAGAIN if there was nothing to read).            */
+/*******************************************************************/
+int splice_server(fsm* state)
+{
+    ssize_t in;
+    size_t  len = SPLICE_SIZE;
+
+    /* Stop at the end of the body; the next headers are read */
+    if (state->framing && state->resp_left < (long long) len)
+        len = state->resp_left;
+
+    if (state->pipefd[0] == -1)
+    {
+        if (pipe2(state->pipefd, O_NONBLOCK | O_CLOEXEC) == -1)
+            return -1;
+        state->cli_out.pipefd = state->pipefd[0];
+    }
+
+    if ((in = splice(state->servfd, NULL, state->pipefd[1], NULL,
+                     len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) <= 0)
+        return in;
+
+    /* Queued behind whatever the client is still owed */
+    if (outq_piped(&state->cli_out, in) == -1 ||
+        outq_flush(&state->cli_out, state->clientfd) == -1)
+    {
+        errno = EPIPE;
+        return -1;
+    }
+
+    return in;
+}
+
+/*******************************************************************/
+/* @brief Answers a fragment request from the fragment cache: from  */
+/*        memory, or else from disk by sendfile(). A fragment found */
+/*        on disk more than once is copied into memory. On a miss   */
+/*        the response is marked to be stored, as long as it is the */
+/*        next one the server sends.                                */
+/* @returns true if the client was answered, or removed for failing */
+/*          to be; the caller tells these apart by state->closed.   */
+/*******************************************************************/
+bool serve_cached(pool *p, fsm* state)
+{
+    struct fc_entry* e;
+    struct dc_hit h;
+    size_t body;
+    unsigned long long elapsed, ns;
+
+    state->fill_next = false;
+
+    /* Only GETs for fragments, and only while answers stay in order */
+    if (!p->cache || state->servst->expecting != VIDEO ||
+        state->lastchunk[0] == '\0' || !span_is(state, state->method, "GET") ||
+        state->inflight > 0 || state->fill != NULL)
+        return false;
+
+    if ((e = fc_get(&fcache, state->lastchunk)) != NULL)
+    {
+        send_client(p, state, e->data, e->len);
+
+        body    = e->len - e->hdr_len;
+        elapsed = e->elapsed;
+        fc_release(&fcache, e);
+
+        if (state->closed)
+            return true;
+    }
+    else if (dc_get(&dcache, state->lastchunk, &h))
+    {
+        if (h.hot && (e = fc_new(&fcache, state->lastchunk, h.data, h.len,
+                                 0)) != NULL)
+        {
+            e->hdr_len = h.hdr_len;
+            e->elapsed = h.elapsed;
+            fc_put(&fcache, e);
+        }
+
+        /* The queue holds the segment until the bytes are out */
+        if (outq_file(&state->cli_out, state->clientfd, h.fd, h.off, h.len,
+                      h.pin) == -1)
+        {
+            rm_client(p, state);
+            return true;
+        }
+
+        body    = h.len - h.hdr_len;
+        elapsed = h.elapsed;
+    }
+    else
+    {
+        strcpy(state->fill_key, state->lastchunk);
+        state->fill_next = state->framing;
+        return false;
+    }
+
+    /* The sample is how fast the origin sent this fragment, not how
+       fast the cache is; otherwise ABR would climb past what a miss
+       can be fetched at. */
+    clock_gettime(CLOCK_MONOTONIC, &state->end);
+    ns = 1000000000ULL * state->end.tv_sec + state->end.tv_nsec - elapsed;
+    state->start.tv_sec  = ns / 1000000000ULL;
+    state->start.tv_nsec = ns % 1000000000ULL;
+
+    state->body_size = body;
+    calculate_bitrate(state);
+    state->body_size = 0;
+
+    return true;
+}
+
+/*******************************************************************/
+/* @brief Answers a manifest request with the _nolist twin kept for */
+/*        the video, as long as nothing is due to the client first. */
+/* @returns true if the client was answered.                        */
+/*******************************************************************/
+bool serve_manifest(pool *p, fsm* state)
+{
+    char* nolist;
+    size_t len;
+
+    if (state->servst->expecting != NOLIST || state->video == NULL ||
+        !span_is(state, state->method, "GET") || state->inflight > 0 ||
+        state->fill != NULL ||
+        (nolist = mf_nolist(state->video, state->mf_uri, &len)) == NULL)
+        return false;
+
+    send_client(p, state, nolist, len);
+    free(nolist);
+    return true;
+}
+
+/*******************************************************************/
+/* @brief Starts fetching the fragments after the one a client just */
+/*        asked for, at the bitrate it is expected to ask for them  */
+/*        at. The stream itself takes the bitrate's worth of the    */
+/*        client's measured throughput and adaptation keeps half as */
+/*        much again in reserve; each fragment fetched ahead needs  */
+/*        another bitrate's worth spare, so a client with little    */
+/*        headroom gets no prefetch.                                */
+/*******************************************************************/
+void prefetch_next(pool *p, fsm* state)
+{
+    char key[FC_KEY_LEN];
+    char* name;
+    char* host;
+    int host_len;
+    struct span* h;
+    unsigned long long rate = state->current_best;
+    int j;
+
+    if (p->pf.depth == 0 || state->servst->expecting != VIDEO ||
+        state->lastchunk[0] == '\0' || !span_is(state, state->method, "GET") ||
+        state->connecting || rate == 0 ||
+        (name = strrchr(state->lastchunk, '/')) == NULL)
+        return;
+
+    /* The client's Host, or failing that the origin's address */
+    if ((h = search_hdr(state, "Host")) != NULL)
+    {
+        host     = span_at(state, *h);
+        host_len = h->len;
+    }
+    else
+    {
+        host     = state->serv_ip;
+        host_len = strlen(state->serv_ip);
+    }
+
+    for (j = 1; j <= p->pf.depth; j++)
+    {
+        if (state->avg_tput * 2 < rate * (2 * j + 3))
+            break;
 
-            /* Client sent EOF, close socket. */
-            if (n == 0)
+        snprintf(key, sizeof(key), "%.*s%lluSeg%d-Frag%d",
+                 (int) (name + 1 - state->lastchunk), state->lastchunk,
+                 rate, state->segno, state->fragno + j);
+
+        /* The client is fetching it itself already, or will */
+        if (frame_pending(state, key) ||
+            asked_next(state, state->segno, state->fragno + j))
+            continue;
+
+        pf_start(&p->pf, &p->loop, &p->up, key, host, host_len,
+                 state->serv_addr.sin_addr.s_addr);
+    }
+}
+
+/*******************************************************************/
+/* @brief Whether a request the client has pipelined behind the one */
+/*        being served asks for fragment frag of segment seg, at    */
+/*        any bitrate.                                              */
+/*******************************************************************/
+bool asked_next(fsm* state, int seg, int frag)
+{
+    char name[32];
+    int  at = state->req_at + state->req_len + state->body_size;
+    int  n  = snprintf(name, sizeof(name), "Seg%d-Frag%d ", seg, frag);
+
+    return at < state->end_idx &&
+           scan_find(state->request + at, state->end_idx - at, name, n) != NULL;
+}
+
+/*****************************************************************/
+/* @brief Accounts for n bytes relayed to a client. Fragments    */
+/*        the framing follows are sampled whole as their last    */
+/*        byte goes by (frame_skip); only once framing is lost   */
+/*        does each read feed the estimate by itself.            */
+/*        state->end must already be clocked.                    */
+/*****************************************************************/
+void count_relayed(fsm* state, int n)
+{
+    sample_recv(state, n);
+
+    if (state->framing)
+        return;
+
+    state->body_size = n;
+
+    /* Calculate new throughput here */
+    calculate_bitrate(state);
+
+    state->body_size = 0;
+}
+
+/*******************************************************************/
+/* @brief Handles n bytes from a client's webserver: relays them to */
+/*        the client, or stashes them if they are a .f4m manifest   */
+/*        meant for the proxy.                                      */
+/* @param p     The pool of clients.                                */
+/* @param state The client whose server sent the bytes.             */
+/* @param buf   The bytes.                                          */
+/* @param n     How many bytes.                                     */
+/*******************************************************************/
+void server_data(pool *p, fsm* state, char* buf, int n)
+{
+    int error;
+    struct serv_rep* servst;
+    char* nolist;
+    size_t len;
+
+    clock_gettime(CLOCK_MONOTONIC, &state->end);
+
+    servst = state->servst;
+
+    /* perform the pipelining loop */
+    do {
+
+        /* If not, REGF4M, just send it away */
+        if(servst->expecting != REGF4M)
+        {
+            /* Just pass it on to the client */
+            relay(p, state, buf, n);
+            count_relayed(state, n);
+            break;
+        }
+
+        /* Is this the body or the status/headers? */
+        if (servst->headers == NULL &&
+            store_request_serv(buf, n, state->servst) == -1)
+        {
+            rm_client(p, state);
+            return;
+        }
+
+        /* Parse the headers */
+        if(servst->headers == NULL)
+        {
+            /* A manifest that cannot be delimited is not relayed */
+            if((error = parse_headers_serv(state)) != 0 && error != -1)
             {
-                rm_client(client_fd, p, i);
+                fail_client(p, state, 502);
+                return;
             }
 
-            /* Error with recv */
-            if (n == -1)
+            /* Skip the headers and keep only body data from buf; the
+               last n bytes of response[] came from it */
+            if(error == 0)
             {
-                rm_client(client_fd, p, i);
+                buf += servst->hdr_len - (servst->end_idx - n);
+                n    = servst->end_idx - servst->hdr_len;
             }
-        } // End of client read check
 
-        memset(buf,0,BUF_SIZE);
+            /* Incomplete headers, save and work on this later */
+            if(error == -1) break;
+        }
 
-        /* Check if the webserver has sent something to be relayed to this client */
-        if(state->servfd > 0 && FD_ISSET(state->servfd, &p->readfds))
+        /* Parse the body */
+        if(servst->headers != NULL && servst->body_idx < servst->body_size)
         {
-            p->nready--;
+            error = parse_body_serv(servst, buf, n);
 
-            /* Receive bytes from the webserver */
-            n = Recv(state->servfd, buf, BUF_SIZE);
+            /* More body data has to be sent, save for later */
+            if(error == -1) break;
+        }
 
-            clock_gettime(CLOCK_MONOTONIC, &state->end);
+        /* Everything has been parsed. */
+        /* If .f4m file, proceed to save it.*/
+        parse_f4m(state);
+        servst->expecting = NOLIST;
+        state->inflight--;
+        frame_answered(state, NULL);
+
+        /* The client gets the _nolist twin made from it or, if none
+           could be made, the manifest as it is */
+        if (state->video != NULL &&
+            (nolist = mf_nolist(state->video, state->mf_uri, &len)) != NULL)
+        {
+            send_client(p, state, nolist, len);
+            free(nolist);
+        }
+        else
+        {
+            send_client(p, state, servst->response, servst->hdr_len);
+            send_client(p, state, servst->body, servst->body_size);
+        }
+
+        /* Cleanup servstate */
+        free(servst->body);
+        bp_put(servst->response);
+        servst->response  = NULL;
+        servst->body      = NULL;
+        servst->headers   = NULL;
+        servst->end_idx   = 0;
+        servst->body_idx  = 0;
+        servst->body_size = 0;
+        servst->hdr_len   = 0;
+        servst->line_at   = 0;
+        servst->scan_at   = 0;
+        servst->length_at = 0;
+
+        if (state->closed)
+            return;
+
+        if(error == 0)
+            break;
+
+        /* The next response follows the body just taken */
+        buf += n - error;
+        n    = error;
+    } while(error > 0);
+}
+
+/*******************************************************************/
+/* @brief Sends bytes from a webserver on to the client. Under      */
+/*        io_uring the provided buffer being handled is queued for  */
+/*        a linked send instead, and recycled once it has gone out. */
+/*******************************************************************/
+void relay(pool *p, fsm* state, char* buf, int n)
+{
+    frame_response(state, buf, n);
+
+    if (p->loop.backend == EV_URING && p->ring_bid >= 0)
+    {
+        uring_relay(p, state, buf, n, p->ring_bid);
+        p->ring_bid = -1; // The send owns the buffer now
+        return;
+    }
+
+    send_client(p, state, buf, n);
+}
+
+/*******************************************************************/
+/* @brief Writes to a client, queueing what its socket won't take.  */
+/*        The client is removed if the write fails.                 */
+/*******************************************************************/
+void send_client(pool *p, fsm* state, char* buf, int n)
+{
+    if (p->loop.backend == EV_URING)
+    {
+        uring_write(p, state, &state->cli_ev, buf, n);
+        return;
+    }
+
+    if (outq_write(&state->cli_out, state->clientfd, buf, n) == -1)
+        rm_client(p, state);
+}
+
+/*******************************************************************/
+/* @brief Writes to a client's server, as send_client does. Until   */
+/*        the server is connected everything is queued.             */
+/*******************************************************************/
+void send_server(pool *p, fsm* state, char* buf, int n)
+{
+    int ret;
+
+    if (state->closed)
+        return;
+
+    if (state->connecting)
+        ret = outq_push(&state->serv_out, buf, n);
+    else if (p->loop.backend == EV_URING)
+    {
+        uring_write(p, state, &state->serv_ev, buf, n);
+        return;
+    }
+    else
+        ret = outq_write(&state->serv_out, state->servfd, buf, n);
+
+    if (ret == -1)
+        rm_client(p, state);
+}
+
+/*******************************************************************/
+/* @brief Answers a client with an error and closes it once the     */
+/*        response is out.                                          */
+/*******************************************************************/
+void fail_client(pool *p, fsm* state, int error)
+{
+    client_error(state, error);
+    send_client(p, state, state->response, state->resp_idx);
+
+    if (!state->closed)
+        drain_client(p, state);
+}
+
+/*******************************************************************/
+/* @brief Closes a client's server connection and removes the       */
+/*        client as soon as everything queued for it has been      */
+/*        written.                                                  */
+/*******************************************************************/
+void drain_client(pool *p, fsm* state)
+{
+    struct io_uring_sqe* sqe;
+
+    if (state->cli_out.bytes == 0 &&
+        state->sendq_tail == state->sendq_head)
+    {
+        rm_client(p, state);
+        return;
+    }
+
+    if (state->servfd >= 0)
+    {
+        /* io_uring's requests on it have to go before it does */
+        if (p->loop.backend == EV_URING &&
+            (sqe = uring_sqe(&p->ring)) != NULL)
+        {
+            uring_prep_cancel_fd(sqe, state->servfd, UR_DATA(NULL, UR_CANCEL));
+            uring_submit(&p->ring);
+        }
+
+        ev_del(&p->loop, &state->serv_ev);
+        close_socket(state->servfd);
+        state->servfd     = -1;
+        state->serv_ev.fd = -1;
+    }
+
+    outq_clear(&state->serv_out);
+    state->draining = true;
+}
+
+/*********************************************************************/
+/* @brief Watches a client's sockets for what they are needed for    */
+/*        now: writability while bytes are queued for them, and      */
+/*        input unless the other side is too far behind. A server    */
+/*        is read again once its client's queue is down to OUTQ_LOW. */
+/*********************************************************************/
+void set_interest(pool *p, fsm* state)
+{
+    unsigned int cli = 0, serv = 0;
+
+    if (p->loop.backend == EV_URING || state->closed)
+        return;
+
+    if (state->draining)
+    {
+        if (state->cli_out.bytes == 0)
+        {
+            rm_client(p, state);
+            return;
+        }
+
+        if (ev_mod(&p->loop, &state->cli_ev, EV_WRITE) == -1)
+            rm_client(p, state);
+        return;
+    }
+
+    /* Spliced bytes are read only into an empty pipe */
+    if (state->cli_out.bytes >= OUTQ_HIGH || state->cli_out.piped > 0)
+        state->paused = true;
+    else if (state->cli_out.bytes <= OUTQ_LOW)
+        state->paused = false;
+
+    if (state->connecting)
+        serv = EV_WRITE;
+    else
+    {
+        if (!state->paused)
+            serv |= EV_READ;
+        if (state->serv_out.bytes > 0)
+            serv |= EV_WRITE;
+    }
+
+    if (state->serv_out.bytes < OUTQ_HIGH)
+        cli |= EV_READ;
+    if (state->cli_out.bytes > 0)
+        cli |= EV_WRITE;
+
+    if (ev_mod(&p->loop, &state->cli_ev, cli) == -1 ||
+        ev_mod(&p->loop, &state->serv_ev, serv) == -1)
+        rm_client(p, state);
+}
+
+/******************************************************/
+/* @brief Arms a multishot recv on a client or server */
+/*        socket, drawing from the provided buffers.  */
+/******************************************************/
+void uring_watch(pool *p, struct ev_handle* h)
+{
+    struct io_uring_sqe* sqe;
+
+    if ((sqe = uring_sqe(&p->ring)) == NULL)
+        return;
 
-            if (n >= 1)
+    uring_prep_recv_multi(sqe, h->fd, UR_DATA(h, UR_RECV));
+    h->events |= EV_READ;
+    h->state->uring_ops++;
+}
+
+/*********************************************************************/
+/* @brief Handles every completion the ring has posted: new clients, */
+/*        DNS readiness, received data and finished relays.          */
+/* @param p The pool of clients.                                     */
+/*********************************************************************/
+void check_completions(pool *p)
+{
+    struct io_uring_cqe* cqe;
+    struct io_uring_sqe* sqe;
+    struct ev_handle*    h;
+    uint64_t             data;
+    unsigned             flags;
+    int                  res;
+    fsm*                 state;
+    struct sockaddr_in   cli_addr;
+    socklen_t            cli_size;
+
+    while ((cqe = uring_peek(&p->ring)) != NULL)
+    {
+        data  = cqe->user_data;
+        res   = cqe->res;
+        flags = cqe->flags;
+        uring_cq_advance(&p->ring);
+
+        if (flags & IORING_CQE_F_BUFFER)
+            p->ring.bufs_free--;
+
+        h = UR_PTR(data);
+
+        switch (UR_OP(data))
+        {
+        case UR_ACCEPT:
+            /* Multishot accepts leave the peer to be asked for */
+            if (res >= 0)
             {
-                servst = state->servst;
-
-                /* perform the pipelining loop */
-                do {
-
-                    /* If not, REGF4M, just send it away */
-                    if(servst->expecting != REGF4M)
-                    {
-                        /* Just pass it on to the client */
-                        Send(client_fd, buf, n);
-
-                        state->body_size = n;
-
-                        /* Calculate new throughput here */
-                        calculate_bitrate(state);
-
-                        state->body_size = 0;
-                        break;
-                    }
-
-                    /* Is this the body or the status/headers? */
-                    if (servst->headers == NULL)
-                        /*  Store the status msg */
-                        store_request_serv(buf, n, state->servst);
-
-                    /* Parse the headers */
-                    if(servst->headers == NULL)
-                    {
-                        if((error = parse_headers_serv(state)) != 0 && error != -1)
-                        {
-                            printf("parse_status error!!\n");
-                            exit(0);
-                        }
-
-                        /* Remove headers and store only body data from buf */
-                        if(error == 0)
-                        {
-                            char* CRLF = memmem(buf, n, "\r\n\r\n", strlen("\r\n\r\n"));
-                            n = resetbuf_serv(buf, CRLF+4 - buf, n);
-                        }
-
-                        /* Incomplete headers, save and work on this later */
-                        if(error == -1) break;
-                    }
-
-                    /* Parse the body */
-                    if(servst->headers != NULL && servst->body_idx < servst->body_size)
-                    {
-                        error = parse_body_serv(servst, buf, n);
-
-                        /* More body data has to be sent, save for later */
-                        if(error == -1) break;
-                    }
-
-                    /* Everything has been parsed. */
-                    /* If .f4m file, proceed to save it.*/
-                    parse_f4m(state);
-                    servst->expecting = NOLIST;
-
-                    /* Cleanup servstate */
-                    free(servst->body);
-                    servst->body = NULL;
-
-                    if(error == 0)
-                        break;
-
-                    n = error;
-                } while(error > 0);
+                cli_size = sizeof(cli_addr);
+                if (getpeername(res, (struct sockaddr *) &cli_addr,
+                                &cli_size) == -1)
+                    cli_addr.sin_addr.s_addr = INADDR_NONE;
+                add_client(res, cli_addr.sin_addr.s_addr, p);
             }
-        } // End of webserver read check
-    } // End of single client loop.
+
+            if (!(flags & IORING_CQE_F_MORE) &&
+                (sqe = uring_sqe(&p->ring)) != NULL)
+                uring_prep_accept_multi(sqe, h->fd, data);
+            break;
+        case UR_POLL:
+            handle_dns(p);
+
+            if (!(flags & IORING_CQE_F_MORE) &&
+                (sqe = uring_sqe(&p->ring)) != NULL)
+                uring_prep_poll_multi(sqe, h->fd, data);
+            break;
+        case UR_RECV:
+            recv_complete(p, h, res, flags);
+            break;
+        case UR_SEND:
+            send_complete(p, h->state, res);
+            break;
+        case UR_CONNECT:
+            h->state->uring_ops--;
+            if (!h->state->closed)
+                connect_done(p, h->state, -res);
+            break;
+        case UR_WRITE:
+            write_complete(p, h);
+            break;
+        }
+    }
+
+    check_timers(p);
+
+    /* Buffers came back; restart the receives that ran dry */
+    while (p->ring.bufs_free > 0 && (state = p->starved) != NULL)
+    {
+        p->starved         = state->starve_next;
+        state->starve_next = NULL;
+
+        if (state->starved & (1 << EV_CLIENT))
+            uring_watch(p, &state->cli_ev);
+        if ((state->starved & (1 << EV_SERVER)) && !state->paused)
+            uring_watch(p, &state->serv_ev);
+
+        state->starved = 0;
+    }
+
+    reap_clients(p);
+}
+
+/*********************************************************************/
+/* @brief Handles one completion of a multishot recv.                */
+/* @param h      The handle of the socket that was read.             */
+/* @param res    Bytes received, 0 on EOF or a negated errno.        */
+/* @param flags  CQE flags, carrying the provided buffer id.         */
+/*********************************************************************/
+void recv_complete(pool *p, struct ev_handle* h, int res, unsigned flags)
+{
+    fsm* state = h->state;
+    int  bid   = -1;
+
+    if (flags & IORING_CQE_F_BUFFER)
+        bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+    /* The recv is over and no longer refers to the fsm */
+    if (!(flags & IORING_CQE_F_MORE))
+    {
+        h->events &= ~EV_READ;
+        state->uring_ops--;
+    }
+
+    if (state->closed)
+    {
+        if (bid >= 0)
+            uring_buf_recycle(&p->ring, bid);
+        return;
+    }
+
+    if (res > 0 && bid >= 0)
+    {
+        if (h->kind == EV_CLIENT)
+        {
+            client_data(p, state, uring_buf(&p->ring, bid), res);
+            uring_buf_recycle(&p->ring, bid);
+        }
+        else
+        {
+            p->ring_bid = bid;
+            server_data(p, state, uring_buf(&p->ring, bid), res);
+
+            /* Unless it was queued for relaying, the buffer is free again */
+            if (p->ring_bid == bid)
+                uring_buf_recycle(&p->ring, bid);
+            p->ring_bid = -1;
+        }
+    }
+    else if (res == -ENOBUFS)
+    {
+        /* Re-armed by check_completions once buffers are recycled */
+        if (state->starved == 0)
+        {
+            state->starve_next = p->starved;
+            p->starved         = state;
+        }
+        state->starved |= 1 << h->kind;
+        return;
+    }
+    else if (res != -ECANCELED)
+    {
+        /* EOF or a real error */
+        rm_client(p, state);
+        return;
+    }
+
+    /* Keep receiving, unless the relay paused this server */
+    if (!state->closed && !state->draining && !(h->events & EV_READ) &&
+        !(h->kind == EV_SERVER && state->paused))
+        uring_watch(p, h);
+}
+
+/*********************************************************************/
+/* @brief Queues a received buffer to be relayed to the client. The  */
+/*        server recv is cancelled while too much is queued, so one  */
+/*        slow client cannot drain the shared buffer ring. Behind    */
+/*        output already waiting in cli_out it is copied there       */
+/*        instead, so bytes reach the client in order.               */
+/*********************************************************************/
+void uring_relay(pool *p, fsm* state, char* buf, int n, int bid)
+{
+    struct io_uring_sqe* sqe;
+    bool full;
+
+    if (state->cli_out.bytes > 0)
+    {
+        int ret = outq_push(&state->cli_out, buf, n);
+
+        uring_buf_recycle(&p->ring, bid);
+        if (ret == -1)
+        {
+            rm_client(p, state);
+            return;
+        }
+        full = state->cli_out.bytes >= OUTQ_HIGH;
+    }
+    else
+    {
+        if (sendq_add(p, state, buf, n, bid) == -1)
+        {
+            uring_buf_recycle(&p->ring, bid);
+            rm_client(p, state);
+            return;
+        }
+        full = state->sendq_tail - state->sendq_head > UR_RELAY_HIGH;
+    }
+
+    if (!state->paused && full && (sqe = uring_sqe(&p->ring)) != NULL)
+    {
+        state->paused = true;
+        uring_prep_cancel_fd(sqe, state->servfd, UR_DATA(NULL, UR_CANCEL));
+    }
+}
+
+/*********************************************************************/
+/* @brief Appends a buffer to a client's relay queue and starts a    */
+/*        chain of sends if none is in flight.                       */
+/* @param bid  The provided buffer holding it, or -1 for a malloc'd  */
+/*             copy.                                                 */
+/* @returns 0, or -1 if the queue could not grow.                    */
+/*********************************************************************/
+int sendq_add(pool *p, fsm* state, char* buf, int n, int bid)
+{
+    if (state->sendq_tail == state->sendq_cap)
+    {
+        if (state->sendq_head > 0)
+        {
+            memmove(state->sendq, state->sendq + state->sendq_head,
+                    (state->sendq_tail - state->sendq_head) * sizeof(struct relay));
+            state->sendq_sent -= state->sendq_head;
+            state->sendq_tail -= state->sendq_head;
+            state->sendq_head  = 0;
+        }
+        else
+        {
+            int cap = state->sendq_cap ? 2 * state->sendq_cap : 16;
+            struct relay* q = realloc(state->sendq, cap * sizeof(struct relay));
+
+            if (q == NULL)
+                return -1;
+
+            state->sendq     = q;
+            state->sendq_cap = cap;
+        }
+    }
+
+    state->sendq[state->sendq_tail].buf = buf;
+    state->sendq[state->sendq_tail].len = n;
+    state->sendq[state->sendq_tail].bid = bid;
+    state->sendq_tail++;
+
+    /* Nothing in flight: start a chain right away */
+    if (state->sendq_sent == state->sendq_head)
+        uring_flush(p, state);
+
+    return 0;
+}
+
+/*******************************************************************/
+/* @brief Lets go of a relay queue entry that is done with.         */
+/*******************************************************************/
+void sendq_done(pool *p, struct relay* r)
+{
+    if (r->bid >= 0)
+        uring_buf_recycle(&p->ring, r->bid);
+    else
+        free(r->buf);
+}
+
+/*********************************************************************/
+/* @brief Writes the proxy's own output to a client or server under  */
+/*        io_uring. The socket is non-blocking: what it won't take   */
+/*        waits in the outq for a poll to say it is writable. A      */
+/*        client with relays in flight gets a copy queued behind     */
+/*        them instead.                                              */
+/*********************************************************************/
+void uring_write(pool *p, fsm* state, struct ev_handle* h, char* buf, int n)
+{
+    struct outq* q = h->kind == EV_CLIENT ? &state->cli_out : &state->serv_out;
+    char* copy;
+
+    if (h->kind == EV_CLIENT && state->sendq_tail > state->sendq_head)
+    {
+        if ((copy = malloc(n)) == NULL)
+        {
+            rm_client(p, state);
+            return;
+        }
+
+        memcpy(copy, buf, n);
+        if (sendq_add(p, state, copy, n, -1) == -1)
+        {
+            free(copy);
+            rm_client(p, state);
+        }
+        return;
+    }
+
+    if (outq_write(q, h->fd, buf, n) == -1)
+    {
+        rm_client(p, state);
+        return;
+    }
+
+    uring_poll_out(p, h);
+}
+
+/*******************************************************************/
+/* @brief Arms a one-shot poll for a socket with queued output,     */
+/*        unless one is already waiting.                            */
+/*******************************************************************/
+void uring_poll_out(pool *p, struct ev_handle* h)
+{
+    fsm* state = h->state;
+    struct outq* q = h->kind == EV_CLIENT ? &state->cli_out : &state->serv_out;
+    struct io_uring_sqe* sqe;
+
+    if (q->bytes == 0 || (h->events & EV_WRITE) ||
+        (sqe = uring_sqe(&p->ring)) == NULL)
+        return;
+
+    uring_prep_poll_out(sqe, h->fd, UR_DATA(h, UR_WRITE));
+    h->events |= EV_WRITE;
+    state->uring_ops++;
+}
+
+/*********************************************************************/
+/* @brief Handles a socket with queued output becoming writable, or  */
+/*        its poll being cancelled by a pause: flushes what it will  */
+/*        take and polls again for the rest.                         */
+/*********************************************************************/
+void write_complete(pool *p, struct ev_handle* h)
+{
+    fsm* state = h->state;
+    struct outq* q = h->kind == EV_CLIENT ? &state->cli_out : &state->serv_out;
+
+    state->uring_ops--;
+    h->events &= ~EV_WRITE;
+
+    if (state->closed || h->fd < 0)
+        return;
+
+    switch (outq_flush(q, h->fd))
+    {
+    case -1:
+        rm_client(p, state);
+        return;
+    case 1:
+        uring_poll_out(p, h);
+        return;
+    }
+
+    if (h->kind == EV_CLIENT)
+        uring_caught_up(p, state);
+}
+
+/*******************************************************************/
+/* @brief Called once a client has been sent everything: closes it  */
+/*        if it was draining, else picks its server back up.       */
+/*******************************************************************/
+void uring_caught_up(pool *p, fsm* state)
+{
+    if (state->draining)
+    {
+        rm_client(p, state);
+        return;
+    }
+
+    if (state->paused)
+    {
+        state->paused = false;
+        if (state->servfd >= 0 && !(state->serv_ev.events & EV_READ))
+            uring_watch(p, &state->serv_ev);
+    }
+}
+
+/*******************************************************************/
+/* @brief Submits every unsent relay buffer as one chain of linked */
+/*        sends, so they reach the client in order.                */
+/*******************************************************************/
+void uring_flush(pool *p, fsm* state)
+{
+    struct io_uring_sqe* sqe;
+    int i, last = state->sendq_tail - 1;
+
+    for (i = state->sendq_sent; i <= last; i++)
+    {
+        if ((sqe = uring_sqe(&p->ring)) == NULL)
+            break;
+
+        uring_prep_send(sqe, state->clientfd, state->sendq[i].buf,
+                        state->sendq[i].len, UR_DATA(&state->cli_ev, UR_SEND),
+                        i < last);
+        state->uring_ops++;
+    }
+
+    state->sendq_sent = i;
+}
+
+/*********************************************************************/
+/* @brief Handles the completion of one relayed send. Sends complete */
+/*        in the order of their chain.                               */
+/* @param res  Bytes sent or a negated errno.                        */
+/*********************************************************************/
+void send_complete(pool *p, fsm* state, int res)
+{
+    struct relay* r = &state->sendq[state->sendq_head++];
+
+    state->uring_ops--;
+    sendq_done(p, r);
+
+    if (state->closed)
+        return;
+
+    /* MSG_WAITALL makes a short send an error */
+    if (res != r->len)
+    {
+        rm_client(p, state);
+        return;
+    }
+
+    /* The chain is still going */
+    if (state->sendq_head < state->sendq_sent)
+        return;
+
+    if (state->sendq_sent < state->sendq_tail)
+    {
+        uring_flush(p, state);
+        return;
+    }
+
+    state->sendq_head = state->sendq_sent = state->sendq_tail = 0;
+    uring_caught_up(p, state);
 }
 
 /***************************************************************************/
 /* @brief Removes a client and its state from the maintained pool, freeing */
-/* up resources and cleaning up memory                                     */
+/* up resources and cleaning up memory. The fsm itself is freed once the   */
+/* current batch of events has been dispatched.                            */
 /*                                                                         */
-/* @param client_fd  The client fd to be removed from the pool             */
 /* @param p          The pool from which to be removed                     */
-/* @param logmsg     A msg to write to the logfile                         */
-/* @param i          The index into the pool                               */
+/* @param state      The client to remove                                  */
 /***************************************************************************/
-void rm_client(int client_fd, pool* p, int i)
+void rm_client(pool* p, fsm* state)
 {
-    /* Sanitize memory */
-    fsm* state = p->states[i];
-    delfromfree(state->freebuf, FREE_SIZE);
-    free(state);
+    if (state->closed)
+        return;
+
+    state->closed = true;
+
+    timer_del(p, state);
+
+    /* Stop watching both sockets before they are closed */
+    if (p->loop.backend == EV_URING)
+    {
+        /* Cancellation has to reach the kernel while the fds are open */
+        struct io_uring_sqe* sqe;
+
+        if ((sqe = uring_sqe(&p->ring)) != NULL)
+            uring_prep_cancel_fd(sqe, state->clientfd, UR_DATA(NULL, UR_CANCEL));
+        if (state->servfd >= 0 && (sqe = uring_sqe(&p->ring)) != NULL)
+            uring_prep_cancel_fd(sqe, state->servfd, UR_DATA(NULL, UR_CANCEL));
+        uring_submit(&p->ring);
+
+        /* Relayed buffers that were never sent go straight back */
+        while (state->sendq_tail > state->sendq_sent)
+            sendq_done(p, &state->sendq[--state->sendq_tail]);
+
+        /* Forget a receive that was waiting for buffers */
+        for (fsm** link = &p->starved; *link != NULL;
+             link = &(*link)->starve_next)
+        {
+            if (*link == state)
+            {
+                *link = state->starve_next;
+                break;
+            }
+        }
+        state->starved = 0;
+    }
+    else
+    {
+        ev_del(&p->loop, &state->cli_ev);
+        ev_del(&p->loop, &state->serv_ev);
+    }
+
+    close_socket(state->clientfd);
+
+    if (state->servfd >= 0)
+        release_server(p, state);
+
+    /* A fragment cut short is not cached */
+    free(state->fill);
 
-    close_socket(client_fd);
-    FD_CLR(client_fd, &p->masterfds);
-    p->clientfd[i] = -1;
+    if (state->pipefd[0] >= 0)
+    {
+        close(state->pipefd[0]);
+        close(state->pipefd[1]);
+    }
+
+    outq_clear(&state->cli_out);
+    outq_clear(&state->serv_out);
+
+    if (state->servst != NULL)
+    {
+        free(state->servst->body);
+        bp_put(state->servst->response);
+        free(state->servst);
+    }
+
+    state->next  = p->graveyard;
+    p->graveyard = state;
+    p->nclients--;
 }
 
 
@@ -640,10 +2199,15 @@ void rm_client(int client_fd, pool* p, int i)
 /************************************************************/
 void client_error(fsm* state, int error)
 {
-    char* response = state->response;
+    char* response;
     char body[LOG_SIZE] = {0};
     char* errnum; char* errormsg;
 
+    /* Held until the client is removed */
+    if (state->response == NULL && (state->response = bp_get()) == NULL)
+        return;
+
+    response = state->response;
     memset(response,0,BUF_SIZE);
 
     switch (error)
@@ -656,6 +2220,14 @@ void client_error(fsm* state, int error)
         errnum    = "411";
         errormsg  = "Length Required";
         break;
+    case 413:
+        errnum    = "413";
+        errormsg  = "Request Entity Too Large";
+        break;
+    case 414:
+        errnum    = "414";
+        errormsg  = "Request-URI Too Long";
+        break;
     case 500:
         errnum    = "500";
         errormsg  = "Internal Server Error";
@@ -664,6 +2236,10 @@ void client_error(fsm* state, int error)
         errnum    = "501";
         errormsg  = "Not Implemented";
         break;
+    case 502:
+        errnum    = "502";
+        errormsg  = "Bad Gateway";
+        break;
     case 503:
         errnum    = "503";
         errormsg  = "Service Unavailable";
@@ -678,19 +2254,19 @@ void client_error(fsm* state, int error)
     }
 
     /* Build the HTTP response body */
-    sprintf(response, "HTTP/1.1 %s %s\r\n", errnum, errormsg);
-    sprintf(response, "%sContent-type: text/html\r\n", response);
-    sprintf(response, "%sServer: Liso/1.0\r\n", response);
-
-    sprintf(body, "<html><title>Webserver Error!</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, errormsg);
-    sprintf(body, "%s<hr><em>Fadhil's Web Server </em>\r\n", body);
-
-    sprintf(response, "%sConnection: close\r\n",      response);
-    sprintf(response, "%sContent-Length: %d\r\n\r\n", response,(int)strlen(body));
-
-    sprintf(response, "%s%s", response, body);
+    snprintf(body, sizeof(body),
+             "<html><title>Webserver Error!</title>"
+             "<body bgcolor=""ffffff"">\r\n"
+             "%s: %s\r\n"
+             "<hr><em>Fadhil's Web Server </em>\r\n", errnum, errormsg);
+
+    snprintf(response, BUF_SIZE,
+             "HTTP/1.1 %s %s\r\n"
+             "Content-type: text/html\r\n"
+             "Server: Liso/1.0\r\n"
+             "Connection: close\r\n"
+             "Content-Length: %d\r\n\r\n"
+             "%s", errnum, errormsg, (int) strlen(body), body);
 
     state->resp_idx += strlen(response);
 }
@@ -700,6 +2276,12 @@ void cleanup(int sig)
     (void) sig;
 
     log_close(logfile);
+    if (samplelog != NULL)
+        log_close(samplelog);
+    fc_stats(&fcache, stderr);
+    dc_stats(&dcache, stderr);
+    pf_stats(stderr);
+    ss_stats(stderr);
 
     fprintf(stderr, "\nThank you for flying Liso. See ya!\n");
     exit(1);
@@ -721,15 +2303,55 @@ sigchld_handler(int sig)
     return;
 }
 
-/************************************************************/
-/* @brief Connects to the webserver that has the videos.    */
-/* @param state - The state of the client behind the proxy. */
-/************************************************************/
-int connect_server(fsm* state, char* webip)
+/*****************************************************************/
+/* @brief Gets a client a connection to the webserver that has   */
+/*        the videos: an idle one from the pool if possible,     */
+/*        else a new one, which connects without being waited    */
+/*        for; connect_done is called once the connect succeeds, */
+/*        fails or times out.                                    */
+/* @param p     - The pool of the client.                        */
+/* @param state - The state of the client behind the proxy.      */
+/* @param webip - The server's address.                          */
+/*****************************************************************/
+int connect_server(pool *p, fsm* state, char* webip)
 {
-    int status, sock;
+    int sock;
+    in_addr_t ip = inet_addr(webip);
+
+    /* An idle connection to this origin saves the handshake */
+    if (ip != INADDR_NONE && (sock = up_get(&p->up, ip)) >= 0)
+    {
+        memset(&state->serv_addr, 0, sizeof(state->serv_addr));
+        state->serv_addr.sin_family      = AF_INET;
+        state->serv_addr.sin_port        = htons(8080);
+        state->serv_addr.sin_addr.s_addr = ip;
+    }
+    else if ((sock = open_server(p, state, webip)) == -1)
+        return EXIT_FAILURE;
+
+    /* We now have a unique connection for this client */
+    state->servfd     = sock;
+    state->serv_ev.fd = sock;
+    state->servst     = calloc(sizeof(struct serv_rep), 1);
+
+    strncpy(state->serv_ip, webip, INET_ADDRSTRLEN);
+
+    if (state->connecting)
+        timer_set(p, state, connect_timeout);
+
+    return EXIT_SUCCESS;
+}
+
+/*****************************************************************/
+/* @brief Opens a new connection to webip and starts connecting. */
+/* @returns the socket, -1 on error.                             */
+/*****************************************************************/
+int open_server(pool *p, fsm* state, char* webip)
+{
+    int status, sock, one = 1;
     struct addrinfo hints; struct sockaddr_in fake;
     struct addrinfo *servinfo; //will point to the results
+    struct io_uring_sqe* sqe;
 
     memset(&hints, 0, sizeof (hints));
     hints.ai_family = AF_INET;     //don't care IPv4 or IPv6
@@ -743,35 +2365,201 @@ int connect_server(fsm* state, char* webip)
     fake.sin_addr.s_addr = inet_addr(fake_ip);
     fake.sin_port        = 0;
 
-    /* Connect to the www_ip. */
+    /* Connect to the www_ip. A dotted address resolves without
+       blocking. */
     if ((status = getaddrinfo(webip, "8080", &hints, &servinfo)) != 0)
     {
         fprintf(stderr, "getaddrinfo error: %s \n", gai_strerror(status));
-        return EXIT_FAILURE;
+        return -1;
     }
 
     if((sock = socket(servinfo->ai_family, servinfo->ai_socktype,
                       servinfo->ai_protocol)) == -1)
     {
         fprintf(stderr, "Socket failed");
-        return EXIT_FAILURE;
+        freeaddrinfo(servinfo);
+        return -1;
     }
 
-    if (connect (sock, servinfo->ai_addr, servinfo->ai_addrlen) == -1)
+    memcpy(&state->serv_addr, servinfo->ai_addr, sizeof(struct sockaddr_in));
+    freeaddrinfo(servinfo);
+
+    /* Bind this socket to the fake-ip with an ephemeral port; this has
+       to happen before the connect picks a source address */
+    bind(sock, (struct sockaddr *) &fake, sizeof(fake));
+
+    /* A pooled connection still has the last request unacknowledged;
+       a new one must not wait behind it for a delayed ACK */
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+    if (p->loop.backend == EV_URING)
     {
-        fprintf(stderr, "Connect");
-            return EXIT_FAILURE;
+        if ((sqe = uring_sqe(&p->ring)) == NULL)
+        {
+            close_socket(sock);
+            return -1;
+        }
+
+        uring_prep_connect(sqe, sock, (struct sockaddr *) &state->serv_addr,
+                           sizeof(state->serv_addr),
+                           UR_DATA(&state->serv_ev, UR_CONNECT));
+        state->uring_ops++;
+        state->connecting = true;
+        return sock;
     }
 
-    /* Bind this socket to the fake-ip with an ephemeral port */
-    bind(sock, (struct sockaddr *) &fake, sizeof(fake));
+    if (connect(sock, (struct sockaddr *) &state->serv_addr,
+                sizeof(state->serv_addr)) == -1)
+    {
+        if (errno != EINPROGRESS)
+        {
+            fprintf(stderr, "Connect: %s\n", strerror(errno));
+            close_socket(sock);
+            return -1;
+        }
 
-    /* We now have a unique connection established for this client */
-    state->servfd = sock;
-    state->servst = calloc(sizeof(struct serv_rep), 1);
+        state->connecting = true;
+    }
 
-    strncpy(state->serv_ip, webip, INET_ADDRSTRLEN);
-    freeaddrinfo(servinfo);
+    return sock;
+}
 
-    return EXIT_SUCCESS;
+/*******************************************************************/
+/* @brief Hands a client's server connection to the idle pool if    */
+/*        every request sent on it has been answered in full and    */
+/*        the server keeps it open; otherwise closes it.            */
+/*******************************************************************/
+void release_server(pool *p, fsm* state)
+{
+    if (!state->connecting && state->framing && state->reusable &&
+        state->inflight == 0 && state->resp_left == 0 &&
+        state->resp_hdr_len == 0 && state->serv_out.bytes == 0 &&
+        up_put(&p->up, state->serv_addr.sin_addr.s_addr, state->servfd,
+               now_ms()))
+        return;
+
+    close_socket(state->servfd);
+}
+
+/*******************************************************************/
+/* @brief Settles a client's server connect. On success, requests   */
+/*        the client sent in the meantime go out; otherwise the     */
+/*        client gets a 503.                                        */
+/* @param err  0 if connected, else why not.                        */
+/*******************************************************************/
+void connect_done(pool *p, fsm* state, int err)
+{
+    state->connecting = false;
+    timer_del(p, state);
+
+    if (err != 0)
+    {
+        fprintf(stderr, "Connect %s: %s\n", state->serv_ip, strerror(err));
+        fail_client(p, state, 503);
+        return;
+    }
+
+    /* The readiness backends flush and start reading once this event
+       has been handled */
+    if (p->loop.backend != EV_URING)
+        return;
+
+    switch (outq_flush(&state->serv_out, state->servfd))
+    {
+    case -1:
+        rm_client(p, state);
+        return;
+    case 1:
+        uring_poll_out(p, &state->serv_ev);
+        break;
+    }
+
+    uring_watch(p, &state->serv_ev);
+}
+
+/* @brief Monotonic time in milliseconds. */
+long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*****************************************************************/
+/* @brief Arms a client's timer to fire in ms milliseconds,      */
+/*        replacing any pending one. Timers are checked at every */
+/*        TICK_MS, which bounds how late one fires.              */
+/*****************************************************************/
+void timer_set(pool *p, fsm* state, int ms)
+{
+    state->deadline = now_ms() + ms;
+
+    if (state->tprev != NULL || p->timers == state)
+        return;
+
+    state->tprev = NULL;
+    state->tnext = p->timers;
+    if (p->timers != NULL)
+        p->timers->tprev = state;
+    p->timers = state;
+}
+
+/* @brief Disarms a client's timer, if any. */
+void timer_del(pool *p, fsm* state)
+{
+    if (state->deadline == 0)
+        return;
+
+    if (state->tprev != NULL)
+        state->tprev->tnext = state->tnext;
+    else
+        p->timers = state->tnext;
+
+    if (state->tnext != NULL)
+        state->tnext->tprev = state->tprev;
+
+    state->tprev    = NULL;
+    state->tnext    = NULL;
+    state->deadline = 0;
+}
+
+/*******************************************************/
+/* @brief Fires every timer whose deadline has passed. */
+/*******************************************************/
+void check_timers(pool *p)
+{
+    long long now;
+    fsm* state;
+    fsm* next;
+    struct dns_query* q;
+
+    now = now_ms();
+    up_sweep(&p->up, now);
+
+    /* Queries out of tries fall back */
+    while ((q = rs_expire(&p->rs, now)) != NULL)
+        resolved(p, q, INADDR_NONE);
+
+    pf_expire(&p->pf, &p->loop, now);
+    ss_expire(now);
+    sh_tick(now);
+    pr_expire(now);
+
+    if (p->timers == NULL)
+        return;
+
+    for (state = p->timers; state != NULL; state = next)
+    {
+        next = state->tnext;
+
+        if (state->deadline > now)
+            continue;
+
+        timer_del(p, state);
+
+        if (state->connecting)
+            connect_done(p, state, ETIMEDOUT);
+    }
 }
@@ -4,6 +4,7 @@
 #include <time.h>
 #include <arpa/inet.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
 #include <stdbool.h>
 #include <signal.h>
 #include <errno.h>
@@ -17,19 +18,57 @@
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "uthash.h"
+#include "event.h"
+#include "uring.h"
+#include "outq.h"
+#include "upstream.h"
+#include "resolver.h"
+#include "fcache.h"
+#include "dcache.h"
+#include "prefetch.h"
+#include "manifest.h"
+#include "est.h"
+#include "session.h"
+#include "share.h"
+#include "prior.h"
+#include "scan.h"
+#include "bufpool.h"
 
 #define BUF_SIZE  8192
+#define REQ_BUF_MAX (64 * 1024)  // Most unserved request bytes a client may have
 #define LOG_SIZE  1024
-#define FREE_SIZE 40
+#define VIDEO_HOST "video.cs.cmu.edu"  // Name the video server is found by
+#define RESP_HDR_SIZE 2048  // Longest response header block framed
+#define FRAME_REQS    16    // Requests in flight framing keeps track of
+#define HDR_MAX   32    // Request headers that can be looked up by name
+
+#define UR_RELAY_HIGH 32  // Relay buffers queued before a server is paused
+#define SPLICE_SIZE   65536  // Bytes moved per splice(), one pipe's worth
+
+#define OUTQ_HIGH (256 * 1024)  // Queued bytes that stop reading the other side
+#define OUTQ_LOW  (64 * 1024)   // ...and that let it resume
+
+#define TICK_MS         100   // Timer granularity of the event loop
+#define CONNECT_TIMEOUT 3000  // Default ms to wait for a server connect
 
 #define NOLIST    1
 #define REGF4M    2
 #define VIDEO     3
 
+/* A received buffer queued for relaying to a client under io_uring */
+struct relay {
+  char* buf;
+  int   len;
+  int   bid;   // Provided buffer to recycle once the send completes, or
+               // -1 for a copy of the proxy's own output, freed instead
+};
+
 struct serv_rep {
-  char response[BUF_SIZE]; // arr of chars containing response from server.
+  char* response; // a manifest's headers as they come in; pooled, NULL
+                  // while no manifest is being fetched
 
   char* status;
   char* headers;
@@ -40,19 +79,55 @@ struct serv_rep {
   int end_idx; // used to mark end of data in response buffer
   int body_idx; // used to mark end of data in body buffer
 
+  int hdr_len;   // Header bytes, blank line included, once all are in
+  int line_at;   // Start of the line parse_headers_serv is on
+  int scan_at;   // Where its search for the line's end resumes
+  int length_at; // Where the Content-Length value is, 0 if not seen
+
   int expecting; // What is the server sending me?
 };
 
-typedef struct state {
-  char request[BUF_SIZE]; // arr of chars containing the text of the request.
-  char response[BUF_SIZE]; // arr of chars containing response to client.
+/* Bytes [off, off + len) of the request a client's buffer is on */
+struct span {
+  int off;
+  int len;
+};
 
-  char* method; // index into method
-  char* uri;    // index into uri
-  char* version; // you get the idea
-  char* header;  // index into the headers
+/* One request header line, "name: value" */
+struct http_hdr {
+  struct span name;
+  struct span value;  // Without surrounding whitespace
+};
+
+/* A request sent to a client's server, as it was when sent: by the */
+/* time its response comes in the client may have pipelined others  */
+struct sent_req {
+  char chunk[FC_KEY_LEN];  // The fragment it is for, "" if none
+  struct timespec start;   // When it went out
+};
 
-  char* body;  // alloc memory for body to send
+typedef struct state {
+  char* request; // text of the requests, NULL until the first bytes come in
+  int req_size;  // bytes request[] has room for; it grows as requests do
+  int req_at;    // where in request[] the request being parsed starts
+  char* response; // request line for the server, or an error for the
+                  // client; pooled, NULL between requests
+
+  /* The request at req_at, once parse_request has it; spans and the */
+  /* cursors below count from req_at, so moving it moves nothing else */
+  int req_len;           // Request line to blank line; 0 until parsed
+  struct span method;
+  struct span uri;
+  struct span version;
+  struct span header;    // Header lines, blank line included
+  struct http_hdr hdrs[HDR_MAX];
+  int nhdrs;
+  int line_at;           // Start of the line parse_request is on
+  int scan_at;           // Where its search for the line's end resumes
+  int req_err;           // What was wrong with the request line, if
+                         // anything; told once the request is all in
+
+  char* body;  // into request[], the body to send
   ssize_t body_size; // size of body to send
 
   int end_idx; // used to mark end of data in buffer
@@ -62,46 +137,111 @@ typedef struct state {
   char  serv_ip[INET_ADDRSTRLEN];   // Store the IP in string form
 
   int servfd;      // File descriptor of server sock for this client.
+  bool connecting; // servfd's connect is still in progress.
+  struct sockaddr_in serv_addr; // Where servfd connects to.
+
+  /* Framing of the responses relayed from the server, so that servfd */
+  /* can be pooled once every request sent on it has been answered.   */
+  int  inflight;              // Requests sent but not fully answered.
+  bool framing;               // Response boundaries are still known.
+  bool reusable;              // The server will keep servfd open.
+  long long resp_left;        // Body bytes of this response still due.
+  int  resp_hdr_len;          // Header bytes of the next response so far.
+  char* resp_hdr;             // Pooled while they are coming in.
+  long long frag_len;         // Body length of the fragment response being
+                              // relayed, sampled once it is all in; 0 if
+                              // none is.
+  struct timespec first_byte; // When the response's first byte came in.
+  struct sent_req sent[FRAME_REQS]; // Requests not yet answered, oldest
+  int  sent_head, sent_n;           // at sent[sent_head]
+
+  /* A fragment missed in the cache, stored as the server sends it */
+  struct fc_entry* fill;      // Being stored, NULL if none.
+  bool fill_next;             // Store the next response under fill_key.
+  char fill_key[FC_KEY_LEN];
   struct serv_rep* servst; // Keep state of the server of this client.
 
   struct timespec start; // Time of receiving complete chunk request.
   struct timespec end;   // Time of receiving complete chunk data.
 
-  unsigned long long avg_tput;        // Average tput using EW2MA.
+  unsigned long long avg_tput;        // Estimated tput (Kbps), from est.
+  struct est est;
   unsigned long long current_best;
+  struct video* video;        // The video it is watching, once known
+  in_addr_t cli_ip;           // Its session is for this address
+  char sess_path[MF_PATH_LEN];// and this video, "" until it has one
+  struct sh_group* group;     // Clients of its origin, once it has had
+                              // a fragment from it
+  char mf_path[MF_PATH_LEN];  // Directory and URI of the manifest last
+  char mf_uri[MF_PATH_LEN];   // asked for
   char lastchunk[300];
-
-  char* freebuf[FREE_SIZE];   // Hold ptrs to any buffer that needs freeing
+  int  segno;                 // Of the fragment lastchunk names
+  int  fragno;
+  int  bitrate;
+  long long buffer;           // ms of video its player is taken to hold,
+  long long buf_at;           // as of this ms
+
+  int clientfd;               // File descriptor of the client itself.
+  struct ev_handle cli_ev;    // Event handle for clientfd.
+  struct ev_handle serv_ev;   // Event handle for servfd.
+  int pipefd[2];              // Splice relay pipe, -1 until first used.
+
+  struct outq cli_out;        // Bytes waiting to be written to the client.
+  struct outq serv_out;       // Bytes waiting to be written to the server.
+  bool draining;              // Server gone; close once cli_out is sent.
+  bool paused;                // Not reading the server until the client
+                              // has caught up.
+
+  bool closed;                // Removed; freed once the current batch is done.
+  struct state* next;         // Link in the DNS wait queue or the graveyard.
+
+  long long deadline;         // When the pending timer fires (ms), 0 if none.
+  struct state* tprev;        // Links in the pool's timer list.
+  struct state* tnext;
+
+  /* io_uring backend only */
+  int  uring_ops;             // Requests in flight that point at this fsm.
+  struct relay* sendq;        // [head, sent) in flight, [sent, tail) unsent.
+  int  sendq_head, sendq_sent, sendq_tail, sendq_cap;
+  unsigned starved;           // Handles whose recv ran out of buffers.
+  struct state* starve_next;  // Link in the pool's starved list.
 } fsm;
 
 typedef struct pool {
-  int maxfd;         /* Largest descriptor in the master set */
-
-  fd_set masterfds;  /* Set containing all active descriptors */
-  fd_set readfds;    /* Subset of descriptors ready for reading */
-  fd_set writefds;   /* Subset of descriptors ready for writing */
+  struct evloop loop;        /* Readiness backend (select or epoll) */
+  struct ev_ready ready[EV_MAX_READY]; /* Handles reported ready */
+  int nready;                /* Number of ready handles from ev_wait */
+  bool splice;               /* Relay bodies with splice() */
+  bool cache;                /* Serve fragments from the fragment cache */
 
-  int nready;        /* Number of ready descriptors from select */
-  int maxi;          /* Max index of clientfd array             */
+  struct ev_handle listen_ev; /* Handle for the listening socket */
+  struct ev_handle dns_ev;    /* Handle for the DNS socket */
 
-  int clientfd[FD_SETSIZE];    /* Array of sockets for each client */
-  fsm*  states[FD_SETSIZE];    /* Array of states for each client */
-  bool dns[FD_SETSIZE];        /* Array of bools indicating whether
-                                  this client is expecting a dns response
-                                  from the server. */
+  int nclients;              /* Number of connected clients */
 
-  char* freebuf[FREE_SIZE];   // Hold ptrs to any buffer that needs freeing */
+  struct resolver rs;        /* DNS queries waiting for a reply */
 
+  fsm* graveyard;            /* Clients removed during this batch of events */
+  fsm* timers;               /* Clients with a deadline pending */
 
+  struct upstreams up;       /* Idle keep-alive server connections */
+  struct prefetcher pf;      /* Fragments being fetched ahead of clients */
 
+  struct uring ring;         /* io_uring backend: the ring, */
+  int ring_bid;              /* buffer being handled,       */
+  fsm* starved;              /* clients waiting for buffers */
 } pool;
 
-struct bitrate {
-  int bitrate;
-  UT_hash_handle hh;
-};
+/* One worker thread. Each has its own listening socket, pool and DNS */
+/* socket, so workers share nothing but the video registry and caches. */
+typedef struct shard {
+  int       id;
+  int       cpu;      // CPU the worker is pinned to, -1 if not pinned
+  pthread_t tid;
+  pool*     pool;
+} shard;
 
-void rm_client(int client_fd, pool* p, int i);
+void rm_client(pool* p, fsm* state);
 void rm_cgi(int cgi_fd, pool* p, char* logmsg, int i);
 void client_error(fsm* state, int error);
 void cleanup(int sig);
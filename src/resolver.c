@@ -0,0 +1,272 @@
+/*********************************************************************/
+/* @file resolver.c                                                  */
+/*                                                                   */
+/* @brief Asynchronous lookups for the proxy. Every query in flight  */
+/*        is kept by its DNS message ID, so a reply reaches the      */
+/*        clients that asked for it whatever order replies come back */
+/*        in, and replies nobody is waiting for are dropped. A query */
+/*        is sent again every timeout_ms until it has been sent      */
+/*        DNS_TRIES times, and is then handed back as expired.       */
+/*                                                                   */
+/*        Answers are cached for their TTL, so only the first client */
+/*        for a name in each TTL window waits for a round trip;      */
+/*        clients asking while that query is out share it.           */
+/*********************************************************************/
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mydns.h"
+#include "resolver.h"
+
+void rs_init(struct resolver* r, int sock, const char* ip, int port,
+             int timeout_ms)
+{
+  memset(r, 0, sizeof(struct resolver));
+  r->sock       = sock;
+  r->timeout_ms = timeout_ms;
+  r->seed       = time(NULL) ^ getpid() ^ (uintptr_t) r;
+
+  r->server.sin_family      = AF_INET;
+  r->server.sin_port        = htons(port);
+  r->server.sin_addr.s_addr = inet_addr(ip);
+}
+
+static void rs_send(struct resolver* r, struct dns_query* q)
+{
+  byte_buf*  qname = gen_QNAME(q->name, strlen(q->name));
+  question** query = calloc(1, sizeof(question*));
+  byte_buf*  msg;
+
+  query[0] = gen_question(qname->buf, strlen((char *) qname->buf) + 1);
+  msg      = gen_message(q->id, 0, 0, 0, 0, 0, 0, 0, 1, 0, query, NULL);
+
+  /* A send that fails is retried like a lost query */
+  sendto(r->sock, msg->buf, msg->pos, MSG_DONTWAIT,
+         (struct sockaddr *) &r->server, sizeof(r->server));
+
+  q->tries++;
+
+  delete_bytebuf(msg);
+  delete_bytebuf(qname);
+}
+
+/* Queues q last in deadline order */
+static void rs_link(struct resolver* r, struct dns_query* q)
+{
+  q->prev = r->tail;
+  q->next = NULL;
+
+  if(r->tail == NULL)
+    r->head = q;
+  else
+    r->tail->next = q;
+  r->tail = q;
+}
+
+static void rs_unlink(struct resolver* r, struct dns_query* q)
+{
+  if(q->prev == NULL)
+    r->head = q->next;
+  else
+    q->prev->next = q->next;
+
+  if(q->next == NULL)
+    r->tail = q->prev;
+  else
+    q->next->prev = q->prev;
+
+  q->prev = NULL;
+  q->next = NULL;
+}
+
+/* Takes q out of the table; the caller owns it from then on */
+static void rs_remove(struct resolver* r, struct dns_query* q)
+{
+  rs_unlink(r, q);
+  HASH_DEL(r->byid, q);
+  HASH_DELETE(hn, r->byname, q);
+  r->npending--;
+}
+
+/* Keeps an answer for ttl seconds. Expired answers make room when */
+/* the cache is full; failing that, the answer is not kept.        */
+static void rs_store(struct resolver* r, char* name, in_addr_t ip, int ttl,
+                     long long now)
+{
+  struct dns_cached* c;
+  struct dns_cached* tmp;
+
+  HASH_FIND_STR(r->cache, name, c);
+
+  if(c == NULL && r->ncached >= DNS_CACHE_MAX)
+    HASH_ITER(hh, r->cache, c, tmp)
+      {
+        if(c->expires <= now)
+          {
+            HASH_DEL(r->cache, c);
+            free(c);
+            r->ncached--;
+          }
+      }
+
+  if(c == NULL)
+    {
+      if(r->ncached >= DNS_CACHE_MAX ||
+         (c = calloc(1, sizeof(struct dns_cached))) == NULL)
+        return;
+
+      strcpy(c->name, name);
+      HASH_ADD_STR(r->cache, name, c);
+      r->ncached++;
+    }
+
+  c->ip      = ip;
+  c->expires = now + ttl * 1000LL;
+}
+
+/*******************************************************************/
+/* @brief Looks name up in the cache.                              */
+/* @returns true with ip set if an answer is still fresh.          */
+/*******************************************************************/
+bool rs_lookup(struct resolver* r, char* name, long long now, in_addr_t* ip)
+{
+  struct dns_cached* c;
+
+  HASH_FIND_STR(r->cache, name, c);
+  if(c == NULL)
+    return false;
+
+  if(c->expires <= now)
+    {
+      HASH_DEL(r->cache, c);
+      free(c);
+      r->ncached--;
+      return false;
+    }
+
+  *ip = c->ip;
+  return true;
+}
+
+/*******************************************************************/
+/* @brief Sends a query for name under an ID no other pending      */
+/*        query has, unless one for name is already out.           */
+/* @returns the pending query, NULL if none could be made.         */
+/*******************************************************************/
+struct dns_query* rs_query(struct resolver* r, char* name, long long now)
+{
+  struct dns_query* q;
+  struct dns_query* dup;
+  int id;
+
+  HASH_FIND(hn, r->byname, name, strlen(name), q);
+  if(q != NULL)
+    return q;
+
+  if(r->npending > 0xffff || strlen(name) >= DNS_NAME_LEN ||
+     (q = calloc(1, sizeof(struct dns_query))) == NULL)
+    return NULL;
+
+  do
+    {
+      id = rand_r(&r->seed) & 0xffff;
+      HASH_FIND_INT(r->byid, &id, dup);
+    }
+  while(dup != NULL);
+
+  q->id       = id;
+  q->deadline = now + r->timeout_ms;
+  strcpy(q->name, name);
+
+  HASH_ADD_INT(r->byid, id, q);
+  HASH_ADD(hn, r->byname, name, strlen(q->name), q);
+  rs_link(r, q);
+  r->npending++;
+
+  rs_send(r, q);
+  return q;
+}
+
+/*******************************************************************/
+/* @brief Matches a datagram from the DNS server to its query,     */
+/*        caching the answer for its TTL.                          */
+/* @param ip  Set to the answer, INADDR_NONE if there is none.     */
+/* @returns the query, taken out of the table, or NULL if the      */
+/*          datagram answers nothing pending.                      */
+/*******************************************************************/
+struct dns_query* rs_reply(struct resolver* r, uint8_t* buf, ssize_t n,
+                           long long now, in_addr_t* ip)
+{
+  struct dns_query* q;
+  dns_message*      msg;
+  int               id, ttl;
+
+  /* Shorter than a header */
+  if(n < 12)
+    return NULL;
+
+  id = (buf[0] << 8) | buf[1];
+  HASH_FIND_INT(r->byid, &id, q);
+  if(q == NULL)
+    return NULL;
+
+  msg = parse_message(buf);
+
+  /* The ID alone could be a stale reply to an older query */
+  if(!msg->QR || msg->questions == NULL ||
+     strcmp((char *) msg->questions[0]->NAME, q->name))
+    {
+      free_dns(msg);
+      return NULL;
+    }
+
+  if(msg->RCODE == 0 && msg->answers != NULL)
+    {
+      *ip = (in_addr_t) binary2int(msg->answers[0]->RDATA, 4);
+      ttl = binary2int(msg->answers[0]->TTL, 2);
+
+      if(ttl > 0)
+        rs_store(r, q->name, *ip, ttl, now);
+    }
+  else
+    *ip = INADDR_NONE;
+
+  free_dns(msg);
+  rs_remove(r, q);
+  return q;
+}
+
+/*******************************************************************/
+/* @brief Sends every query whose deadline has passed again, until */
+/*        one runs out of tries.                                   */
+/* @returns a query that has been sent DNS_TRIES times without a   */
+/*          reply, taken out of the table; NULL once none is due.  */
+/*          Call until NULL.                                       */
+/*******************************************************************/
+struct dns_query* rs_expire(struct resolver* r, long long now)
+{
+  struct dns_query* q;
+
+  while((q = r->head) != NULL && q->deadline <= now)
+    {
+      if(q->tries >= DNS_TRIES)
+        {
+          rs_remove(r, q);
+          return q;
+        }
+
+      rs_send(r, q);
+      q->deadline = now + r->timeout_ms;
+
+      rs_unlink(r, q);
+      rs_link(r, q);
+    }
+
+  return NULL;
+}
@@ -0,0 +1,70 @@
+/*********************************************************************/
+/* @file resolver.h                                                  */
+/*                                                                   */
+/* @brief Interfaces for resolver.c, the proxy's table of DNS        */
+/*        queries waiting for a reply and cache of answers.          */
+/*********************************************************************/
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "uthash.h"
+
+#define DNS_TIMEOUT   500   // Default ms before a query is sent again
+#define DNS_TRIES     4     // Sends before a query is given up on
+#define DNS_NAME_LEN  256
+#define DNS_CACHE_MAX 256   // Names whose answers are kept
+
+struct state;
+
+/* One query in flight. The proxy links the clients waiting on it */
+/* through their fsm; clients asking for the same name meanwhile   */
+/* wait on it too.                                                 */
+struct dns_query {
+  int id;                    // Key; the ID of the DNS message
+  char name[DNS_NAME_LEN];
+  int tries;                 // Times it has been sent
+  long long deadline;        // When it is sent again or given up on
+  struct state* waiters;
+  struct dns_query* prev;    // Pending queries, earliest deadline first
+  struct dns_query* next;
+  UT_hash_handle hh;
+  UT_hash_handle hn;         // In the hash by name
+};
+
+/* An answer, kept for as long as its TTL allows */
+struct dns_cached {
+  char name[DNS_NAME_LEN];   // Key
+  in_addr_t ip;
+  long long expires;         // ms
+  UT_hash_handle hh;
+};
+
+struct resolver {
+  int sock;
+  struct sockaddr_in server;
+  struct dns_query* byid;    // Hash of pending queries by ID
+  struct dns_query* byname;  // and by name
+  struct dns_query* head;    // Deadline order; every try waits as long,
+  struct dns_query* tail;    // so appending keeps it sorted
+  int npending;
+  struct dns_cached* cache;  // Hash of answers by name
+  int ncached;
+  int timeout_ms;
+  unsigned int seed;         // For IDs a spoofed reply cannot guess
+};
+
+void rs_init(struct resolver* r, int sock, const char* ip, int port,
+             int timeout_ms);
+bool rs_lookup(struct resolver* r, char* name, long long now,
+               in_addr_t* ip);
+struct dns_query* rs_query (struct resolver* r, char* name, long long now);
+struct dns_query* rs_reply (struct resolver* r, uint8_t* buf, ssize_t n,
+                            long long now, in_addr_t* ip);
+struct dns_query* rs_expire(struct resolver* r, long long now);
+
+#endif
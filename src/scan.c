@@ -0,0 +1,494 @@
+/*********************************************************************/
+/* @file scan.c                                                      */
+/*                                                                   */
+/* @brief Byte-scanning kernels: finding a delimiter in a buffer,    */
+/*        comparing names without regard to case, and the header    */
+/*        and attribute lookups built on them. Each kernel has a    */
+/*        scalar version and, on x86-64, SSE2 and AVX2 ones; which  */
+/*        are used is settled once, by scan_init, from what the CPU */
+/*        supports.                                                 */
+/*                                                                   */
+/*        The SIMD finds test the needle's first and last bytes at  */
+/*        16 or 32 positions a step and only compare the rest where */
+/*        both match, which for delimiters like CRLF CRLF skips     */
+/*        almost every position the scalar memchr stops at.         */
+/*********************************************************************/
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "scan.h"
+
+static const char* find_scalar(const char* hay, size_t hlen,
+                               const char* needle, size_t nlen);
+static const char* ifind_scalar(const char* hay, size_t hlen,
+                                const char* needle, size_t nlen);
+static bool        ieq_scalar (const char* a, const char* b, size_t n);
+
+static const char* (*find_fn)(const char*, size_t, const char*, size_t) =
+  find_scalar;
+static const char* (*ifind_fn)(const char*, size_t, const char*, size_t) =
+  ifind_scalar;
+static bool (*ieq_fn)(const char*, const char*, size_t) = ieq_scalar;
+static int level_in_use = SCAN_SCALAR;
+
+/* ASCII only; header names and attributes are */
+static inline char lower(char c)
+{
+  return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/* First occurrence of needle (nlen >= 2) in hay, a byte at a time */
+static const char* find_scalar(const char* hay, size_t hlen,
+                               const char* needle, size_t nlen)
+{
+  const char* p = hay;
+  const char* end;
+
+  if(hlen < nlen)
+    return NULL;
+
+  end = hay + hlen - nlen + 1;
+  while(p < end && (p = memchr(p, needle[0], end - p)) != NULL)
+    {
+      if(p[nlen - 1] == needle[nlen - 1] &&
+         !memcmp(p + 1, needle + 1, nlen - 2))
+        return p;
+      p++;
+    }
+
+  return NULL;
+}
+
+/* As find_scalar, but for a lower case needle in hay of any case */
+static const char* ifind_scalar(const char* hay, size_t hlen,
+                                const char* needle, size_t nlen)
+{
+  const char* p;
+  const char* end;
+
+  if(hlen < nlen)
+    return NULL;
+
+  end = hay + hlen - nlen + 1;
+  for(p = hay; p < end; p++)
+    if(lower(*p) == needle[0] && lower(p[nlen - 1]) == needle[nlen - 1] &&
+       ieq_scalar(p + 1, needle + 1, nlen - 2))
+      return p;
+
+  return NULL;
+}
+
+static bool ieq_scalar(const char* a, const char* b, size_t n)
+{
+  size_t i;
+
+  for(i = 0; i < n; i++)
+    if(lower(a[i]) != lower(b[i]))
+      return false;
+
+  return true;
+}
+
+/* Whether the '=' at eq ends a whole attribute name (nlen bytes, */
+/* the '=' included) of markup starting at p                      */
+static inline bool attr_at(const char* p, const char* eq, const char* name,
+                           size_t nlen)
+{
+  const char* a = eq - (nlen - 1);
+
+  return *a == *name && !memcmp(a + 1, name + 1, nlen - 2) &&
+         (a == p || a[-1] == ' ' || a[-1] == '\t' || a[-1] == '\r' ||
+          a[-1] == '\n');
+}
+
+/* The '=' of the first attribute name in [p, end), looking from  */
+/* from (>= p + nlen - 1) on; markup has far fewer '=' than bytes */
+/* that start a name, so it goes from one '=' to the next. It has */
+/* no SIMD versions: libc's memchr is vectorized already, and the */
+/* SSE2 and AVX2 loops written for it were slower.                */
+static const char* attr_find(const char* p, const char* from,
+                             const char* end, const char* name,
+                             size_t nlen)
+{
+  for(; from < end && (from = memchr(from, '=', end - from)) != NULL; from++)
+    if(attr_at(p, from, name, nlen))
+      return from;
+
+  return NULL;
+}
+
+#if defined(__x86_64__)
+
+/* SSE2 is part of x86-64, so these need no target of their own */
+
+static const char* find_sse2(const char* hay, size_t hlen,
+                             const char* needle, size_t nlen)
+{
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last  = _mm_set1_epi8(needle[nlen - 1]);
+  __m128i a, b;
+  unsigned mask;
+  size_t i;
+
+  for(i = 0; i + nlen - 1 + 16 <= hlen; i += 16)
+    {
+      a = _mm_loadu_si128((const __m128i*) (hay + i));
+      b = _mm_loadu_si128((const __m128i*) (hay + i + nlen - 1));
+      mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                             _mm_cmpeq_epi8(b, last)));
+
+      for(; mask != 0; mask &= mask - 1)
+        if(!memcmp(hay + i + __builtin_ctz(mask) + 1, needle + 1, nlen - 2))
+          return hay + i + __builtin_ctz(mask);
+    }
+
+  return i + nlen <= hlen ? find_scalar(hay + i, hlen - i, needle, nlen)
+                          : NULL;
+}
+
+/* Upper case letters of x to lower case */
+static inline __m128i fold_sse2(__m128i x)
+{
+  __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('A' - 1)),
+                                _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), x));
+
+  return _mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+static bool ieq_sse2(const char* a, const char* b, size_t n)
+{
+  __m128i x, y;
+  size_t i;
+
+  for(i = 0; i + 16 <= n; i += 16)
+    {
+      x = fold_sse2(_mm_loadu_si128((const __m128i*) (a + i)));
+      y = fold_sse2(_mm_loadu_si128((const __m128i*) (b + i)));
+
+      if(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xffff)
+        return false;
+    }
+
+  return ieq_scalar(a + i, b + i, n - i);
+}
+
+/* Matches of the lower case byte c in x, in either case */
+static inline __m128i ieq_byte_sse2(__m128i x, char c)
+{
+  return _mm_cmpeq_epi8(fold_sse2(x), _mm_set1_epi8(c));
+}
+
+static const char* ifind_sse2(const char* hay, size_t hlen,
+                              const char* needle, size_t nlen)
+{
+  __m128i a, b;
+  unsigned mask;
+  size_t i;
+
+  for(i = 0; i + nlen - 1 + 16 <= hlen; i += 16)
+    {
+      a = _mm_loadu_si128((const __m128i*) (hay + i));
+      b = _mm_loadu_si128((const __m128i*) (hay + i + nlen - 1));
+      mask = _mm_movemask_epi8(_mm_and_si128(
+               ieq_byte_sse2(a, needle[0]),
+               ieq_byte_sse2(b, needle[nlen - 1])));
+
+      for(; mask != 0; mask &= mask - 1)
+        if(ieq_sse2(hay + i + __builtin_ctz(mask) + 1, needle + 1, nlen - 2))
+          return hay + i + __builtin_ctz(mask);
+    }
+
+  return i + nlen <= hlen ? ifind_scalar(hay + i, hlen - i, needle, nlen)
+                          : NULL;
+}
+
+/* Positions of the 32 at p where both the first and last bytes match */
+__attribute__((target("avx2")))
+static inline __m256i candidates_avx2(const char* p, size_t nlen,
+                                      __m256i first, __m256i last)
+{
+  __m256i a = _mm256_loadu_si256((const __m256i*) p);
+  __m256i b = _mm256_loadu_si256((const __m256i*) (p + nlen - 1));
+
+  return _mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                          _mm256_cmpeq_epi8(b, last));
+}
+
+__attribute__((target("avx2")))
+static const char* find_avx2(const char* hay, size_t hlen,
+                             const char* needle, size_t nlen)
+{
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last  = _mm256_set1_epi8(needle[nlen - 1]);
+  __m256i lo, hi;
+  uint64_t mask;
+  size_t i;
+
+  /* Two blocks a step, so that the test for a candidate is one branch */
+  for(i = 0; i + nlen - 1 + 64 <= hlen; i += 64)
+    {
+      lo = candidates_avx2(hay + i, nlen, first, last);
+      hi = candidates_avx2(hay + i + 32, nlen, first, last);
+
+      if(_mm256_testz_si256(_mm256_or_si256(lo, hi),
+                            _mm256_or_si256(lo, hi)))
+        continue;
+
+      mask = (uint32_t) _mm256_movemask_epi8(lo) |
+             (uint64_t) (uint32_t) _mm256_movemask_epi8(hi) << 32;
+
+      for(; mask != 0; mask &= mask - 1)
+        if(!memcmp(hay + i + __builtin_ctzll(mask) + 1, needle + 1, nlen - 2))
+          return hay + i + __builtin_ctzll(mask);
+    }
+
+  return i + nlen <= hlen ? find_scalar(hay + i, hlen - i, needle, nlen)
+                          : NULL;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i fold_avx2(__m256i x)
+{
+  __m256i upper = _mm256_and_si256(
+                    _mm256_cmpgt_epi8(x, _mm256_set1_epi8('A' - 1)),
+                    _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), x));
+
+  return _mm256_or_si256(x, _mm256_and_si256(upper,
+                                             _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2")))
+static bool ieq_avx2(const char* a, const char* b, size_t n)
+{
+  __m256i x, y;
+  size_t i;
+
+  for(i = 0; i + 32 <= n; i += 32)
+    {
+      x = fold_avx2(_mm256_loadu_si256((const __m256i*) (a + i)));
+      y = fold_avx2(_mm256_loadu_si256((const __m256i*) (b + i)));
+
+      if((unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) !=
+         0xffffffffu)
+        return false;
+    }
+
+  return ieq_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i ieq_byte_avx2(__m256i x, char c)
+{
+  return _mm256_cmpeq_epi8(fold_avx2(x), _mm256_set1_epi8(c));
+}
+
+__attribute__((target("avx2")))
+static const char* ifind_avx2(const char* hay, size_t hlen,
+                              const char* needle, size_t nlen)
+{
+  __m256i a, b;
+  unsigned mask;
+  size_t i;
+
+  for(i = 0; i + nlen - 1 + 32 <= hlen; i += 32)
+    {
+      a = _mm256_loadu_si256((const __m256i*) (hay + i));
+      b = _mm256_loadu_si256((const __m256i*) (hay + i + nlen - 1));
+      mask = _mm256_movemask_epi8(_mm256_and_si256(
+               ieq_byte_avx2(a, needle[0]),
+               ieq_byte_avx2(b, needle[nlen - 1])));
+
+      for(; mask != 0; mask &= mask - 1)
+        if(ieq_avx2(hay + i + __builtin_ctz(mask) + 1, needle + 1, nlen - 2))
+          return hay + i + __builtin_ctz(mask);
+    }
+
+  return i + nlen <= hlen ? ifind_scalar(hay + i, hlen - i, needle, nlen)
+                          : NULL;
+}
+
+#endif
+
+/*******************************************************************/
+/* @brief Picks the kernels used from here on: those of level, or  */
+/*        of the widest level below it the CPU has. Call before    */
+/*        any thread scans.                                        */
+/* @returns the level picked.                                      */
+/*******************************************************************/
+int scan_init(int level)
+{
+  int have = SCAN_SCALAR;
+
+#if defined(__x86_64__)
+  have = SCAN_SSE2;
+
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2"))
+    have = SCAN_AVX2;
+#endif
+
+  if(level > have)
+    level = have;
+
+  find_fn  = find_scalar;
+  ifind_fn = ifind_scalar;
+  ieq_fn   = ieq_scalar;
+
+#if defined(__x86_64__)
+  if(level == SCAN_SSE2)
+    {
+      find_fn  = find_sse2;
+      ifind_fn = ifind_sse2;
+      ieq_fn   = ieq_sse2;
+    }
+  else if(level == SCAN_AVX2)
+    {
+      find_fn  = find_avx2;
+      ifind_fn = ifind_avx2;
+      ieq_fn   = ieq_avx2;
+    }
+#endif
+
+  return level_in_use = level;
+}
+
+/* @returns the name of the kernels in use. */
+const char* scan_level(void)
+{
+  static const char* names[] = { "scalar", "sse2", "avx2" };
+
+  return names[level_in_use];
+}
+
+/* @returns the first occurrence of needle in hay, NULL if none. */
+const char* scan_find(const char* hay, size_t hlen,
+                      const char* needle, size_t nlen)
+{
+  if(nlen == 0 || nlen > hlen)
+    return NULL;
+
+  if(nlen == 1)
+    return memchr(hay, needle[0], hlen);
+
+  return find_fn(hay, hlen, needle, nlen);
+}
+
+/* @returns the first CRLF in [p, end), NULL if there is none. */
+const char* scan_crlf(const char* p, const char* end)
+{
+  return p < end ? scan_find(p, end - p, "\r\n", 2) : NULL;
+}
+
+/* @returns whether the n bytes at a and b match, ignoring case. */
+bool scan_ieq(const char* a, const char* b, size_t n)
+{
+  return ieq_fn(a, b, n);
+}
+
+/*******************************************************************/
+/* @brief Finds the blank line ending a header block that comes in  */
+/*        piece by piece. Only the bytes added since the last look, */
+/*        and the three before them, can finish it, so only they    */
+/*        are searched.                                             */
+/* @param old  Bytes of hdrs already looked at.                     */
+/* @param len  Bytes of hdrs in all.                                */
+/* @returns the end of the blank line, NULL if it is not in yet.    */
+/*******************************************************************/
+const char* scan_blank(const char* hdrs, size_t old, size_t len)
+{
+  size_t      from = old > 3 ? old - 3 : 0;
+  const char* end  = scan_find(hdrs + from, len - from, "\r\n\r\n",
+                               strlen("\r\n\r\n"));
+
+  return end != NULL ? end + strlen("\r\n\r\n") : NULL;
+}
+
+/*******************************************************************/
+/* @brief Looks a header up by name, in any case, in len bytes of   */
+/*        header lines (the start line excluded). "name:" is       */
+/*        searched for as a whole, without regard to case, and     */
+/*        only counts at the start of a line.                      */
+/* @param vlen  Set to the length of the value, if not NULL.        */
+/* @returns the value, without surrounding whitespace; NULL if no   */
+/*          line has it.                                           */
+/*******************************************************************/
+const char* scan_hdr(const char* hdrs, size_t len, const char* name,
+                     size_t* vlen)
+{
+  const char* end  = hdrs + len;
+  size_t      nlen = strlen(name) + 1;
+  char        key[SCAN_NAME_MAX + 1];
+  const char* p;
+  const char* v;
+  const char* eol;
+  size_t i;
+
+  if(nlen > SCAN_NAME_MAX || nlen > len)
+    return NULL;
+
+  for(i = 0; i < nlen - 1; i++)
+    key[i] = lower(name[i]);
+  key[i] = ':';
+
+  /* The kernels want at least a needle's worth of bytes */
+  for(p = hdrs; end - p >= (ptrdiff_t) nlen &&
+                (p = ifind_fn(p, end - p, key, nlen)) != NULL; p += nlen)
+    {
+      if(p != hdrs && p[-1] != '\n')
+        continue;
+
+      if((eol = scan_crlf(p + nlen, end)) == NULL)
+        eol = end;
+
+      for(v = p + nlen; v < eol && (*v == ' ' || *v == '\t'); v++);
+      for(; eol > v && (eol[-1] == ' ' || eol[-1] == '\t'); eol--);
+
+      if(vlen != NULL)
+        *vlen = eol - v;
+      return v;
+    }
+
+  return NULL;
+}
+
+/*******************************************************************/
+/* @brief Finds the first attribute called name (given with its '=',*/
+/*        as in "bitrate=") in len bytes of markup. Only whole      */
+/*        names count: "maxbitrate=" is not "bitrate=".             */
+/* @param vlen  Set to the length of the value, if not NULL.        */
+/* @returns the value, quotes excluded; NULL if there is none.      */
+/*******************************************************************/
+const char* scan_attr(const char* p, size_t len, const char* name,
+                      size_t* vlen)
+{
+  const char* end  = p + len;
+  size_t      nlen = strlen(name);
+  const char* v;
+  const char* to;
+  char        quote;
+
+  if(nlen < 2 || nlen > len ||
+     (v = attr_find(p, p + nlen - 1, end, name, nlen)) == NULL)
+    return NULL;
+
+  if(++v < end && (*v == '"' || *v == '\''))
+    {
+      quote = *v++;
+      to    = memchr(v, quote, end - v);
+    }
+  else
+    for(to = v; to < end && *to != ' ' && *to != '>' && *to != '/' &&
+                *to != '\t' && *to != '\r' && *to != '\n'; to++);
+
+  if(to == NULL)
+    to = end;
+
+  if(vlen != NULL)
+    *vlen = to - v;
+  return v;
+}
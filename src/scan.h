@@ -0,0 +1,34 @@
+/*********************************************************************/
+/* @file scan.h                                                      */
+/*                                                                   */
+/* @brief Interfaces for scan.c, the byte-scanning kernels the       */
+/*        request, response and manifest parsers are built on.       */
+/*********************************************************************/
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Kernel sets, each a superset of the one before */
+#define SCAN_SCALAR 0
+#define SCAN_SSE2   1   // 16 bytes a step
+#define SCAN_AVX2   2   // 32 bytes a step
+#define SCAN_AUTO   3   // The widest the CPU has
+
+#define SCAN_NAME_MAX 64  // Longest header name scan_hdr looks up
+
+int         scan_init (int level);
+const char* scan_level(void);
+
+const char* scan_find(const char* hay, size_t hlen,
+                      const char* needle, size_t nlen);
+const char* scan_crlf(const char* p, const char* end);
+bool        scan_ieq (const char* a, const char* b, size_t n);
+const char* scan_blank(const char* hdrs, size_t old, size_t len);
+const char* scan_hdr (const char* hdrs, size_t len, const char* name,
+                      size_t* vlen);
+const char* scan_attr(const char* p, size_t len, const char* name,
+                      size_t* vlen);
+
+#endif
@@ -0,0 +1,233 @@
+/*********************************************************************/
+/* @file scanbench.c                                                 */
+/*                                                                   */
+/* @brief Times the scanning kernels of scan.c at each level the CPU */
+/*        has against the code they replaced, on a player's request,*/
+/*        an origin's response headers and an f4m manifest of the   */
+/*        size real ones come in at (kilobytes of base64 bootstrap  */
+/*        and metadata around a handful of <media>).                */
+/*                                                                   */
+/* @usage: ./scanbench [iterations]                                  */
+/*********************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "scan.h"
+
+#define SB_F4M_SIZE 65536
+
+static const char request[] =
+  "GET /vod/1000Seg2-Frag7 HTTP/1.1\r\n"
+  "Host: video.cs.cmu.edu:8080\r\n"
+  "Connection: keep-alive\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+  "(KHTML, like Gecko) Chrome/38.0.2125.111 Safari/537.36\r\n"
+  "Accept: */*\r\n"
+  "Referer: http://video.cs.cmu.edu:8080/StrobeMediaPlayback.swf\r\n"
+  "Accept-Encoding: gzip,deflate,sdch\r\n"
+  "Accept-Language: en-US,en;q=0.8\r\n"
+  "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; player=strobe\r\n"
+  "\r\n";
+
+static const char response[] =
+  "HTTP/1.1 200 OK\r\n"
+  "Date: Tue, 04 Nov 2014 19:43:31 GMT\r\n"
+  "Server: Apache/2.2.22 (Ubuntu)\r\n"
+  "Last-Modified: Mon, 20 Oct 2014 17:01:12 GMT\r\n"
+  "ETag: \"a2c4e-1e2f3-505de9b5a4a00\"\r\n"
+  "Accept-Ranges: bytes\r\n"
+  "Keep-Alive: timeout=5, max=100\r\n"
+  "Connection: Keep-Alive\r\n"
+  "Content-Type: video/f4f\r\n"
+  "Content-Length: 123891\r\n"
+  "\r\n";
+
+static char f4m[SB_F4M_SIZE];
+static size_t f4m_len;     // As mf_register is given it
+static volatile size_t sink;
+
+/* The memmem engine.c had */
+static void* old_memmem(const void* haystack, size_t hlen,
+                        const void* needle, size_t nlen)
+{
+  int needle_first;
+  const void* p = haystack;
+  size_t plen = hlen;
+
+  if(!nlen)
+    return NULL;
+
+  needle_first = *(unsigned char*) needle;
+
+  while(plen >= nlen && (p = memchr(p, needle_first, plen - nlen + 1)))
+    {
+      if(!memcmp(p, needle, nlen))
+        return (void*) p;
+
+      p++;
+      plen = hlen - (p - haystack);
+    }
+
+  return NULL;
+}
+
+/* Base64 filler, as bootstrap and metadata are */
+static int fill_b64(char* p, int n, unsigned* seed)
+{
+  static const char b64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  int i;
+
+  for(i = 0; i < n; i++)
+    {
+      *seed = *seed * 1103515245 + 12345;
+      p[i]  = b64[(*seed >> 16) & 63];
+    }
+
+  return n;
+}
+
+static void make_f4m(void)
+{
+  static const int rates[] = { 10, 100, 500, 1000, 2000, 3500 };
+  unsigned seed = 1;
+  int n = 0, i;
+
+  n += sprintf(f4m + n,
+               "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+               "<manifest xmlns=\"http://ns.adobe.com/f4m/1.0\">\n"
+               "<id>big_buck_bunny</id>\n<streamType>recorded</streamType>\n"
+               "<duration>596.48</duration>\n"
+               "<bootstrapInfo profile=\"named\" id=\"bootstrap1\">");
+  n += fill_b64(f4m + n, 6000, &seed);
+  n += sprintf(f4m + n, "</bootstrapInfo>\n");
+
+  for(i = 0; i < (int) (sizeof(rates) / sizeof(rates[0])); i++)
+    {
+      n += sprintf(f4m + n, "<media streamId=\"big_buck_bunny\" url=\"%d\" "
+                   "bitrate=\"%d\" bootstrapInfoId=\"bootstrap1\">"
+                   "<metadata>", rates[i], rates[i]);
+      n += fill_b64(f4m + n, 1500, &seed);
+      n += sprintf(f4m + n, "</metadata></media>\n");
+    }
+
+  n += sprintf(f4m + n, "</manifest>\n");
+  f4m_len = n;
+}
+
+/* The blank line ending a request */
+static void old_request(void)
+{
+  sink += (char*) old_memmem(request, sizeof(request) - 1, "\r\n\r\n", 4) -
+          request;
+}
+
+static void new_request(void)
+{
+  sink += scan_find(request, sizeof(request) - 1, "\r\n\r\n", 4) - request;
+}
+
+/* Content-Length, as the prefetcher looked it up */
+static void old_header(void)
+{
+  sink += atoi(strcasestr(response, "\r\nContent-Length:") +
+               strlen("\r\nContent-Length:"));
+}
+
+static void new_header(void)
+{
+  const char* lines = scan_crlf(response, response + sizeof(response) - 1);
+
+  sink += atoi(scan_hdr(lines + 2, response + sizeof(response) - 1 -
+                        (lines + 2), "Content-Length", NULL));
+}
+
+/* Every bitrate, as mf_register found them */
+static void old_manifest(void)
+{
+  const char* p = f4m;
+  const char* needle;
+
+  while((needle = strstr(p, "bitrate=")) != NULL)
+    {
+      p = needle + strlen("bitrate=");
+      if(*p == '"')
+        p++;
+      sink += atoi(p);
+    }
+}
+
+static void new_manifest(void)
+{
+  const char* p   = f4m;
+  const char* end = f4m + f4m_len;
+  const char* value;
+  size_t vlen;
+
+  for(; (value = scan_attr(p, end - p, "bitrate=", &vlen)) != NULL;
+      p = value + vlen)
+    sink += atoi(value);
+}
+
+/* @returns ns per call of fn over iters calls. */
+static double time_ns(void (*fn)(void), long iters)
+{
+  struct timespec a, b;
+  long i;
+
+  clock_gettime(CLOCK_MONOTONIC, &a);
+  for(i = 0; i < iters; i++)
+    fn();
+  clock_gettime(CLOCK_MONOTONIC, &b);
+
+  return ((b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec)) / iters;
+}
+
+int main(int argc, char* argv[])
+{
+  static const struct {
+    const char* name;
+    void (*old)(void);
+    void (*new)(void);
+    int scale;           // Fewer iterations for the bigger corpora
+  } tests[] = {
+    { "request blank line", old_request,  new_request,  1   },
+    { "response header",    old_header,   new_header,   1   },
+    { "manifest bitrates",  old_manifest, new_manifest, 100 },
+  };
+  long iters = argc > 1 ? atol(argv[1]) : 2000000;
+  double base, t;
+  int i, level;
+
+  make_f4m();
+
+  printf("%-20s %10s", "", "old ns");
+  for(level = SCAN_SCALAR; level <= SCAN_AVX2; level++)
+    if(scan_init(level) == level)
+      printf(" %16s", scan_level());
+  printf("\n");
+
+  for(i = 0; i < (int) (sizeof(tests) / sizeof(tests[0])); i++)
+    {
+      base = time_ns(tests[i].old, iters / tests[i].scale);
+      printf("%-20s %10.1f", tests[i].name, base);
+
+      for(level = SCAN_SCALAR; level <= SCAN_AVX2; level++)
+        {
+          if(scan_init(level) != level)
+            continue;
+
+          t = time_ns(tests[i].new, iters / tests[i].scale);
+          printf(" %8.1f (%4.1fx)", t, base / t);
+        }
+      printf("\n");
+    }
+
+  return 0;
+}
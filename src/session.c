@@ -0,0 +1,129 @@
+/*********************************************************************/
+/* @file session.c                                                   */
+/*                                                                   */
+/* @brief Adaptation state that outlives connections. A player that  */
+/*        reconnects in the middle of a video, to any worker, picks  */
+/*        up its throughput estimate, bitrate and buffer where it    */
+/*        left off instead of starting again from the bottom. Each   */
+/*        client saves its state here after every fragment; a        */
+/*        session not saved for SS_IDLE_MS is dropped.               */
+/*                                                                   */
+/*        The table is shared by every worker under one mutex. It is */
+/*        kept in order of use, so a sweep stops at the first        */
+/*        session still live.                                        */
+/*********************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "session.h"
+
+static struct session*  sessions = NULL;
+static pthread_mutex_t  ss_lock  = PTHREAD_MUTEX_INITIALIZER;
+static long long        ss_swept;
+static unsigned int     ss_count;
+
+/* Counted over every worker */
+static unsigned long long ss_resumed;
+static unsigned long long ss_expired;
+
+/* @brief Makes the key of the session of ip for the video under path. */
+void ss_key(char* key, in_addr_t ip, const char* path)
+{
+  snprintf(key, SS_KEY_LEN, "%08x%s", (unsigned int) ip, path);
+}
+
+/*******************************************************************/
+/* @brief Looks up what the client at ip last had for the video    */
+/*        under path.                                              */
+/* @returns true if there was a session, copied into s.            */
+/*******************************************************************/
+bool ss_load(in_addr_t ip, const char* path, struct ss_state* s)
+{
+  char key[SS_KEY_LEN];
+  struct session* e;
+
+  ss_key(key, ip, path);
+
+  pthread_mutex_lock(&ss_lock);
+
+  HASH_FIND_STR(sessions, key, e);
+  if(e != NULL)
+    {
+      *s = e->s;
+      ss_resumed++;
+    }
+
+  pthread_mutex_unlock(&ss_lock);
+  return e != NULL;
+}
+
+/*******************************************************************/
+/* @brief Stores s as the session of the client at ip for the      */
+/*        video under path, making it the most recently used.      */
+/*******************************************************************/
+void ss_save(in_addr_t ip, const char* path, const struct ss_state* s,
+             long long now)
+{
+  char key[SS_KEY_LEN];
+  struct session* e;
+
+  ss_key(key, ip, path);
+
+  pthread_mutex_lock(&ss_lock);
+
+  HASH_FIND_STR(sessions, key, e);
+  if(e != NULL)
+    HASH_DEL(sessions, e);
+  else if((e = malloc(sizeof(struct session))) != NULL)
+    {
+      strcpy(e->key, key);
+      ss_count++;
+    }
+
+  if(e != NULL)
+    {
+      e->s    = *s;
+      e->seen = now;
+      HASH_ADD_STR(sessions, key, e);
+    }
+
+  pthread_mutex_unlock(&ss_lock);
+}
+
+/* @brief Drops the sessions idle for SS_IDLE_MS, at most once a sweep. */
+void ss_expire(long long now)
+{
+  struct session* e;
+  struct session* tmp;
+
+  if(__atomic_load_n(&ss_swept, __ATOMIC_RELAXED) + SS_SWEEP_MS > now)
+    return;
+
+  pthread_mutex_lock(&ss_lock);
+
+  ss_swept = now;
+
+  HASH_ITER(hh, sessions, e, tmp)
+    {
+      if(e->seen + SS_IDLE_MS > now)
+        break;
+
+      HASH_DEL(sessions, e);
+      free(e);
+      ss_count--;
+      ss_expired++;
+    }
+
+  pthread_mutex_unlock(&ss_lock);
+}
+
+void ss_stats(FILE* file)
+{
+  if(ss_count == 0 && ss_expired == 0)
+    return;
+
+  fprintf(file, "sessions: %llu resumed, %llu expired, %u live\n",
+          ss_resumed, ss_expired, ss_count);
+}
@@ -0,0 +1,48 @@
+/*********************************************************************/
+/* @file session.h                                                   */
+/*                                                                   */
+/* @brief Interfaces for session.c, the table of what each player    */
+/*        has learned about its link, kept across its connections.   */
+/*********************************************************************/
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <netinet/in.h>
+
+#include "uthash.h"
+#include "est.h"
+#include "manifest.h"
+
+#define SS_IDLE_MS  60000   // ms a session is kept after it was last used
+#define SS_SWEEP_MS 1000    // ms between sweeps for idle sessions
+#define SS_KEY_LEN  (8 + MF_PATH_LEN)
+
+/* A client's adaptation state for one video */
+struct ss_state {
+  struct est est;
+  unsigned long long avg_tput;
+  unsigned long long current_best;
+  int bitrate;                 // Of its last fragment
+  long long buffer;            // ms its player is taken to hold,
+  long long buf_at;            // as of this ms
+};
+
+/* Sessions are keyed by client address and video path, so a player  */
+/* that watches two videos has two.                                  */
+struct session {
+  char key[SS_KEY_LEN];
+  struct ss_state s;
+  long long seen;              // ms it was last saved
+  UT_hash_handle hh;           // In order of use, least recent first
+};
+
+void ss_key   (char* key, in_addr_t ip, const char* path);
+bool ss_load  (in_addr_t ip, const char* path, struct ss_state* s);
+void ss_save  (in_addr_t ip, const char* path, const struct ss_state* s,
+               long long now);
+void ss_expire(long long now);
+void ss_stats (FILE* file);
+
+#endif
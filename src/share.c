@@ -0,0 +1,133 @@
+/*********************************************************************/
+/* @file share.c                                                     */
+/*                                                                   */
+/* @brief Fair allocation among clients behind the same origin. The  */
+/*        clients of one origin are taken to share its link, so what */
+/*        each measures depends on what the others do; left alone   */
+/*        they chase each other up and down the ladder.              */
+/*                                                                   */
+/*        Each group measures its link as the bytes fragments bring  */
+/*        over the time at least one fragment is in flight, which is */
+/*        the link's rate whether the fetches overlap or not. Every  */
+/*        SH_PERIOD_MS the capacity so measured is divided equally   */
+/*        among the clients that fetched a fragment in the last      */
+/*        SH_ACTIVE_MS, and no client is given a bitrate above its   */
+/*        share.                                                     */
+/*                                                                   */
+/*        Groups are shared by every worker under one mutex and are  */
+/*        never freed, so clients keep pointers to theirs.           */
+/*********************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "share.h"
+
+static struct sh_group* groups = NULL;
+static pthread_mutex_t  sh_lock = PTHREAD_MUTEX_INITIALIZER;
+static long long        sh_ticked;
+
+/*******************************************************************/
+/* @brief Records a fragment the client with session key fetched   */
+/*        from the origin at ip, in flight from start to end (ns). */
+/* @returns the origin's group, NULL if it cannot be made.         */
+/*******************************************************************/
+struct sh_group* sh_sample(in_addr_t ip, const char* key, size_t bytes,
+                           unsigned long long start,
+                           unsigned long long end, long long now)
+{
+  struct sh_group*  g;
+  struct sh_member* m;
+
+  pthread_mutex_lock(&sh_lock);
+
+  HASH_FIND(hh, groups, &ip, sizeof(in_addr_t), g);
+  if(g == NULL)
+    {
+      if((g = calloc(1, sizeof(struct sh_group))) == NULL)
+        {
+          pthread_mutex_unlock(&sh_lock);
+          return NULL;
+        }
+
+      g->ip = ip;
+      HASH_ADD(hh, groups, ip, sizeof(in_addr_t), g);
+    }
+
+  /* Only the part not overlapping fetches already counted is busy */
+  if(start >= g->busy_until)
+    g->busy += end - start;
+  else if(end > g->busy_until)
+    g->busy += end - g->busy_until;
+
+  if(end > g->busy_until)
+    g->busy_until = end;
+  g->bytes += bytes;
+
+  HASH_FIND_STR(g->members, key, m);
+  if(m == NULL && (m = malloc(sizeof(struct sh_member))) != NULL)
+    {
+      strcpy(m->key, key);
+      HASH_ADD_STR(g->members, key, m);
+    }
+  if(m != NULL)
+    m->seen = now;
+
+  pthread_mutex_unlock(&sh_lock);
+  return g;
+}
+
+/* @returns the bitrate (Kbps) each client of g may have, 0 for any. */
+unsigned long long sh_share(struct sh_group* g)
+{
+  return g == NULL ? 0 : __atomic_load_n(&g->share, __ATOMIC_RELAXED);
+}
+
+/* @brief Reallocates every group, at most once a period. */
+void sh_tick(long long now)
+{
+  struct sh_group*  g;
+  struct sh_member* m;
+  struct sh_member* tmp;
+  double sample;
+  unsigned int n;
+
+  if(__atomic_load_n(&sh_ticked, __ATOMIC_RELAXED) + SH_PERIOD_MS > now)
+    return;
+
+  pthread_mutex_lock(&sh_lock);
+
+  if(sh_ticked + SH_PERIOD_MS > now)
+    {
+      pthread_mutex_unlock(&sh_lock);
+      return;
+    }
+  sh_ticked = now;
+
+  for(g = groups; g != NULL; g = g->hh.next)
+    {
+      if(g->busy > 0)
+        {
+          sample = (double) g->bytes * 8 * 1000000 / g->busy;
+          g->capacity = g->capacity == 0 ? sample :
+                        SH_ALPHA * sample + (1 - SH_ALPHA) * g->capacity;
+          g->busy  = 0;
+          g->bytes = 0;
+        }
+
+      HASH_ITER(hh, g->members, m, tmp)
+        if(m->seen + SH_ACTIVE_MS <= now)
+          {
+            HASH_DEL(g->members, m);
+            free(m);
+          }
+
+      n = HASH_COUNT(g->members);
+      __atomic_store_n(&g->share,
+                       n > 0 ? (unsigned long long) (g->capacity / n) : 0,
+                       __ATOMIC_RELAXED);
+    }
+
+  pthread_mutex_unlock(&sh_lock);
+}
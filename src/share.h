@@ -0,0 +1,44 @@
+/*********************************************************************/
+/* @file share.h                                                     */
+/*                                                                   */
+/* @brief Interfaces for share.c, which splits the capacity of each  */
+/*        origin's link fairly among the clients fetching from it.   */
+/*********************************************************************/
+#ifndef SHARE_H
+#define SHARE_H
+
+#include <netinet/in.h>
+
+#include "uthash.h"
+#include "session.h"
+
+#define SH_PERIOD_MS 1000    // ms between allocations
+#define SH_ACTIVE_MS 10000   // ms a client counts after its last fragment
+#define SH_ALPHA     0.3     // Weight of a period's capacity sample
+
+/* A client fetching from a group's origin */
+struct sh_member {
+  char key[SS_KEY_LEN];        // Its session's
+  long long seen;              // ms of its last fragment
+  UT_hash_handle hh;
+};
+
+/* The clients behind one origin, taken to share one bottleneck */
+struct sh_group {
+  in_addr_t ip;                // Key
+  unsigned long long busy;     // ns some fragment was in flight, this
+  unsigned long long bytes;    // period, and the bytes fragments brought
+  unsigned long long busy_until;   // ns the last fragment ended
+  double capacity;             // Kbps the link carries when busy
+  unsigned long long share;    // Kbps each member may have, 0 for any
+  struct sh_member* members;
+  UT_hash_handle hh;
+};
+
+struct sh_group* sh_sample(in_addr_t ip, const char* key, size_t bytes,
+                           unsigned long long start,
+                           unsigned long long end, long long now);
+unsigned long long sh_share(struct sh_group* g);
+void sh_tick(long long now);
+
+#endif
@@ -0,0 +1,138 @@
+/*********************************************************************/
+/* @file upstream.c                                                  */
+/*                                                                   */
+/* @brief Idle keep-alive connections to video origins. A client     */
+/*        leaving on a clean response boundary hands its server      */
+/*        connection back here, and the next client for the same     */
+/*        origin takes it instead of paying for a new handshake.     */
+/*        Every worker has its own pool, so none of this is locked.  */
+/*********************************************************************/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "upstream.h"
+
+void up_init(struct upstreams* u, int max_idle, long long idle_ms)
+{
+  memset(u, 0, sizeof(struct upstreams));
+  u->max_idle = max_idle;
+  u->idle_ms  = idle_ms;
+}
+
+/* An idle connection is usable if the origin has neither closed it */
+/* nor sent anything on it.                                         */
+static bool up_alive(int fd)
+{
+  char c;
+
+  return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == -1 &&
+         (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/********************************************************************/
+/* @brief Checks out an idle connection to ip, closing any stale    */
+/*        ones found on the way.                                    */
+/* @returns the connected socket, -1 if there is none.              */
+/********************************************************************/
+int up_get(struct upstreams* u, in_addr_t ip)
+{
+  struct origin*    o;
+  struct idle_conn* c;
+  int fd;
+
+  HASH_FIND_INT(u->origins, &ip, o);
+  if(o == NULL)
+    return -1;
+
+  while((c = o->idle) != NULL)
+    {
+      o->idle = c->next;
+      o->nidle--;
+      u->nidle--;
+
+      fd = c->fd;
+      free(c);
+
+      if(up_alive(fd))
+        return fd;
+
+      close(fd);
+    }
+
+  return -1;
+}
+
+/******************************************************************/
+/* @brief Returns a connection to ip to the pool.                 */
+/* @returns true if it was kept, false if the caller must close   */
+/*          it (pooling disabled or the origin is at max_idle).   */
+/******************************************************************/
+bool up_put(struct upstreams* u, in_addr_t ip, int fd, long long now)
+{
+  struct origin*    o;
+  struct idle_conn* c;
+
+  if(u->max_idle <= 0)
+    return false;
+
+  HASH_FIND_INT(u->origins, &ip, o);
+  if(o == NULL)
+    {
+      if((o = calloc(1, sizeof(struct origin))) == NULL)
+        return false;
+      o->ip = ip;
+      HASH_ADD_INT(u->origins, ip, o);
+    }
+
+  if(o->nidle >= u->max_idle || (c = malloc(sizeof(struct idle_conn))) == NULL)
+    return false;
+
+  c->fd    = fd;
+  c->since = now;
+  c->next  = o->idle;
+  o->idle  = c;
+  o->nidle++;
+  u->nidle++;
+
+  return true;
+}
+
+/***************************************************************/
+/* @brief Closes connections idle for longer than idle_ms. The */
+/*        pool is walked at most once a second.                */
+/***************************************************************/
+void up_sweep(struct upstreams* u, long long now)
+{
+  struct origin*     o;
+  struct origin*     tmp;
+  struct idle_conn** link;
+  struct idle_conn*  c;
+
+  if(now < u->next_sweep)
+    return;
+  u->next_sweep = now + 1000;
+
+  HASH_ITER(hh, u->origins, o, tmp)
+    {
+      link = &o->idle;
+
+      while((c = *link) != NULL)
+        {
+          if(now - c->since < u->idle_ms)
+            {
+              link = &c->next;
+              continue;
+            }
+
+          *link = c->next;
+          o->nidle--;
+          u->nidle--;
+          close(c->fd);
+          free(c);
+        }
+    }
+}
@@ -0,0 +1,45 @@
+/*********************************************************************/
+/* @file upstream.h                                                  */
+/*                                                                   */
+/* @brief Interfaces for upstream.c, the per-worker pool of idle     */
+/*        keep-alive connections to video origins.                   */
+/*********************************************************************/
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <stdbool.h>
+#include <netinet/in.h>
+
+#include "uthash.h"
+
+#define UP_MAX_IDLE  8       // Default idle connections kept per origin
+#define UP_IDLE_MS   15000   // Default ms an idle connection is kept
+
+struct idle_conn {
+  int fd;
+  long long since;           // When it went idle (ms)
+  struct idle_conn* next;
+};
+
+/* The idle connections to one origin, most recently used first */
+struct origin {
+  in_addr_t ip;
+  struct idle_conn* idle;
+  int nidle;
+  UT_hash_handle hh;
+};
+
+struct upstreams {
+  struct origin* origins;    // Hash of origins by ip
+  int max_idle;              // Per origin; 0 disables pooling
+  long long idle_ms;
+  int nidle;                 // Idle connections across all origins
+  long long next_sweep;      // When up_sweep next looks for stale ones
+};
+
+void up_init (struct upstreams* u, int max_idle, long long idle_ms);
+int  up_get  (struct upstreams* u, in_addr_t ip);
+bool up_put  (struct upstreams* u, in_addr_t ip, int fd, long long now);
+void up_sweep(struct upstreams* u, long long now);
+
+#endif
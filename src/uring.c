@@ -0,0 +1,347 @@
+/*********************************************************************/
+/* @file uring.c                                                     */
+/*                                                                   */
+/* @brief Just enough io_uring for the proxy: ring setup through the */
+/*        raw syscalls, SQE helpers for multishot accept/recv/poll,  */
+/*        linked sends, fd cancellation, and a provided buffer ring  */
+/*        that multishot recv picks its buffers from.                */
+/*********************************************************************/
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int sys_setup(unsigned entries, struct io_uring_params* p)
+{
+  return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags,
+                     void* arg, size_t argsz)
+{
+  return (int) syscall(__NR_io_uring_enter, fd, submit, wait, flags,
+                       arg, argsz);
+}
+
+static int sys_register(int fd, unsigned op, void* arg, unsigned nargs)
+{
+  return (int) syscall(__NR_io_uring_register, fd, op, arg, nargs);
+}
+
+/*******************************************************************/
+/* @brief Sets up a ring and registers nbufs provided buffers of   */
+/*        buf_size bytes each in buffer group UR_BGID.             */
+/* @returns 0 on success, -1 (with errno set) otherwise.           */
+/*******************************************************************/
+int uring_init(struct uring* r, unsigned entries, unsigned nbufs,
+               unsigned buf_size)
+{
+  struct io_uring_params   p;
+  struct io_uring_buf_reg  reg;
+  char* sq; char* cq;
+  unsigned i;
+
+  memset(r, 0, sizeof(struct uring));
+  memset(&p, 0, sizeof(p));
+  r->fd = -1;
+
+  if((r->fd = sys_setup(entries, &p)) == -1)
+    return -1;
+
+  /* Multishot recv with provided buffers and timed waits need both */
+  if(!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+     !(p.features & IORING_FEAT_EXT_ARG))
+    {
+      close(r->fd);
+      errno = ENOSYS;
+      return -1;
+    }
+
+  r->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if(r->cq_ring_sz > r->sq_ring_sz)
+    r->sq_ring_sz = r->cq_ring_sz;
+  r->cq_ring_sz = r->sq_ring_sz;
+
+  r->sq_ring = mmap(NULL, r->sq_ring_sz, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if(r->sq_ring == MAP_FAILED)
+    goto fail;
+  r->cq_ring = r->sq_ring;
+
+  r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if(r->sqes == MAP_FAILED)
+    goto fail;
+
+  sq = r->sq_ring;
+  cq = r->cq_ring;
+
+  r->sq_khead   = (unsigned *)(sq + p.sq_off.head);
+  r->sq_ktail   = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask    = *(unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array   = (unsigned *)(sq + p.sq_off.array);
+  r->sq_entries = p.sq_entries;
+  r->sq_tail    = *r->sq_ktail;
+
+  r->cq_khead   = (unsigned *)(cq + p.cq_off.head);
+  r->cq_ktail   = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask    = *(unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes       = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  /* The provided buffer ring and the buffers behind it */
+  r->nbufs    = nbufs;
+  r->buf_size = buf_size;
+  r->br_sz    = nbufs * sizeof(struct io_uring_buf);
+
+  r->br = mmap(NULL, r->br_sz, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(r->br == MAP_FAILED)
+    goto fail;
+
+  if((r->bufs = malloc((size_t) nbufs * buf_size)) == NULL)
+    goto fail;
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr    = (uint64_t)(uintptr_t) r->br;
+  reg.ring_entries = nbufs;
+  reg.bgid         = UR_BGID;
+
+  if(sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    goto fail;
+
+  r->br->tail = 0;
+  for(i = 0; i < nbufs; i++)
+    uring_buf_recycle(r, i);
+
+  return 0;
+
+ fail:
+  uring_exit(r);
+  return -1;
+}
+
+void uring_exit(struct uring* r)
+{
+  int saved = errno;
+
+  if(r->bufs != NULL)
+    free(r->bufs);
+  if(r->br != NULL && r->br != MAP_FAILED)
+    munmap(r->br, r->br_sz);
+  if(r->sqes != NULL && r->sqes != MAP_FAILED)
+    munmap(r->sqes, r->sqes_sz);
+  if(r->sq_ring != NULL && r->sq_ring != MAP_FAILED)
+    munmap(r->sq_ring, r->sq_ring_sz);
+  if(r->fd >= 0)
+    close(r->fd);
+
+  memset(r, 0, sizeof(struct uring));
+  r->fd = -1;
+  errno = saved;
+}
+
+/***********************************************************/
+/* @brief Returns a zeroed SQE to fill in, submitting the  */
+/*        queued ones first if the queue is full.          */
+/***********************************************************/
+struct io_uring_sqe* uring_sqe(struct uring* r)
+{
+  struct io_uring_sqe* sqe;
+  unsigned head = __atomic_load_n(r->sq_khead, __ATOMIC_ACQUIRE);
+
+  if(r->sq_tail - head >= r->sq_entries)
+    {
+      uring_submit(r);
+      head = __atomic_load_n(r->sq_khead, __ATOMIC_ACQUIRE);
+      if(r->sq_tail - head >= r->sq_entries)
+        return NULL;
+    }
+
+  sqe = &r->sqes[r->sq_tail & r->sq_mask];
+  r->sq_array[r->sq_tail & r->sq_mask] = r->sq_tail & r->sq_mask;
+  r->sq_tail++;
+
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  return sqe;
+}
+
+static unsigned uring_flush(struct uring* r)
+{
+  unsigned ktail = *r->sq_ktail;
+  __atomic_store_n(r->sq_ktail, r->sq_tail, __ATOMIC_RELEASE);
+  return r->sq_tail - ktail;
+}
+
+/*****************************************************/
+/* @brief Hands every queued SQE to the kernel.      */
+/* @returns number submitted, -1 on error.           */
+/*****************************************************/
+int uring_submit(struct uring* r)
+{
+  unsigned n = uring_flush(r);
+
+  if(n == 0)
+    return 0;
+
+  return sys_enter(r->fd, n, 0, 0, NULL, 0);
+}
+
+/*******************************************************************/
+/* @brief Submits queued SQEs and waits for at least one completion */
+/* @param timeout_ms  -1 to wait indefinitely.                      */
+/* @returns 0 on success, -1 on error or timeout (errno ETIME).     */
+/*******************************************************************/
+int uring_wait(struct uring* r, int timeout_ms)
+{
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec      ts;
+  unsigned n = uring_flush(r);
+
+  /* Completions are already waiting, only submit */
+  if(uring_peek(r) != NULL)
+    {
+      if(n > 0 && sys_enter(r->fd, n, 0, 0, NULL, 0) < 0)
+        return -1;
+      return 0;
+    }
+
+  memset(&arg, 0, sizeof(arg));
+  if(timeout_ms >= 0)
+    {
+      ts.tv_sec  = timeout_ms / 1000;
+      ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+      arg.ts     = (uint64_t)(uintptr_t) &ts;
+    }
+
+  if(sys_enter(r->fd, n, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+               &arg, sizeof(arg)) < 0)
+    return -1;
+
+  return 0;
+}
+
+/* @brief Returns the oldest unconsumed completion, or NULL. */
+struct io_uring_cqe* uring_peek(struct uring* r)
+{
+  unsigned head = *r->cq_khead;
+  unsigned tail = __atomic_load_n(r->cq_ktail, __ATOMIC_ACQUIRE);
+
+  if(head == tail)
+    return NULL;
+
+  return &r->cqes[head & r->cq_mask];
+}
+
+/* @brief Marks the completion returned by uring_peek as consumed. */
+void uring_cq_advance(struct uring* r)
+{
+  __atomic_store_n(r->cq_khead, *r->cq_khead + 1, __ATOMIC_RELEASE);
+}
+
+/* @brief Returns the memory of provided buffer bid. */
+char* uring_buf(struct uring* r, int bid)
+{
+  return r->bufs + (size_t) bid * r->buf_size;
+}
+
+/*********************************************************/
+/* @brief Gives buffer bid back to the kernel so recv    */
+/*        can pick it again.                             */
+/*********************************************************/
+void uring_buf_recycle(struct uring* r, int bid)
+{
+  unsigned short tail = r->br->tail;
+  struct io_uring_buf* buf = &r->br->bufs[tail & (r->nbufs - 1)];
+
+  buf->addr = (uint64_t)(uintptr_t) uring_buf(r, bid);
+  buf->len  = r->buf_size;
+  buf->bid  = (unsigned short) bid;
+
+  __atomic_store_n(&r->br->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+  r->bufs_free++;
+}
+
+void uring_prep_accept_multi(struct io_uring_sqe* sqe, int fd, uint64_t data)
+{
+  sqe->opcode    = IORING_OP_ACCEPT;
+  sqe->fd        = fd;
+  sqe->ioprio    = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = data;
+}
+
+void uring_prep_recv_multi(struct io_uring_sqe* sqe, int fd, uint64_t data)
+{
+  sqe->opcode    = IORING_OP_RECV;
+  sqe->fd        = fd;
+  sqe->ioprio    = IORING_RECV_MULTISHOT;
+  sqe->flags     = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = UR_BGID;
+  sqe->user_data = data;
+}
+
+/**************************************************************/
+/* @brief Prepares a send of len bytes. With link set, the    */
+/*        next SQE only starts once this one has completed,   */
+/*        which keeps a chain of sends on one socket ordered. */
+/**************************************************************/
+void uring_prep_send(struct io_uring_sqe* sqe, int fd, char* buf, int len,
+                     uint64_t data, bool link)
+{
+  sqe->opcode    = IORING_OP_SEND;
+  sqe->fd        = fd;
+  sqe->addr      = (uint64_t)(uintptr_t) buf;
+  sqe->len       = (unsigned) len;
+  sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+  sqe->flags     = link ? IOSQE_IO_LINK : 0;
+  sqe->user_data = data;
+}
+
+void uring_prep_poll_multi(struct io_uring_sqe* sqe, int fd, uint64_t data)
+{
+  sqe->opcode        = IORING_OP_POLL_ADD;
+  sqe->fd            = fd;
+  sqe->poll32_events = POLLIN;
+  sqe->len           = IORING_POLL_ADD_MULTI;
+  sqe->user_data     = data;
+}
+
+/* @brief Prepares a one-shot poll for fd becoming writable. */
+void uring_prep_poll_out(struct io_uring_sqe* sqe, int fd, uint64_t data)
+{
+  sqe->opcode        = IORING_OP_POLL_ADD;
+  sqe->fd            = fd;
+  sqe->poll32_events = POLLOUT;
+  sqe->user_data     = data;
+}
+
+/* @brief Cancels every request still pending on fd. */
+void uring_prep_cancel_fd(struct io_uring_sqe* sqe, int fd, uint64_t data)
+{
+  sqe->opcode       = IORING_OP_ASYNC_CANCEL;
+  sqe->fd           = fd;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  sqe->user_data    = data;
+}
+
+/******************************************************************/
+/* @brief Prepares a connect. addr must stay valid until the      */
+/*        connect completes.                                      */
+/******************************************************************/
+void uring_prep_connect(struct io_uring_sqe* sqe, int fd,
+                        struct sockaddr* addr, socklen_t len, uint64_t data)
+{
+  sqe->opcode    = IORING_OP_CONNECT;
+  sqe->fd        = fd;
+  sqe->addr      = (uint64_t)(uintptr_t) addr;
+  sqe->off       = len;
+  sqe->user_data = data;
+}
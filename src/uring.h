@@ -0,0 +1,89 @@
+/*********************************************************************/
+/* @file uring.h                                                     */
+/*                                                                   */
+/* @brief Interfaces for uring.c, a minimal io_uring wrapper (no     */
+/*        liburing needed) used by the proxy's completion backend.   */
+/*********************************************************************/
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+/* Operations encoded in the low bits of a SQE's user_data, next to */
+/* the pointer of the event handle the operation belongs to.        */
+#define UR_ACCEPT  1
+#define UR_RECV    2
+#define UR_SEND    3
+#define UR_POLL    4
+#define UR_CANCEL  5
+#define UR_CONNECT 6
+#define UR_WRITE   7   // One-shot poll for a socket with queued output
+
+#define UR_OPMASK  0x7ULL
+#define UR_DATA(ptr, op)  ((uint64_t)(uintptr_t)(ptr) | (op))
+#define UR_PTR(data)      ((void *)(uintptr_t)((data) & ~UR_OPMASK))
+#define UR_OP(data)       ((int)((data) & UR_OPMASK))
+
+#define UR_ENTRIES 4096   // Submission queue depth
+#define UR_NBUFS   1024   // Provided receive buffers (power of two)
+#define UR_BGID    1      // Buffer group of the provided buffers
+
+struct uring {
+  int fd;
+
+  /* Submission queue */
+  unsigned* sq_khead;
+  unsigned* sq_ktail;
+  unsigned  sq_mask;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  unsigned  sq_tail;      // Local tail, published by uring_submit
+  unsigned  sq_entries;
+
+  /* Completion queue */
+  unsigned* cq_khead;
+  unsigned* cq_ktail;
+  unsigned  cq_mask;
+  struct io_uring_cqe* cqes;
+
+  void*  sq_ring;  size_t sq_ring_sz;
+  void*  cq_ring;  size_t cq_ring_sz;
+  size_t sqes_sz;
+
+  /* Provided buffer ring for multishot recv */
+  struct io_uring_buf_ring* br;
+  size_t   br_sz;
+  char*    bufs;
+  unsigned nbufs;
+  unsigned buf_size;
+  unsigned bufs_free;    // Buffers currently owned by the kernel
+};
+
+int   uring_init(struct uring* r, unsigned entries, unsigned nbufs,
+                 unsigned buf_size);
+void  uring_exit(struct uring* r);
+struct io_uring_sqe* uring_sqe(struct uring* r);
+int   uring_submit(struct uring* r);
+int   uring_wait(struct uring* r, int timeout_ms);
+struct io_uring_cqe* uring_peek(struct uring* r);
+void  uring_cq_advance(struct uring* r);
+
+char* uring_buf(struct uring* r, int bid);
+void  uring_buf_recycle(struct uring* r, int bid);
+
+void uring_prep_accept_multi(struct io_uring_sqe* sqe, int fd,
+                             uint64_t data);
+void uring_prep_recv_multi(struct io_uring_sqe* sqe, int fd, uint64_t data);
+void uring_prep_send(struct io_uring_sqe* sqe, int fd, char* buf, int len,
+                     uint64_t data, bool link);
+void uring_prep_poll_multi(struct io_uring_sqe* sqe, int fd, uint64_t data);
+void uring_prep_poll_out(struct io_uring_sqe* sqe, int fd, uint64_t data);
+void uring_prep_cancel_fd(struct io_uring_sqe* sqe, int fd, uint64_t data);
+void uring_prep_connect(struct io_uring_sqe* sqe, int fd,
+                        struct sockaddr* addr, socklen_t len, uint64_t data);
+
+#endif